@@ -1,10 +1,17 @@
-local coroutine = require("taggedcoro").fortag("exception")
+local tc = require "taggedcoro"
+local coroutine = tc.fortag("exception")
 
 local ex = {}
 
+-- the non-local returns of taggedcoro.nlrret are errors that have to
+-- go through a trycatch
+local isnlr = tc.isnlr or function () return false end
+
 local function trycatchk(cblk, co, ok, ...)
   if ok and coroutine.status(co) == "dead" then
       return ...
+  elseif not ok and isnlr((...)) then
+    error((...), 0)
   else
     local resume
     if ok then
@@ -19,13 +26,89 @@ local function trycatchk(cblk, co, ok, ...)
   end
 end
 
+-- Exception classes are tags, and a trycatch with a table of handlers
+-- runs its block in a coroutine tagged with the set of its classes. Sets
+-- and classes share an __eq that makes a set equal to the classes it
+-- handles and their subclasses, so a throw yields straight to the
+-- nearest trycatch that has a handler for it.
+
+local classmt, setmt = {}, {}
+
+local function isclass(v)
+  return type(v) == "table" and getmetatable(v) == classmt
+end
+
+-- the handler of set for class c or its nearest ancestor
+local function lookup(set, c)
+  while c do
+    local h = set.handlers[c]
+    if h then return h end
+    c = c.parent
+  end
+end
+
+local function eq(a, b)
+  if isclass(b) then a, b = b, a end
+  return isclass(a) and getmetatable(b) == setmt and lookup(b, a) ~= nil
+end
+
+classmt.__eq, setmt.__eq = eq, eq
+
+classmt.__tostring = function (c)
+  return "exception class " .. tostring(c.name)
+end
+
+-- ex.class(name[, parent]) creates an exception class; it is also the
+-- metatable of its instances
+function ex.class(name, parent)
+  local c = setmetatable({ name = name, parent = parent }, classmt)
+  c.__index = c
+  return c
+end
+
+local function classof(e)
+  if isclass(e) then return e end
+  local mt = type(e) == "table" and getmetatable(e)
+  if isclass(mt) then return mt end
+end
+
+local function dispatch(set, co, ok, e, ...)
+  if not ok then
+    error(e, 0)
+  elseif tc.status(co) == "dead" then
+    return e, ...
+  end
+  local resume = function (v)
+    return dispatch(set, co, tc.resume(co, v))
+  end
+  local traceback = function (msg)
+    return tc.traceback(co, msg)
+  end
+  return lookup(set, classof(e))(resume, traceback, e, ...)
+end
+
+-- ex.trycatch(tblk, cblk) catches every untyped throw in cblk, and
+-- ex.trycatch(tblk, { [class] = handler, ... }) only the throws of those
+-- classes and their subclasses, with the handler of the nearest class;
+-- other throws and errors go past it without stopping
 function ex.trycatch(tblk, cblk)
+  if type(cblk) == "table" then
+    local set = setmetatable({ handlers = cblk }, setmt)
+    local co = tc.create(set, tblk)
+    return dispatch(set, co, tc.resume(co))
+  end
   local co = coroutine.create(tblk)
   return trycatchk(cblk, co, coroutine.resume(co))
 end
 
-function ex.throw(...)
-  return coroutine.yield(...)
+-- throws to the class of e when e is a class or one of its instances,
+-- and to the untyped handlers otherwise
+function ex.throw(e, ...)
+  local c = classof(e)
+  if c then
+    return tc.yield(c, e, ...)
+  end
+  return coroutine.yield(e, ...)
 end
 
 return ex
@@ -1,13 +1,90 @@
 local coroutine = require("taggedcoro").fortag("iterator")
 
+local unpack = table.unpack or unpack
+
+local function pack(...)
+  return { n = select("#", ...), ... }
+end
+
 local iterator = {}
 
-function iterator.make(f)
-  return coroutine.wrap(f)
+-- buffers of batched iterators, by coroutine
+local batches = setmetatable({}, { __mode = "k" })
+
+local DONE = {}
+
+-- iterator.make(f, n) produces values in batches of up to n items: the
+-- producer only switches back to the consumer when the batch is full or
+-- it returns, and the consumer drains the batch without switching, so
+-- the items, the final results and any error come out in the same order.
+-- In batched mode produce returns nothing.
+function iterator.make(f, n)
+  if not n or n <= 1 then
+    return coroutine.wrap(f)
+  end
+  local b = { vals = {}, ns = {}, items = 0, top = 0, max = n }
+  local co = coroutine.create(function (...)
+    return DONE, f(...)
+  end)
+  batches[co] = b
+  local item, pos, results, err = 0, 0
+  local function finish(ok, marker, ...)
+    if not ok then
+      err = { marker }
+    elseif marker == DONE then
+      results = pack(...)
+    end
+  end
+  return function (...)
+    if item == b.items then
+      item, pos, b.items, b.top = 0, 0, 0, 0
+      if not (results or err) then
+        finish(pcall(coroutine.call, co, ...))
+      end
+      if b.items == 0 then -- nothing left but the outcome of the producer
+        local res, e = results, err
+        results, err = nil, nil
+        if e then
+          error(e[1], 0)
+        elseif res then
+          return unpack(res, 1, res.n)
+        end
+      end
+    end
+    item = item + 1
+    local k = b.ns[item]
+    pos = pos + k
+    return unpack(b.vals, pos - k + 1, pos)
+  end
+end
+
+local function handler()
+  local co = coroutine.running()
+  while co and coroutine.tag(co) ~= "iterator" do
+    co = coroutine.parent(co)
+  end
+  return co and batches[co]
 end
 
 function iterator.produce(...)
-  return coroutine.yield(...)
+  local b = handler()
+  if not b then
+    return coroutine.yield(...)
+  end
+  if b.items == b.max then
+    coroutine.yield()
+  end
+  local n, vals, top = select("#", ...), b.vals, b.top
+  if n == 1 then
+    vals[top + 1] = ...
+  else
+    for i = 1, n do
+      vals[top + i] = (select(i, ...))
+    end
+  end
+  b.top = top + n
+  b.items = b.items + 1
+  b.ns[b.items] = n
 end
 
 return iterator
@@ -1,13 +1,103 @@
-local coroutine = require("taggedcoro").fortag("nlr")
+local tc = require "taggedcoro"
+local coroutine = tc.fortag("nlr")
 
 local nlr = {}
 
-function nlr.run(blk)
-  local co = coroutine.wrap(blk)
-  return co()
+local unpack = table.unpack or unpack
+local getinfo = debug.getinfo
+local pcall, xpcall = pcall, xpcall
+
+-- A return is an error value carrying the values to return when it can
+-- unwind straight to its run, and a yield of the run's coroutine
+-- otherwise, so a pcall or a coroutine between the two does not see it,
+-- as before. The runs take their coroutines from a pool, so a run that
+-- returns either way normally creates none.
+
+local isnlr, throw = tc.isnlr, tc.nlrret
+if not isnlr then
+  local token = {}
+  isnlr = function (e)
+    return type(e) == "table" and getmetatable(e) == token
+  end
+  throw = function (...)
+    error(setmetatable({ n = select("#", ...), ... }, token), 0)
+  end
+end
+
+local DONE = {}
+
+local idle, pooled = {}, setmetatable({}, { __mode = "k" })
+
+local function finish(ok, ...)
+  if ok then
+    return true, ...
+  end
+  local e = ...
+  if isnlr(e) then
+    return true, unpack(e, 1, e.n)
+  end
+  return false, e
+end
+
+-- runs one body after another, with a proper tail call per body
+local function loop(blk, ...)
+  return loop(coroutine.yield(DONE, finish(pcall(blk, ...))))
+end
+
+-- whether the running code is the body of a run with no pcall or
+-- coroutine between them; the frame under the body is the pcall of loop
+local function direct()
+  if not pooled[coroutine.running()] then
+    return false
+  end
+  local level, prev = 3
+  while true do
+    local info = getinfo(level, "f")
+    if not info then
+      return false
+    elseif info.func == loop then
+      return true
+    elseif prev == pcall or prev == xpcall then
+      return false
+    end
+    prev, level = info.func, level + 1
+  end
+end
+
+local function rethrow(ok, ...)
+  if not ok then
+    error((...), 0)
+  end
+  return ...
+end
+
+-- the coroutine of a run stays suspended and out of the pool when a
+-- return yields it
+local function result(co, ok, ...)
+  if not ok then
+    error((...), 0)
+  elseif (...) == DONE then
+    idle[#idle + 1] = co
+    return rethrow(select(2, ...))
+  end
+  return ...
+end
+
+function nlr.run(blk, ...)
+  local co = idle[#idle]
+  if co then
+    idle[#idle] = nil
+  else
+    co = coroutine.create(loop)
+    pooled[co] = true
+  end
+  return result(co, coroutine.resume(co, blk, ...))
 end
 
 function nlr.ret(...)
+  if direct() then
+    throw(...)
+  end
   coroutine.yield(...)
 end
 
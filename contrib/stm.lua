@@ -1,86 +1,648 @@
-local coroutine = require("taggedcoro").fortag("stm")
+local tc = require "taggedcoro"
+local coroutine = tc.fortag("stm")
 
-local thread = require "thread"
+-- green threads, for transactions that wait on local variables; only
+-- loaded when one does, so states that only use shared variables do not
+-- need them
+local thread
+local function threads()
+  thread = thread or require "thread"
+  return thread
+end
+
+-- backoff sleeps with the thread module (which counts milliseconds), or
+-- not at all without it
+local nosleep = false
+local function sleep(secs)
+  if nosleep then return end
+  local ok, mod = pcall(threads)
+  if ok and mod.sleep then
+    mod.sleep(secs * 1000)
+  else
+    nosleep = true
+  end
+end
 
 local stm = {}
 
+-- named variables
 local db = {}
 
-function stm.var(name, val)
+-- condition variables of the variables that retrying transactions wait on
+local cvs = setmetatable({}, { __mode = "k" })
+
+-- Values already read or written by a transaction, by the coroutine that
+-- runs it; gets of these are served without yielding to the handler.
+-- Values in a transaction never change under it, as the log fails any
+-- read that would see a newer commit.
+local caches = setmetatable({}, { __mode = "k" })
+
+local NIL = {}
+
+-- names of the named variables
+local names = setmetatable({}, { __mode = "k" })
+
+local stats = { commits = 0, aborts = 0, retries = 0, conflicts = {} }
+
+-- Variables and transaction logs come from the C implementation, with a
+-- global version clock and flat read and write sets; the pure Lua
+-- implementation gets the same interface on tables, without shared
+-- variables.
+
+local newvar, newtx = tc.tvar, tc.stmtx
+
+if not newvar then
+  local clock = 0
+
+  -- running snapshot logs, which hold back the old values they may read
+  local snapshots = setmetatable({}, { __mode = "k" })
+
+  local function oldest(wv)
+    for t in pairs(snapshots) do
+      if t.rv < wv then wv = t.rv end
+    end
+    return wv
+  end
+
+  local tx = {}
+  tx.__index = tx
+
+  -- old values are in var.old as { version, value }, newest first
+  newvar = function (val, kind, versions)
+    if kind == "shared" then
+      error("shared variables need the C implementation of taggedcoro")
+    end
+    return { value = val, version = 0, watchers = 0, depth = versions or 0, old = {} }
+  end
+
+  newtx = function (mode)
+    local t = setmetatable({ rv = clock, reads = {}, writes = {}, values = {} }, tx)
+    if mode == "snapshot" then
+      t.snapshot = true
+      snapshots[t] = true
+    end
+    return t
+  end
+
+  function tx:nest()
+    local child = newtx()
+    child.rv, child.parent, child.snapshot = self.rv, self, self.snapshot
+    return child
+  end
+
+  -- the newest value of var at the start of a snapshot
+  local function readat(self, var)
+    if var.version <= self.rv then
+      return true, var.value
+    end
+    for i = 1, #var.old do
+      if var.old[i][1] <= self.rv then
+        return true, var.old[i][2]
+      end
+    end
+    self.failed = var
+    snapshots[self] = nil
+    return false
+  end
+
+  -- moves the value of var into its history before a commit at wv
+  local function keepold(var, wv, old)
+    local hist = var.old
+    table.insert(hist, 1, { var.version, var.value })
+    hist[var.depth + 1] = nil
+    local succ, keep = wv, 0
+    while keep < #hist and succ > old do
+      keep = keep + 1
+      succ = hist[keep][1]
+    end
+    for i = #hist, keep + 1, -1 do
+      hist[i] = nil
+    end
+  end
+
+  function tx:read(var)
+    local t = self
+    while t do
+      if t.values[var] ~= nil then
+        return true, t.values[var].v
+      end
+      t = t.parent
+    end
+    if self.snapshot then
+      local ok, v = readat(self, var)
+      if ok then
+        self.reads[#self.reads + 1] = var
+      end
+      return ok, v
+    end
+    if var.version > self.rv then
+      self.failed = var
+      return false
+    end
+    self.reads[#self.reads + 1] = var
+    return true, var.value
+  end
+
+  function tx:write(var, val)
+    if self.snapshot then
+      error("snapshot transactions are read-only")
+    end
+    if self.values[var] == nil then
+      self.writes[#self.writes + 1] = var
+    end
+    self.values[var] = { v = val }
+  end
+
+  -- the reads of the transaction and of the ones enclosing it
+  local function allreads(self)
+    local reads, t = {}, self
+    while t do
+      for i = 1, #t.reads do
+        reads[#reads + 1] = t.reads[i]
+      end
+      t = t.parent
+    end
+    return reads
+  end
+
+  function tx:validate()
+    local reads = allreads(self)
+    for i = 1, #reads do
+      if reads[i].version > self.rv then
+        return false, reads[i]
+      end
+    end
+    return true
+  end
+
+  function tx:commit()
+    snapshots[self] = nil
+    if #self.writes == 0 then
+      return true
+    end
+    clock = clock + 1
+    local ok, bad = self:validate()
+    if not ok then
+      self.failed = bad
+      return false
+    end
+    local woken, old = {}, oldest(clock)
+    self.wv = clock
+    for i = 1, #self.writes do
+      local var = self.writes[i]
+      if var.depth > 0 then
+        keepold(var, clock, old)
+      end
+      var.value, var.version = self.values[var].v, clock
+      if var.watchers > 0 then
+        woken[#woken + 1] = var
+      end
+    end
+    return true, (table.unpack or unpack)(woken)
+  end
+
+  function tx:merge()
+    local parent = self.parent
+    for i = 1, #self.reads do
+      parent.reads[#parent.reads + 1] = self.reads[i]
+    end
+    for i = 1, #self.writes do
+      local var = self.writes[i]
+      parent:write(var, self.values[var].v)
+    end
+  end
+
+  function tx:extend()
+    if not self:validate() then
+      return false
+    end
+    local t = self
+    while t do
+      t.rv = clock
+      t = t.parent
+    end
+    return true
+  end
+
+  function tx:watch()
+    if not self.watched then
+      self.watched = allreads(self)
+      for i = 1, #self.watched do
+        self.watched[i].watchers = self.watched[i].watchers + 1
+      end
+    end
+    return self.watched
+  end
+
+  function tx:unwatch()
+    local watched = self.watched
+    if watched then
+      self.watched = nil
+      for i = 1, #watched do
+        watched[i].watchers = watched[i].watchers - 1
+      end
+    end
+  end
+
+  function tx:abort()
+    snapshots[self] = nil
+  end
+
+  function tx:shared()
+    return 0
+  end
+
+  function tx:logged()
+    return 0
+  end
+
+  function tx:size()
+    return #self.reads, #self.writes
+  end
+
+  function tx:writes()
+    local vals = {}
+    for i = 1, #self.writes do
+      vals[i] = self.values[self.writes[i]].v
+    end
+    return { (table.unpack or unpack)(self.writes) }, vals, self.wv or 0
+  end
+
+  function tx:conflict()
+    return self.failed
+  end
+end
+
+-- stm.var(name, val[, kind[, versions]]) creates a named variable and
+-- returns it; get and set take the variable itself or its name. Variables
+-- of kind "shared" live outside the Lua state and can be passed to other
+-- states (through taggedcoro.newstate or queues), where transactions on
+-- them run in parallel on other OS threads. A variable keeps up to
+-- versions old values (none by default) for snapshots that need them.
+function stm.var(name, val, kind, versions)
   if coroutine.isyieldable("stm") then
     return error("cannot create stm variable " .. name .. " inside a transaction")
   end
-  db[name] = { value = val, timestamp = 0, cv = thread.cv() }
+  local var = newvar(val, kind, versions)
+  db[name] = var
+  names[var] = name
+  return var
 end
 
-function stm.transaction(blk)
-  if coroutine.isyieldable() then
-    return blk()
+local function wake(ok, ...)
+  for i = 1, select("#", ...) do
+    local cv = cvs[(select(i, ...))]
+    if cv then
+      threads().signal(cv)
+    end
+  end
+  return ok
+end
+
+-- Durable variables: the writes to them of each commit go to a
+-- write-ahead log, as the names and values of the variables with the
+-- version of the commit; the log syncs them to disk in batches, and a
+-- transaction only returns once its batch is on disk. The variable
+-- itself carries its name and log, and the commit appends the record
+-- before it releases the variables, so the log has the writes to each
+-- variable in the order of their versions, and commits in other states
+-- log the writes to a shared durable variable too.
+
+local wal
+local recovered = {} -- newest values in the log, by name
+
+-- stm.open(path) opens the log at path and reads back what it holds;
+-- states that open the same path share the log and its batches
+function stm.open(path)
+  if not tc.wal then
+    error("durable variables need the C implementation of taggedcoro")
+  end
+  wal = assert(tc.wal(path))
+  recovered = {}
+  for data, version in wal:records() do
+    local names, vals, n = tc.decode(data)
+    for i = 1, n do
+      local r = recovered[names[i]]
+      if not r or r.version < version then
+        recovered[names[i]] = { version = version, value = vals[i] }
+      end
+    end
   end
-  local co = coroutine.wrap(function ()
+end
+
+-- stm.durable(name, val[, kind[, versions]]) is stm.var for a variable
+-- whose writes go to the log; it starts with the value the log has for
+-- name, if any, or with val. Other states need not open the log to
+-- commit to a shared durable variable.
+function stm.durable(name, val, kind, versions)
+  if not wal then
+    error("no stm log open")
+  end
+  local r = recovered[name]
+  if r then
+    val = r.value
+  end
+  local var = stm.var(name, val, kind, versions)
+  var:durable(name, wal)
+  return var
+end
+
+-- waits until the durable writes of a committed log are on disk; an
+-- async task first lets the other tasks in its run queue commit, so
+-- their writes go in the same batch, and goes back to its run queue
+-- while another thread flushes it
+local function synced(tx)
+  if tx:logged() == 0 then
+    return
+  end
+  local tag = tc.isyieldable("async") and "async" or nil
+  if tag then
+    tc.yield(tag)
+  end
+  tx:sync(tag)
+end
+
+local function cacheput(cache, var, v)
+  if v == nil then
+    cache[var] = NIL
+  else
+    cache[var] = v
+  end
+end
+
+local run
+
+-- Nested transactions are closed: each runs in its own coroutine with a
+-- log nested in the log of its parent, and with a cache that falls back
+-- to the cache of its parent. A nested transaction that ends merges both
+-- into its parent; one that fails or retries runs again on its own, as
+-- long as what its ancestors read is still current. It runs from inside
+-- the block of its parent, which only hands it its log and cache, so
+-- its errors and the yields of other tags go through the code around it
+-- there, like any call.
+
+-- runs blk once against a new log (nested in parent, if given), returns
+-- true if it committed or rolled back, or "abort" or "retry" and the
+-- log if it has to run again
+local function attempt(blk, parent, pcache, mode)
+  local co = coroutine.create(function ()
     blk()
     return "commit"
   end)
-  local tvars = {}
-  local request, name, val = co()
+  local tx = parent and parent:nest() or newtx(mode)
+  local cache = pcache and setmetatable({}, { __index = pcache }) or {}
+  caches[co] = cache
+  local function step(ok, ...)
+    if not ok then
+      tx:abort()
+      error((...), 0)
+    end
+    return ...
+  end
+  local request, var, val = step(coroutine.resume(co))
   while true do
     if request == "get" then
-      if not tvars[name] then
-        tvars[name] = { value = db[name].value, timestamp = db[name].timestamp, dirty = false }
+      local ok, v = tx:read(var)
+      if not ok then
+        return "abort", tx
       end
-      request, name, val = co(tvars[name].value)
+      cacheput(cache, var, v)
+      request, var, val = step(coroutine.resume(co, v))
+    elseif request == "getmany" then
+      for i = 1, #var do
+        local ok, v = tx:read(var[i])
+        if not ok then
+          return "abort", tx
+        end
+        cacheput(cache, var[i], v)
+      end
+      request, var, val = step(coroutine.resume(co))
     elseif request == "set" then
-      if not tvars[name] then
-        tvars[name] = { value = val, timestamp = db[name].timestamp, dirty = true }
-      else
-        tvars[name].value = val
-        tvars[name].dirty = true
+      tx:write(var, val)
+      cacheput(cache, var, val)
+      request, var, val = step(coroutine.resume(co))
+    elseif request == "setmany" then
+      for i = 1, #var do
+        tx:write(var[i], val[i])
+        cacheput(cache, var[i], val[i])
       end
-      request, name, val = co()
+      request, var, val = step(coroutine.resume(co))
     elseif request == "retry" then
-      for name, var in pairs(tvars) do
-        if db[name].timestamp > var.timestamp then
-          return stm.transaction(blk)
-        end
-      end
-      local cvs = {}
-      for name, _ in pairs(tvars) do
-        cvs[#cvs+1] = db[name].cv
+      -- waits until another thread writes a shared variable it read; an
+      -- async task lets the other tasks of its run queue run meanwhile
+      if tx:shared() > 0 then
+        tx:wait(tc.isyieldable("async") and "async" or nil)
+        return "retry", tx
       end
-      thread.yield("cvs", cvs)
-      return stm.transaction(blk)
-    elseif request == "commit" then
-      for name, var in pairs(tvars) do
-        if db[name].timestamp > var.timestamp then
-          return stm.transaction(blk)
+      local vars = tx:watch()
+      if tx:validate() then
+        local wait = {}
+        for i = 1, #vars do
+          local cv = cvs[vars[i]] or threads().cv()
+          cvs[vars[i]] = cv
+          wait[i] = cv
         end
+        threads().yield("cvs", wait)
       end
-      for name, var in pairs(tvars) do
-        if var.dirty then
-          db[name].value = var.value
-          db[name].timestamp = db[name].timestamp + 1
-        end
+      tx:unwatch()
+      return "retry", tx
+    elseif request == "nest" then
+      request, var, val = step(coroutine.resume(co, tx, cache))
+    elseif request == "restart" then -- from a nested transaction
+      return "abort", tx
+    elseif request == "commit" and parent then
+      tx:merge()
+      for k, v in pairs(cache) do
+        pcache[k] = v
       end
-      for name, var in pairs(tvars) do
-        if var.dirty then
-          thread.signal(db[name].cv)
-        end
+      return true
+    elseif request == "commit" then
+      if not wake(tx:commit()) then
+        return "abort", tx
       end
-      break
+      stats.commits = stats.commits + 1
+      synced(tx)
+      return true
     elseif request == "rollback" then
-      break
+      tx:abort()
+      return true
     else
       return error("invalid stm operation " .. request)
     end
   end
 end
 
-function stm.get(name)
-  return coroutine.yield("get", name)
+-- A contention manager decides how long a transaction that conflicted
+-- waits before it runs again: stm.manager(aborts, karma) gets the
+-- number of times in a row it aborted and its karma, the reads and
+-- writes of all its failed runs, and returns seconds to sleep (with the
+-- sleep of the thread module) or nil to run again at once.
+
+-- randomized exponential backoff, from base up to max seconds
+function stm.backoff(base, max)
+  base, max = base or 1e-5, max or 1e-2
+  return function (aborts)
+    local limit = math.min(max, base * 2 ^ math.min(aborts - 1, 30))
+    return limit * math.random()
+  end
+end
+
+-- backoff that shrinks as a transaction accumulates karma, so long
+-- transactions that keep losing to short ones get to run first
+function stm.karma(base, max, scale)
+  local backoff = stm.backoff(base, max)
+  scale = scale or 64
+  return function (aborts, karma)
+    return backoff(aborts) * scale / (scale + karma)
+  end
+end
+
+stm.manager = stm.karma()
+
+-- stm.stats() returns the counters of this state: commits, aborts and
+-- retries of transactions, and conflicts, a table from each variable
+-- (by name if it has one) to the aborts it caused
+function stm.stats()
+  local conflicts = {}
+  for var, n in pairs(stats.conflicts) do
+    conflicts[names[var] or var] = n
+  end
+  return { commits = stats.commits, aborts = stats.aborts,
+           retries = stats.retries, conflicts = conflicts }
 end
 
-function stm.set(name, val)
-  return coroutine.yield("set", name, val)
+function stm.resetstats()
+  stats = { commits = 0, aborts = 0, retries = 0, conflicts = {} }
+end
+
+-- runs blk until it commits or rolls back; a nested transaction gives
+-- up and returns false if its ancestors have to run again
+function run(blk, parent, pcache, mode)
+  local aborts, karma = 0, 0
+  while true do
+    local res, tx = attempt(blk, parent, pcache, mode)
+    if res == true then
+      return true
+    end
+    local reads, writes = tx:size()
+    tx:abort()
+    karma = karma + reads + writes
+    if res == "retry" then
+      stats.retries = stats.retries + 1
+    else
+      local var = tx:conflict()
+      stats.aborts = stats.aborts + 1
+      if var then
+        stats.conflicts[var] = (stats.conflicts[var] or 0) + 1
+      end
+    end
+    if parent and not parent:extend() then
+      return false
+    end
+    if res == "abort" and stm.manager then
+      aborts = aborts + 1
+      local secs = stm.manager(aborts, karma)
+      if secs and secs > 0 then
+        sleep(secs)
+      end
+    end
+  end
+end
+
+-- runs blk as a transaction nested in the one of the running block
+local function nest(blk)
+  local tx, cache = coroutine.yield("nest")
+  if not run(blk, tx, cache) then
+    coroutine.yield("restart")
+  end
+end
+
+function stm.transaction(blk)
+  if coroutine.isyieldable() then
+    return nest(blk)
+  end
+  run(blk)
+end
+
+-- stm.snapshot(blk) runs blk as a read-only transaction that reads every
+-- variable as it was when it started, so writers committing meanwhile
+-- do not make it run again, as long as the variables it reads keep
+-- enough old values; it cannot set variables. Inside another transaction
+-- it runs as a nested transaction. With the C implementation at most 256
+-- snapshots can run at once in the process; starting one more is an
+-- error.
+function stm.snapshot(blk)
+  if coroutine.isyieldable() then
+    return nest(blk)
+  end
+  run(blk, nil, nil, "snapshot")
+end
+
+local function tovar(var)
+  if type(var) == "string" then
+    return db[var] or error("no stm variable " .. var)
+  end
+  return var
+end
+
+-- the cache of the transaction running this code
+local function current()
+  local co = coroutine.running()
+  while co and coroutine.tag(co) ~= "stm" do
+    co = coroutine.parent(co)
+  end
+  return co and caches[co]
+end
+
+function stm.get(var)
+  var = tovar(var)
+  local cache = current()
+  local v = cache and cache[var]
+  if v == nil then
+    return coroutine.yield("get", var)
+  elseif v == NIL then
+    return nil
+  end
+  return v
+end
+
+-- stm.getmany{ var, ... } returns the values of the variables, reading
+-- the ones not in the cache with a single yield
+function stm.getmany(vars)
+  local cache = current()
+  local misses, res = {}, {}
+  for i = 1, #vars do
+    local var = tovar(vars[i])
+    res[i] = var
+    if not (cache and cache[var] ~= nil) then
+      misses[#misses + 1] = var
+    end
+  end
+  if #misses > 0 then
+    coroutine.yield("getmany", misses)
+  end
+  for i = 1, #vars do
+    local v = cache[res[i]]
+    if v == NIL then
+      v = nil
+    end
+    res[i] = v
+  end
+  return (table.unpack or unpack)(res, 1, #vars)
+end
+
+function stm.set(var, val)
+  return coroutine.yield("set", tovar(var), val)
+end
+
+-- stm.setmany{ [var] = val, ... } sets the variables with a single yield
+function stm.setmany(t)
+  local vars, vals = {}, {}
+  for var, val in pairs(t) do
+    vars[#vars + 1] = tovar(var)
+    vals[#vals + 1] = val
+  end
+  return coroutine.yield("setmany", vars, vals)
 end
 
 function stm.retry()
@@ -0,0 +1,422 @@
+local iterator = require "taggedcoro.iterator"
+local coroutine = require("taggedcoro").fortag("tee")
+
+local unpack = table.unpack or unpack
+
+local stream = {}
+
+local mt = { __index = {} }
+local methods = mt.__index
+
+-- items produced by generators before switching back to the consumer
+stream.batch = 64
+
+-- A stream is a source and a list of stages, and is only compiled when
+-- it runs: runs of pure stages become one chain of closures pulling from
+-- the stage before them, and only generators (sources and pipes that call
+-- stream.produce) get a coroutine, which produces in batches.
+
+local function new(source, stages)
+  return setmetatable({ source = source, stages = stages or {} }, mt)
+end
+
+local function append(s, stage)
+  local stages = {}
+  for i = 1, #s.stages do stages[i] = s.stages[i] end
+  stages[#stages + 1] = stage
+  return new(s.source, stages)
+end
+
+stream.produce = iterator.produce
+
+-- sources, functions that return a function that pulls the next item or nil
+
+function stream.range(i, j, step)
+  step = step or 1
+  return new(function ()
+    local k = i - step
+    return function ()
+      k = k + step
+      if (step > 0 and k <= j) or (step < 0 and k >= j) then
+        return k
+      end
+    end
+  end)
+end
+
+function stream.values(t)
+  return new(function ()
+    local k = 0
+    return function ()
+      k = k + 1
+      return t[k]
+    end
+  end)
+end
+
+-- a stream over a generic for iterator; it can only run once
+function stream.from(f, s, var)
+  return new(function ()
+    return function ()
+      var = f(s, var)
+      return var
+    end
+  end)
+end
+
+-- a stream over the records of a file as strings, read from a memory
+-- mapping with the C implementation; with slices, the records are slices
+-- of the mapping instead, which only have sub, byte, # and ..
+function stream.lines(path, delim, slices)
+  local tc = require "taggedcoro"
+  return new(function ()
+    if tc.mmap then
+      return assert(tc.mmap(path)):records(delim, not slices)
+    elseif delim and delim ~= "\n" then
+      error("records with other delimiters need the C implementation")
+    end
+    return io.lines(path)
+  end)
+end
+
+-- a stream over the items that f(...) produces with stream.produce
+function stream.generate(f, ...)
+  local n, args = select("#", ...), { ... }
+  return new(function ()
+    return iterator.make(function ()
+      f(unpack(args, 1, n))
+    end, stream.batch)
+  end)
+end
+
+-- stages, functions from the pull function of the stage before to a new one
+
+local function map(f)
+  return function (up)
+    return function ()
+      local v = up()
+      if v ~= nil then
+        return f(v)
+      end
+    end
+  end
+end
+
+local function compose(f, g)
+  return function (v)
+    v = f(v)
+    if v ~= nil then
+      return g(v)
+    end
+  end
+end
+
+local function filter(p)
+  return function (up)
+    return function ()
+      local v = up()
+      while v ~= nil and not p(v) do
+        v = up()
+      end
+      return v
+    end
+  end
+end
+
+local function take(n)
+  return function (up)
+    local count = 0
+    return function ()
+      if count < n then
+        count = count + 1
+        return up()
+      end
+    end
+  end
+end
+
+local function skip(n)
+  return function (up)
+    return function ()
+      while n > 0 do
+        n = n - 1
+        if up() == nil then return nil end
+      end
+      return up()
+    end
+  end
+end
+
+local function pipe(f)
+  return function (up)
+    return iterator.make(function () f(up) end, stream.batch)
+  end
+end
+
+function methods:map(f)
+  local last = self.stages[#self.stages]
+  if last and last.kind == "map" then -- fuse with the map before it
+    local s = append(self, { kind = "map", fn = compose(last.fn, f) })
+    table.remove(s.stages, #s.stages - 1)
+    return s
+  end
+  return append(self, { kind = "map", fn = f })
+end
+
+function methods:filter(p)
+  return append(self, { kind = "filter", fn = p })
+end
+
+function methods:take(n)
+  return append(self, { kind = "take", fn = n })
+end
+
+function methods:skip(n)
+  return append(self, { kind = "skip", fn = n })
+end
+
+-- a stage that reads its input by calling the function it receives and
+-- writes its output with stream.produce, running in its own coroutine
+function methods:pipe(f)
+  return append(self, { kind = "pipe", fn = f })
+end
+
+local stagefns = { map = map, filter = filter, take = take, skip = skip, pipe = pipe }
+
+function methods:iter()
+  local pull = self.source()
+  for i = 1, #self.stages do
+    local stage = self.stages[i]
+    pull = stagefns[stage.kind](stage.fn)(pull)
+  end
+  return pull
+end
+
+function methods:each(f)
+  for v in self:iter() do
+    f(v)
+  end
+end
+
+function methods:fold(f, acc)
+  for v in self:iter() do
+    acc = f(acc, v)
+  end
+  return acc
+end
+
+function methods:collect()
+  local t, n = {}, 0
+  for v in self:iter() do
+    n = n + 1
+    t[n] = v
+  end
+  return t
+end
+
+function methods:count()
+  local n = 0
+  for _ in self:iter() do
+    n = n + 1
+  end
+  return n
+end
+
+-- pmap(s, f[, opts]) maps f over s on opts.workers Lua states on their own
+-- OS threads (4 by default), with at most opts.window items (4 per worker
+-- by default) in flight; results are reordered to come out in the order
+-- of s. f and the items go through queues, so they have the same
+-- restrictions as queue values. It needs the C implementation.
+
+local WORKER = [[
+  local inq, outq, f = ...
+  while true do
+    local item = inq:pop()
+    if not item then break end
+    local res = { item[1], pcall(f, item[2]) }
+    if not pcall(outq.push, outq, res) then
+      outq:push({ item[1], false, "cannot send result of type " .. type(res[3]) })
+    end
+  end
+]]
+
+local function pmap(s, f, workers, window)
+  local tc = require "taggedcoro"
+  if not tc.newstate then
+    error("pmap needs the C implementation of taggedcoro")
+  end
+  local inq, outq = tc.queue(window + workers), tc.queue(window)
+  local states = {}
+  for i = 1, workers do
+    states[i] = tc.newstate(WORKER, inq, outq, f)
+  end
+  local stopped = false
+  local function stop()
+    if not stopped then
+      stopped = true
+      for _ = 1, workers do
+        inq:trypush(false)
+      end
+    end
+  end
+  -- stops the workers if the consumer drops the iterator midway
+  local guard = setmetatable({}, { __gc = stop })
+  local pull = s:iter()
+  local sent, nextout, done = 0, 1, false
+  local pending = {} -- reorder buffer
+  while true do
+    while not done and sent - nextout + 1 < window do
+      local v = pull()
+      if v == nil then
+        done = true
+      else
+        sent = sent + 1
+        inq:push({ sent, v })
+      end
+    end
+    if nextout > sent then
+      break
+    end
+    while not pending[nextout] do
+      local r = outq:pop()
+      pending[r[1]] = r
+    end
+    local r = pending[nextout]
+    pending[nextout] = nil
+    nextout = nextout + 1
+    if not r[2] then
+      stop()
+      error(r[3], 0)
+    end
+    iterator.produce(r[3])
+  end
+  stop()
+  for i = 1, workers do
+    states[i]:join()
+  end
+  setmetatable(guard, nil)
+end
+
+function stream.pmap(s, f, opts)
+  if type(s) == "function" then
+    s = stream.from(s)
+  end
+  opts = opts or {}
+  local workers = opts.workers or 4
+  local window = opts.window or workers * 4
+  return new(function ()
+    return iterator.make(function ()
+      pmap(s, f, workers, window)
+    end, stream.batch)
+  end)
+end
+
+function methods:pmap(f, opts)
+  return stream.pmap(self, f, opts)
+end
+
+-- tee(s, n[, capacity]) runs s once for n consumers through a ring buffer
+-- (of 64 items by default), each with its own cursor. A consumer that gets
+-- a full buffer ahead of the slowest one yields to the "tee" tag until the
+-- others catch up, or grows the buffer if it cannot yield; the consumers of
+-- stream.run can always yield. Every stream of a tee has to be consumed,
+-- or the coroutine that consumes it has to end, for the others to go on.
+
+local function tee(s, n, cap)
+  local pull = s:iter()
+  local buf, produced, done = {}, 0, false
+  local cursors, owners = {}, {}
+
+  local function slowest()
+    local min = produced
+    for i = 1, n do
+      local c = cursors[i]
+      if c and owners[i] and coroutine.status(owners[i]) == "dead" then
+        cursors[i] = nil -- its consumer is gone
+      elseif c and c < min then
+        min = c
+      end
+    end
+    return min
+  end
+
+  local function grow(min)
+    local nbuf = {}
+    for k = min, produced - 1 do
+      nbuf[k % (cap * 2) + 1] = buf[k % cap + 1]
+    end
+    buf, cap = nbuf, cap * 2
+  end
+
+  local function consumer(i)
+    return function ()
+      if not owners[i] then
+        owners[i] = coroutine.running()
+      end
+      local c = cursors[i]
+      while c == produced do
+        if done then
+          return nil
+        end
+        local min = slowest()
+        if produced - min < cap then
+          local v = pull()
+          if v == nil then
+            done = true
+            return nil
+          end
+          buf[produced % cap + 1] = v
+          produced = produced + 1
+        elseif coroutine.isyieldable() then
+          coroutine.yield()
+        else
+          grow(min)
+        end
+      end
+      cursors[i] = c + 1
+      return buf[c % cap + 1]
+    end
+  end
+
+  local streams = {}
+  for i = 1, n do
+    local used = false
+    cursors[i] = 0
+    streams[i] = new(function ()
+      if used then
+        error("a tee stream can only run once")
+      end
+      used = true
+      return consumer(i)
+    end)
+  end
+  return unpack(streams, 1, n)
+end
+
+function stream.tee(s, n, cap)
+  return tee(s, n or 2, cap or 64)
+end
+
+-- runs the functions round-robin, each in a coroutine that can yield
+-- to the "tee" tag, until all of them return
+function stream.run(...)
+  local cos = {}
+  for i = 1, select("#", ...) do
+    cos[i] = coroutine.create((select(i, ...)))
+  end
+  local alive = #cos
+  while alive > 0 do
+    alive = 0
+    for i = 1, #cos do
+      local co = cos[i]
+      if coroutine.status(co) ~= "dead" then
+        coroutine.call(co)
+        if coroutine.status(co) ~= "dead" then
+          alive = alive + 1
+        end
+      end
+    end
+  end
+end
+
+return stream
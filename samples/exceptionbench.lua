@@ -0,0 +1,56 @@
+-- Throwing through nested trycatch blocks that do not handle the
+-- exception: untyped handlers rethrow at every level, typed ones are
+-- skipped by the throw
+-- usage: lua exceptionbench.lua [throws] [depth]
+
+local ex = require "taggedcoro.exception"
+
+local N = tonumber(arg and arg[1]) or 20000
+local DEPTH = tonumber(arg and arg[2]) or 8
+
+local NotFound = ex.class("NotFound")
+local Timeout = ex.class("Timeout")
+local Refused = ex.class("Refused", Timeout) -- caught as a Timeout
+
+local function untyped(depth, kind)
+  if depth == 0 then
+    return ex.throw(kind, 1) + 1
+  end
+  return ex.trycatch(function ()
+    return untyped(depth - 1, kind)
+  end, function (retry, _, k, v)
+    if depth ~= DEPTH then -- only the outermost level handles it
+      return retry(ex.throw(k, v))
+    end
+    return retry(v)
+  end)
+end
+
+local function typed(depth, kind)
+  if depth == 0 then
+    return ex.throw(kind, 1) + 1
+  end
+  local handlers = {
+    [Timeout] = function (retry, _, _, v) return retry(v) end,
+  }
+  if depth == DEPTH then
+    handlers = { [NotFound] = function (retry, _, _, v) return retry(v) end }
+  end
+  return ex.trycatch(function ()
+    return typed(depth - 1, kind)
+  end, handlers)
+end
+
+local function bench(name, f, kind)
+  local start = os.clock()
+  local sum = 0
+  for _ = 1, N do
+    sum = sum + f(DEPTH, kind)
+  end
+  print(string.format("%-10s %d, %.3fs", name, sum, os.clock() - start))
+  return sum
+end
+
+assert(typed(1, Refused) == 2) -- the subclass is handled by its parent
+local s = bench("untyped", untyped, "notfound")
+assert(bench("typed", typed, NotFound) == s)
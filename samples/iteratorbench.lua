@@ -0,0 +1,32 @@
+-- Tokenizing a long string with an unbatched and with batched iterators
+-- usage: lua iteratorbench.lua [words] [batch size]
+
+local iterator = require "taggedcoro.iterator"
+
+local WORDS = tonumber(arg and arg[1]) or 1000000
+local BATCH = tonumber(arg and arg[2]) or 64
+
+local text = string.rep("lorem ipsum dolor sit amet ", math.floor(WORDS / 5))
+
+local function words(n)
+  return iterator.make(function ()
+    for w in text:gmatch("%a+") do
+      iterator.produce(w)
+    end
+  end, n)
+end
+
+local function run(name, n)
+  local start = os.clock()
+  local count, len = 0, 0
+  for w in words(n) do
+    count = count + 1
+    len = len + #w
+  end
+  print(string.format("%-12s %d words, %d letters, %.3fs", name, count, len, os.clock() - start))
+  return count, len
+end
+
+local c1, l1 = run("unbatched", nil)
+local c2, l2 = run("batch " .. BATCH, BATCH)
+assert(c1 == c2 and l1 == l2)
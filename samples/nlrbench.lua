@@ -0,0 +1,48 @@
+-- Searching arrays with non-local returns, through a new coroutine,
+-- through taggedcoro.nlr and through the bare C protected call, on
+-- early and on normal returns
+-- usage: lua nlrbench.lua [searches]
+
+local tc = require "taggedcoro"
+local nlr = require "taggedcoro.nlr"
+local coroutine = tc.fortag("nlr")
+
+local N = tonumber(arg and arg[1]) or 200000
+
+local t = {}
+for i = 1, 16 do t[i] = i end
+
+local corun = function (blk)
+  return coroutine.wrap(blk)()
+end
+local coret = coroutine.yield
+
+local function search(run, ret, x)
+  return run(function ()
+    for i = 1, #t do
+      if t[i] == x then ret(i) end
+    end
+    return nil
+  end)
+end
+
+local function bench(name, run, ret, x)
+  local start = os.clock()
+  local found = 0
+  for _ = 1, N do
+    if search(run, ret, x) then found = found + 1 end
+  end
+  print(string.format("%-24s %d found, %.3fs", name, found, os.clock() - start))
+  return found
+end
+
+local c = bench("coroutine, early return", corun, coret, 8)
+assert(c == N and bench("nlr, early return", nlr.run, nlr.ret, 8) == c)
+if tc.nlrrun then
+  assert(bench("nlrrun, early return", tc.nlrrun, tc.nlrret, 8) == c)
+end
+c = bench("coroutine, normal return", corun, coret, 0)
+assert(c == 0 and bench("nlr, normal return", nlr.run, nlr.ret, 0) == c)
+if tc.nlrrun then
+  assert(bench("nlrrun, normal return", tc.nlrrun, tc.nlrret, 0) == c)
+end
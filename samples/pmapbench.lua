@@ -0,0 +1,36 @@
+-- A CPU-bound map over a stream, sequential and on worker states
+-- usage: lua pmapbench.lua [items] [workers]
+
+local stream = require "taggedcoro.stream"
+
+local ok, socket = pcall(require, "socket")
+local now = ok and socket.gettime or os.time
+
+local N = tonumber(arg and arg[1]) or 2000
+local WORKERS = tonumber(arg and arg[2]) or 4
+
+local function collatz(n) -- CPU-bound, and only uses globals
+  local steps = 0
+  for k = n, n + 2000 do
+    local x = k
+    while x ~= 1 do
+      x = x % 2 == 0 and math.floor(x / 2) or 3 * x + 1
+      steps = steps + 1
+    end
+  end
+  return steps
+end
+
+local function run(name, s)
+  local start = now()
+  local res = s:collect()
+  print(string.format("%-10s %d items %.2fs", name, #res, now() - start))
+  return res
+end
+
+local items = stream.range(1, N)
+local seq = run("sequential", items:map(collatz))
+local par = run(WORKERS .. " workers", items:pmap(collatz, { workers = WORKERS }))
+for i = 1, N do
+  assert(seq[i] == par[i])
+end
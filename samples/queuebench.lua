@@ -0,0 +1,37 @@
+-- Messages per second between two Lua states on different OS threads
+-- usage: lua queuebench.lua [messages] [capacity]
+
+local tc = require "taggedcoro"
+
+local ok, socket = pcall(require, "socket")
+local now = ok and socket.gettime or os.clock -- os.clock adds the time of both threads
+
+local N = tonumber(arg and arg[1]) or 1000000
+local CAP = tonumber(arg and arg[2]) or 1024
+
+local function producer(q, n, payload)
+  for i = 1, n do
+    q:push(payload or i)
+  end
+  q:push(false)
+end
+
+local function run(kind, payload)
+  local q = tc.queue(CAP, kind)
+  local start = now()
+  local st = tc.newstate(producer, q, N, payload)
+  local count = 0
+  while q:pop() do
+    count = count + 1
+  end
+  st:join()
+  local elapsed = now() - start
+  assert(count == N)
+  print(string.format("%-4s %-8s %10d messages %8.3fs %12.0f msgs/s",
+                      kind, payload and "string" or "integer", N, elapsed, N / elapsed))
+end
+
+for _, kind in ipairs{ "spsc", "mpmc" } do
+  run(kind)
+  run(kind, string.rep("x", 64))
+end
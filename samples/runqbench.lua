@@ -0,0 +1,53 @@
+-- Latency of short high-priority tasks under saturating background load,
+-- with a FIFO run queue (all tasks at the same priority) and with priorities
+-- usage: lua runqbench.lua [rounds] [background tasks]
+
+local tc = require "taggedcoro"
+
+local ok, socket = pcall(require, "socket")
+local now = ok and socket.gettime or os.clock
+
+local ROUNDS = tonumber(arg and arg[1]) or 2000
+local BACKGROUND = tonumber(arg and arg[2]) or 50
+
+local function spin(n)
+  local x = 0
+  for i = 1, n do x = x + i end
+  return x
+end
+
+local function batch()
+  while true do
+    spin(2000)
+    tc.yield("task")
+  end
+end
+
+local function run(name, prio)
+  local q = tc.runq()
+  for _ = 1, BACKGROUND do
+    q:push(tc.create("task", batch, 10))
+  end
+  local latencies = {}
+  local steps = 0
+  while #latencies < ROUNDS do
+    steps = steps + 1
+    if steps % 10 == 0 then -- a new health check arrives
+      local start = now()
+      q:push(tc.create("task", function ()
+        spin(100)
+        latencies[#latencies + 1] = now() - start
+      end, prio))
+    end
+    local co = q:pop()
+    tc.resume(co)
+    if tc.status(co) ~= "dead" then q:push(co) end
+  end
+  table.sort(latencies)
+  local p50 = latencies[math.ceil(#latencies * 0.50)]
+  local p99 = latencies[math.ceil(#latencies * 0.99)]
+  print(string.format("%-8s %6d tasks p50 %9.3fms p99 %9.3fms", name, #latencies, p50 * 1000, p99 * 1000))
+end
+
+run("fifo", 10)
+run("priority", 0)
@@ -0,0 +1,43 @@
+-- Round trips per second of a small record through the C serializer,
+-- compared with formatting it as a Lua chunk and loading it back
+-- usage: lua serializebench.lua [iterations]
+
+local tc = require "taggedcoro"
+
+local ok, socket = pcall(require, "socket")
+local now = ok and socket.gettime or os.clock
+
+local N = tonumber(arg and arg[1]) or 100000
+
+local load = loadstring or load
+
+local record = { id = 42, name = "tagged", score = 1.5, tags = { "a", "b", "c" } }
+
+local function format(v)
+  if type(v) == "table" then
+    local out = {}
+    for k, x in pairs(v) do
+      out[#out + 1] = "[" .. format(k) .. "]=" .. format(x)
+    end
+    return "{" .. table.concat(out, ",") .. "}"
+  elseif type(v) == "string" then
+    return string.format("%q", v)
+  else
+    return tostring(v)
+  end
+end
+
+local function run(name, roundtrip)
+  local start = now()
+  for _ = 1, N do
+    local r = roundtrip(record)
+    assert(r.id == 42)
+  end
+  local elapsed = now() - start
+  print(string.format("%-8s %10d round trips %8.3fs %12.0f/s", name, N, elapsed, N / elapsed))
+end
+
+run("format", function (v) return load("return " .. format(v))() end)
+run("string", function (v) return tc.decode(tc.encode(v)) end)
+local buf = tc.buffer()
+run("buffer", function (v) return buf:encode(v):decode() end)
@@ -0,0 +1,60 @@
+-- A simulated service: clients send requests at random intervals over a
+-- simulated hour, and workers handle them through a channel with a
+-- simulated service time; runs on the virtual clock of a simulation, so
+-- the hour takes as long as the tasks take to run
+-- usage: lua simbench.lua [clients] [workers] [seed]
+
+local tc = require "taggedcoro"
+
+local ok, socket = pcall(require, "socket")
+local now = ok and socket.gettime or os.clock
+
+local CLIENTS = tonumber(arg and arg[1]) or 10000
+local WORKERS = tonumber(arg and arg[2]) or 100
+local SEED = tonumber(arg and arg[3]) or 42
+local HOUR = 3600
+
+local function run()
+  local sim = tc.simulation(SEED)
+  local requests = tc.chan(WORKERS)
+  local served, waited, timers = 0, 0, 0
+  math.randomseed(SEED)
+  for _ = 1, WORKERS do
+    sim:spawn(function ()
+      while true do
+        local sent, ok = requests:recv()
+        if not ok then break end
+        waited = waited + (sim:now() - sent)
+        sim:sleep(0.05 + math.random() * 0.1)
+        timers = timers + 1
+        served = served + 1
+      end
+    end)
+  end
+  local clients = tc.waitgroup()
+  clients:add(CLIENTS)
+  for _ = 1, CLIENTS do
+    sim:spawn(function ()
+      while sim:now() < HOUR do
+        sim:sleep(math.random() * 60)
+        timers = timers + 1
+        requests:send(sim:now())
+      end
+      clients:done()
+    end)
+  end
+  sim:spawn(function ()
+    clients:wait()
+    requests:close()
+  end)
+  sim:run()
+  return served, waited / math.max(served, 1), timers, sim:now()
+end
+
+local start = now()
+local served, wait, timers, simulated = run()
+local elapsed = now() - start
+print(string.format("%d requests, %.3fs mean wait, %d timers, %.0fs simulated in %.3fs",
+                    served, wait, timers, simulated, elapsed))
+local again = run()
+assert(again == served, "runs with the same seed must be the same")
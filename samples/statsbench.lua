@@ -0,0 +1,27 @@
+-- Cost of a resume/yield round trip, to compare builds with and without
+-- TC_STATS, and the per-tag figures when they are there
+-- usage: lua statsbench.lua [switches]
+
+local tc = require "taggedcoro"
+
+local N = tonumber(arg and arg[1]) or 1000000
+
+local co = tc.create("ping", function ()
+  while true do tc.yield("ping") end
+end)
+
+local start = os.clock()
+for _ = 1, N do
+  tc.resume(co)
+end
+local elapsed = os.clock() - start
+print(string.format("%s: %d switches, %.3fs, %.0f ns/switch",
+                    tc.stats and "with stats" or "without stats",
+                    N, elapsed, elapsed / N * 1e9))
+
+if tc.stats then
+  for tag, s in pairs(tc.stats()) do
+    print(string.format("  %-10s %.3fs cpu, %d resumes, %d yields",
+                        tostring(tag), s.cpu, s.resumes, s.yields))
+  end
+end
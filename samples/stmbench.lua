@@ -0,0 +1,73 @@
+-- Bank transfers between shared STM accounts from several Lua states on
+-- their own OS threads; the total must stay the same
+-- usage: lua stmbench.lua [transfers] [accounts] [karma|backoff|none]
+
+local tc = require "taggedcoro"
+local stm = require "taggedcoro.stm"
+
+local ok, socket = pcall(require, "socket")
+local now = ok and socket.gettime or os.time
+
+local TRANSFERS = tonumber(arg and arg[1]) or 200000
+local ACCOUNTS = tonumber(arg and arg[2]) or 64
+local MANAGER = arg and arg[3] or "karma"
+local INITIAL = 1000
+
+local unpack = table.unpack or unpack
+
+local WORKER = [[
+  local stm = require "taggedcoro.stm"
+  local n, seed, manager = ...
+  local accounts = { select(4, ...) }
+  math.randomseed(seed)
+  if manager == "none" then
+    stm.manager = nil
+  else
+    stm.manager = stm[manager]()
+  end
+  for _ = 1, n do
+    local from = accounts[math.random(#accounts)]
+    local to = accounts[math.random(#accounts)]
+    local amount = math.random(10)
+    stm.transaction(function ()
+      local balance = stm.get(from)
+      if balance >= amount then
+        stm.set(from, balance - amount)
+        stm.set(to, stm.get(to) + amount)
+      end
+    end)
+  end
+  local stats = stm.stats()
+  return stats.commits, stats.aborts
+]]
+
+local accounts = {}
+for i = 1, ACCOUNTS do
+  accounts[i] = stm.var("account" .. i, INITIAL, "shared")
+end
+
+local function run(workers)
+  local states = {}
+  local start = now()
+  for i = 1, workers do
+    states[i] = tc.newstate(WORKER, math.floor(TRANSFERS / workers), i, MANAGER,
+                            unpack(accounts))
+  end
+  local aborts = 0
+  for i = 1, workers do
+    aborts = aborts + select(2, states[i]:join())
+  end
+  local total = 0
+  for i = 1, ACCOUNTS do
+    total = total + accounts[i]:get()
+  end
+  assert(total == INITIAL * ACCOUNTS)
+  local elapsed = now() - start
+  print(string.format("%d workers: %d transfers, %.3fs, %.0f/s, %d aborts",
+                      workers, TRANSFERS, elapsed, TRANSFERS / math.max(elapsed, 1e-3),
+                      aborts))
+end
+
+for _, workers in ipairs({ 1, 2, 4, 8 }) do
+  run(workers)
+end
@@ -0,0 +1,46 @@
+-- Transactions that read 50 variables twice and write them back, with a
+-- get and a set per variable and with getmany/setmany
+-- usage: lua stmmanybench.lua [transactions] [variables]
+
+local stm = require "taggedcoro.stm"
+
+local N = tonumber(arg and arg[1]) or 20000
+local VARS = tonumber(arg and arg[2]) or 50
+
+local vars = {}
+for i = 1, VARS do
+  vars[i] = stm.var("v" .. i, 0)
+end
+
+local function single()
+  stm.transaction(function ()
+    local sum = 0
+    for i = 1, VARS do sum = sum + stm.get(vars[i]) end
+    for i = 1, VARS do sum = sum + stm.get(vars[i]) end -- from the cache
+    for i = 1, VARS do stm.set(vars[i], stm.get(vars[i]) + 1) end
+  end)
+end
+
+local function many()
+  stm.transaction(function ()
+    local vals = { stm.getmany(vars) }
+    local sum = 0
+    for i = 1, VARS do sum = sum + vals[i] end
+    vals = { stm.getmany(vars) } -- from the cache
+    local writes = {}
+    for i = 1, VARS do writes[vars[i]] = vals[i] + 1 end
+    stm.setmany(writes)
+  end)
+end
+
+local function bench(name, f)
+  local start = os.clock()
+  for _ = 1, N do f() end
+  print(string.format("%-8s %d transactions, %.3fs", name, N, os.clock() - start))
+end
+
+bench("single", single)
+bench("many", many)
+local final
+stm.transaction(function () final = stm.get(vars[1]) end)
+assert(final == 2 * N)
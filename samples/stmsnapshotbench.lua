@@ -0,0 +1,75 @@
+-- Reporting transactions that read every shared variable while other
+-- states keep writing a timestamp, as ordinary transactions and as
+-- snapshots; ordinary ones abort when the timestamp moves under them
+-- usage: lua stmsnapshotbench.lua [writes] [variables] [versions]
+
+local tc = require "taggedcoro"
+local stm = require "taggedcoro.stm"
+
+local ok, socket = pcall(require, "socket")
+local now = ok and socket.gettime or os.time
+
+local WRITES = tonumber(arg and arg[1]) or 20000
+local VARS = tonumber(arg and arg[2]) or 200
+local VERSIONS = tonumber(arg and arg[3]) or 8
+local WRITERS = 2
+
+local unpack = table.unpack or unpack
+
+local WRITER = [[
+  local stm = require "taggedcoro.stm"
+  local n, timestamp, finished = ...
+  local vars = { select(4, ...) }
+  for i = 1, n do
+    stm.transaction(function ()
+      stm.set(timestamp, stm.get(timestamp) + 1)
+      local var = vars[i % #vars + 1]
+      stm.set(var, stm.get(var) + 1)
+    end)
+  end
+  stm.transaction(function ()
+    stm.set(finished, stm.get(finished) + 1)
+  end)
+]]
+
+local timestamp = stm.var("timestamp", 0, "shared", VERSIONS)
+local vars = {}
+for i = 1, VARS do
+  vars[i] = stm.var("v" .. i, 0, "shared", VERSIONS)
+end
+
+local function report()
+  local sum = stm.get(timestamp)
+  for i = 1, VARS do
+    sum = sum + stm.get(vars[i])
+  end
+  return sum
+end
+
+local function run(name, transaction)
+  local finished = stm.var("finished", 0, "shared")
+  local states = {}
+  stm.resetstats()
+  local start = now()
+  for i = 1, WRITERS do
+    states[i] = tc.newstate(WRITER, WRITES, timestamp, finished, unpack(vars))
+  end
+  local reports, done = 0, 0
+  while done < WRITERS do
+    transaction(function ()
+      report()
+      done = stm.get(finished)
+    end)
+    reports = reports + 1
+  end
+  for i = 1, WRITERS do
+    states[i]:join()
+  end
+  local elapsed = now() - start
+  local stats = stm.stats()
+  print(string.format("%-11s %d reports, %d aborts, %.3fs",
+                      name, reports, stats.aborts, elapsed))
+end
+
+run("transaction", stm.transaction)
+run("snapshot", stm.snapshot)
@@ -0,0 +1,46 @@
+-- A five-stage pipeline, with one coroutine per stage and fused
+-- usage: lua streambench.lua [items]
+
+local iterator = require "taggedcoro.iterator"
+local stream = require "taggedcoro.stream"
+
+local N = tonumber(arg and arg[1]) or 10000000
+
+local function double(x) return x * 2 end
+local function odd3(x) return x % 3 ~= 0 end
+local function inc(x) return x + 1 end
+local function add(a, b) return a + b end
+
+-- every stage is a generator, as when chaining iterator.make by hand
+local function stage(up, f)
+  return iterator.make(function ()
+    for v in up do
+      local r = f(v)
+      if r ~= nil then iterator.produce(r) end
+    end
+  end)
+end
+
+local function chained()
+  local src = iterator.make(function ()
+    for i = 1, N do iterator.produce(i) end
+  end)
+  local s = stage(stage(stage(src, double), function (x) if odd3(x) then return x end end), inc)
+  local n, acc = 0, 0
+  s = stage(s, function (x) n = n + 1; if n <= math.floor(N / 2) then return x end end)
+  for v in s do acc = add(acc, v) end
+  return acc
+end
+
+local function fused()
+  return stream.range(1, N):map(double):filter(odd3):map(inc):take(math.floor(N / 2)):fold(add, 0)
+end
+
+local function run(name, f)
+  local start = os.clock()
+  local r = f()
+  print(string.format("%-8s %.0f %.3fs", name, r, os.clock() - start))
+  return r
+end
+
+assert(run("chained", chained) == run("fused", fused))
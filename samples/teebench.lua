@@ -0,0 +1,48 @@
+-- One log line generator feeding a metrics aggregator and an indexer
+-- through a tee, compared with running the generator twice
+-- usage: lua teebench.lua [lines] [buffer capacity]
+
+local stream = require "taggedcoro.stream"
+
+local N = tonumber(arg and arg[1]) or 1000000
+local CAP = tonumber(arg and arg[2]) or 256
+
+local generated = 0
+
+local function lines()
+  return stream.generate(function ()
+    for i = 1, N do
+      generated = generated + 1
+      stream.produce(string.format("%d GET /item/%d %d", i, i % 100, 200 + (i % 7 == 0 and 304 or 0)))
+    end
+  end)
+end
+
+local function metrics(s)
+  return function ()
+    local errors = s:filter(function (l) return l:match(" 504$") end):count()
+    assert(errors == math.floor(N / 7))
+  end
+end
+
+local function indexer(s)
+  return function ()
+    local index = {}
+    s:each(function (l)
+      local path = l:match("GET (%S+)")
+      index[path] = (index[path] or 0) + 1
+    end)
+    assert(index["/item/1"] > 0)
+  end
+end
+
+local start = os.clock()
+metrics(lines())()
+indexer(lines())()
+print(string.format("twice   %d lines generated, %.3fs", generated, os.clock() - start))
+
+generated = 0
+start = os.clock()
+local a, b = stream.tee(lines(), 2, CAP)
+stream.run(metrics(a), indexer(b))
+print(string.format("tee     %d lines generated, %.3fs", generated, os.clock() - start))
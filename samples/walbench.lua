@@ -0,0 +1,60 @@
+-- Commits to durable STM variables, one at a time from the main
+-- coroutine (one fdatasync per commit) and from async tasks in a run
+-- queue, whose commits share batches (one fdatasync per round of tasks)
+-- usage: lua walbench.lua [commits] [tasks] [path]
+
+local tc = require "taggedcoro"
+local stm = require "taggedcoro.stm"
+
+local ok, socket = pcall(require, "socket")
+local now = ok and socket.gettime or os.time
+
+local COMMITS = tonumber(arg and arg[1]) or 2000
+local TASKS = tonumber(arg and arg[2]) or 32
+local PATH = arg and arg[3] or os.tmpname()
+local PER = math.floor(COMMITS / TASKS)
+
+os.remove(PATH)
+stm.open(PATH)
+
+local vars = {}
+for i = 1, TASKS do
+  vars[i] = stm.durable("counter" .. i, 0)
+end
+
+local function bump(var)
+  stm.transaction(function ()
+    stm.set(var, stm.get(var) + 1)
+  end)
+end
+
+local function report(name, commits, elapsed)
+  print(string.format("%-10s %d commits, %.3fs, %.0f/s",
+                      name, commits, elapsed, commits / math.max(elapsed, 1e-3)))
+end
+
+local start = now()
+for i = 1, COMMITS do
+  bump(vars[i % TASKS + 1])
+end
+report("serial", COMMITS, now() - start)
+
+start = now()
+local q = tc.runq()
+for i = 1, TASKS do
+  q:spawn(function ()
+    for _ = 1, PER do
+      bump(vars[i])
+    end
+  end)
+end
+q:run()
+report("grouped", PER * TASKS, now() - start)
+
+stm.open(PATH) -- read the log back
+local total = 0
+for i = 1, TASKS do
+  total = total + stm.durable("counter" .. i, 0):get()
+end
+assert(total == COMMITS + PER * TASKS)
+os.remove(PATH)
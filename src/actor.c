@@ -0,0 +1,286 @@
+/*
+** Actors: async tasks that own a mailbox. Messages carry a tag and some
+** values, and the mailbox keeps them in arrival order and also in one
+** first-in, first-out list per tag, so receiving the oldest message with
+** a given tag takes constant time however many other messages are
+** queued. An actor that receives from an empty list blocks until a
+** message with that tag arrives.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "taggedcoro.h"
+
+#define TC_ACTOR "taggedcoro.actor"
+
+#define NONE (-1)
+
+/* uservalue of an actor */
+#define A_CO     1  /* coroutine of the actor */
+#define A_MSGS   2  /* message tables, indexed by node */
+#define A_HEADS  3  /* first node of each tag */
+#define A_TAILS  4  /* last node of each tag */
+#define A_WANT   5  /* tag the actor is waiting for */
+
+typedef struct Msg {
+  int prev, next; /* arrival order; next is also the free list */
+  int tnext; /* next message with the same tag */
+} Msg;
+
+typedef struct Actor {
+  Msg *msgs;
+  int cap;
+  int size;
+  int head, tail;
+  int free;
+  int waiting; /* 1 for a tag, 2 for any message */
+  tc_WaitList waiters;
+} Actor;
+
+static Actor *checkactor (lua_State *L, int idx) {
+  return (Actor *)luaL_checkudata(L, idx, TC_ACTOR);
+}
+
+static int newmsg (lua_State *L, Actor *a) {
+  int n;
+  if(a->free == NONE) {
+    int cap = a->cap ? a->cap * 2 : 16, i;
+    Msg *msgs;
+    if(cap <= a->cap) luaL_error(L, "mailbox overflow");
+    msgs = (Msg *)realloc(a->msgs, (size_t)cap * sizeof(Msg));
+    if(!msgs) luaL_error(L, "not enough memory");
+    for(i = a->cap; i < cap; i++) msgs[i].next = i + 1 < cap ? i + 1 : NONE;
+    a->msgs = msgs;
+    a->free = a->cap;
+    a->cap = cap;
+  }
+  n = a->free;
+  a->free = a->msgs[n].next;
+  return n;
+}
+
+/* gets field f of the uservalue table at index uv for the tag at index tag */
+static int gettagfield (lua_State *L, int uv, int f, int tag) {
+  int n;
+  lua_rawgeti(L, uv, f);
+  lua_pushvalue(L, tag);
+  n = lua_rawget(L, -2) == LUA_TNIL ? NONE : (int)lua_tointeger(L, -1);
+  lua_pop(L, 2);
+  return n;
+}
+
+static void settagfield (lua_State *L, int uv, int f, int tag, int n) {
+  lua_rawgeti(L, uv, f);
+  lua_pushvalue(L, tag);
+  if(n == NONE) lua_pushnil(L);
+  else lua_pushinteger(L, n);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+/* queues the message on top of the stack, a table with the tag at 1 and n */
+static void post (lua_State *L, Actor *a, int uv, int tag) {
+  int n = newmsg(L, a), last;
+  lua_rawgeti(L, uv, A_MSGS);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, n + 1);
+  lua_pop(L, 1);
+  a->msgs[n].prev = a->tail;
+  a->msgs[n].next = NONE;
+  a->msgs[n].tnext = NONE;
+  if(a->tail != NONE) a->msgs[a->tail].next = n;
+  else a->head = n;
+  a->tail = n;
+  last = gettagfield(L, uv, A_TAILS, tag);
+  if(last != NONE) a->msgs[last].tnext = n;
+  else settagfield(L, uv, A_HEADS, tag, n);
+  settagfield(L, uv, A_TAILS, tag, n);
+  a->size++;
+}
+
+/* removes message n, the first one with its tag, and pushes its table */
+static void take (lua_State *L, Actor *a, int uv, int n) {
+  Msg *m = &a->msgs[n];
+  int tag;
+  lua_rawgeti(L, uv, A_MSGS);
+  lua_rawgeti(L, -1, n + 1);
+  lua_pushnil(L);
+  lua_rawseti(L, -3, n + 1);
+  lua_remove(L, -2);
+  lua_rawgeti(L, -1, 1);
+  tag = lua_gettop(L);
+  settagfield(L, uv, A_HEADS, tag, m->tnext);
+  if(m->tnext == NONE) settagfield(L, uv, A_TAILS, tag, NONE);
+  lua_pop(L, 1);
+  if(m->prev != NONE) a->msgs[m->prev].next = m->next;
+  else a->head = m->next;
+  if(m->next != NONE) a->msgs[m->next].prev = m->prev;
+  else a->tail = m->prev;
+  m->next = a->free;
+  a->free = n;
+  a->size--;
+}
+
+static int actor_send (lua_State *L) {
+  Actor *a = checkactor(L, 1);
+  int n = lua_gettop(L) - 1, i;
+  luaL_argcheck(L, !lua_isnoneornil(L, 2), 2, "message tag expected");
+  lua_createtable(L, n, 1);
+  for(i = 1; i <= n; i++) {
+    lua_pushvalue(L, i + 1);
+    lua_rawseti(L, -2, i);
+  }
+  lua_pushinteger(L, n);
+  lua_setfield(L, -2, "n");
+  lua_getuservalue(L, 1);
+  lua_insert(L, -2);
+  post(L, a, n + 2, 2);
+  if(a->waiting == 1) { /* waiting for another tag? */
+    lua_rawgeti(L, n + 2, A_WANT);
+    if(!lua_rawequal(L, -1, 2)) return 0;
+  }
+  if(a->waiting) {
+    a->waiting = 0;
+    taggedcoro_wakeone(L, &a->waiters);
+  }
+  return 0;
+}
+
+/* pushes the values of the message on top, replacing it */
+static int unpackmsg (lua_State *L, int withtag) {
+  int t = lua_gettop(L), n, i;
+  lua_getfield(L, t, "n");
+  n = (int)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  luaL_checkstack(L, n, "too many values in message");
+  for(i = withtag ? 1 : 2; i <= n; i++) lua_rawgeti(L, t, i);
+  lua_remove(L, t);
+  return withtag ? n : n - 1;
+}
+
+/* stack: actor, tag or nil, uservalue */
+LUA_KFUNCTION(receivek) {
+  Actor *a = (Actor *)lua_touserdata(L, 1);
+  int any = lua_isnil(L, 2), n;
+  (void)status;
+  (void)ctx;
+  lua_settop(L, 3);
+  n = any ? a->head : gettagfield(L, 3, A_HEADS, 2);
+  if(n != NONE) {
+    take(L, a, 3, n);
+    return unpackmsg(L, any);
+  }
+  a->waiting = any ? 2 : 1;
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, 3, A_WANT);
+  taggedcoro_waitadd(L, &a->waiters, taggedcoro_block(L), -1);
+  lua_pop(L, 1); /* task */
+  lua_pushcfunction(L, taggedcoro_yield);
+  lua_pushliteral(L, TC_ASYNC);
+  lua_pushvalue(L, 1);
+  lua_callk(L, 2, 0, 0, receivek);
+  return receivek(L, LUA_OK, 0);
+}
+
+static int actor_receive (lua_State *L) {
+  checkactor(L, 1);
+  lua_settop(L, 2);
+  lua_getuservalue(L, 1);
+  lua_pushliteral(L, TC_ASYNC);
+  if(!taggedcoro_pushhandler(L, -1)) lua_pushnil(L);
+  lua_rawgeti(L, 3, A_CO);
+  if(!lua_rawequal(L, -1, -2))
+    return luaL_error(L, "attempt to receive from the mailbox of another actor");
+  lua_settop(L, 3);
+  return receivek(L, LUA_OK, 0);
+}
+
+static int actor_len (lua_State *L) {
+  lua_pushinteger(L, checkactor(L, 1)->size);
+  return 1;
+}
+
+static int actor_count (lua_State *L) {
+  Actor *a = checkactor(L, 1);
+  int n, count = 0;
+  luaL_checkany(L, 2);
+  lua_settop(L, 2);
+  lua_getuservalue(L, 1);
+  for(n = gettagfield(L, 3, A_HEADS, 2); n != NONE; n = a->msgs[n].tnext) count++;
+  lua_pushinteger(L, count);
+  return 1;
+}
+
+static int actor_tostring (lua_State *L) {
+  lua_pushfstring(L, "actor (%p)", lua_touserdata(L, 1));
+  return 1;
+}
+
+static int actor_gc (lua_State *L) {
+  Actor *a = checkactor(L, 1);
+  free(a->msgs);
+  a->msgs = NULL;
+  a->cap = a->size = 0;
+  a->head = a->tail = a->free = NONE;
+  return 0;
+}
+
+static int runq_actor (lua_State *L) {
+  Actor *a;
+  int i, nargs = lua_gettop(L) - 2;
+  luaL_checkudata(L, 1, TC_RUNQ);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  a = (Actor *)lua_newuserdata(L, sizeof(Actor));
+  memset(a, 0, sizeof(Actor));
+  a->head = a->tail = a->free = NONE;
+  luaL_setmetatable(L, TC_ACTOR);
+  lua_createtable(L, 5, 0);
+  for(i = A_MSGS; i <= A_TAILS; i++) {
+    lua_newtable(L);
+    lua_rawseti(L, -2, i);
+  }
+  lua_setuservalue(L, -2);
+  lua_insert(L, 3); /* the function receives the actor first */
+  taggedcoro_spawn(L, 1, 2, nargs + 1);
+  lua_getuservalue(L, 3);
+  lua_pushvalue(L, -3);
+  lua_rawseti(L, -2, A_CO);
+  lua_pop(L, 1);
+  lua_remove(L, -2); /* coroutine */
+  lua_pushvalue(L, 3);
+  lua_insert(L, -2);
+  return 2;
+}
+
+static const luaL_Reg actor_methods[] = {
+  {"send", actor_send},
+  {"receive", actor_receive},
+  {"count", actor_count},
+  {NULL, NULL}
+};
+
+static const luaL_Reg actor_meta[] = {
+  {"__len", actor_len},
+  {"__tostring", actor_tostring},
+  {"__gc", actor_gc},
+  {NULL, NULL}
+};
+
+void taggedcoro_openactor (lua_State *L) {
+  /* stack: module, coroset */
+  luaL_newmetatable(L, TC_ACTOR);
+  luaL_newlibtable(L, actor_methods);
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, actor_methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, actor_meta, 1);
+  lua_pop(L, 1);
+  luaL_getmetatable(L, TC_RUNQ);
+  lua_getfield(L, -1, "__index");
+  lua_pushvalue(L, -3);
+  lua_pushcclosure(L, runq_actor, 1);
+  lua_setfield(L, -2, "actor");
+  lua_pop(L, 2);
+}
@@ -0,0 +1,596 @@
+/*
+** Futures and async tasks. A task is a coroutine with the "async" tag
+** that belongs to a run queue; awaiting a pending future blocks the task
+** (it yields to the "async" tag and leaves the run queue) and adds it to
+** the future's wait list, and completing the future pushes every waiter
+** back to its run queue in one batch. Wait lists are intrusive: tasks,
+** combinators and callbacks embed their own tc_Waiter node.
+*/
+
+#include <string.h>
+
+#include "taggedcoro.h"
+
+#define TC_TASK "taggedcoro.task"
+
+enum { PENDING, RESOLVED, REJECTED };
+
+static const char *const states[] = { "pending", "resolved", "rejected" };
+
+/*
+** {======================================================
+** Wait lists
+** =======================================================
+*/
+
+void taggedcoro_waitadd (lua_State *L, tc_WaitList *l, tc_Waiter *w, int owner) {
+  lua_pushvalue(L, owner);
+  w->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  w->list = l;
+  w->next = NULL;
+  w->prev = l->tail;
+  if(l->tail) l->tail->next = w;
+  else l->head = w;
+  l->tail = w;
+}
+
+static void unlink (tc_Waiter *w) {
+  tc_WaitList *l = w->list;
+  if(w->prev) w->prev->next = w->next;
+  else l->head = w->next;
+  if(w->next) w->next->prev = w->prev;
+  else l->tail = w->prev;
+  w->next = w->prev = NULL;
+  w->list = NULL;
+}
+
+void taggedcoro_waitremove (lua_State *L, tc_Waiter *w) {
+  if(!w->list) return;
+  unlink(w);
+  luaL_unref(L, LUA_REGISTRYINDEX, w->ref);
+  w->ref = LUA_NOREF;
+}
+
+/* removes the waiter and fires it, leaving an error on top if it fails */
+static int fire (lua_State *L, tc_Waiter *w) {
+  unlink(w);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, w->ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, w->ref);
+  w->ref = LUA_NOREF;
+  if(w->fire(L, w)) {
+    lua_remove(L, -2); /* owner */
+    return 1;
+  }
+  lua_pop(L, 1);
+  return 0;
+}
+
+int taggedcoro_wakeone (lua_State *L, tc_WaitList *l) {
+  if(!l->head) return 0;
+  if(fire(L, l->head)) lua_error(L);
+  return 1;
+}
+
+/*
+** Wakes the waiters that are in the list now, so waiters added while
+** they fire wait for the next wake. The first error is raised after
+** all of them have been fired.
+*/
+void taggedcoro_wakeall (lua_State *L, tc_WaitList *l) {
+  tc_Waiter *last = l->tail;
+  int err = 0;
+  while(l->head && last && last->list == l) {
+    tc_Waiter *w = l->head;
+    if(fire(L, w)) {
+      if(err) lua_pop(L, 1); /* keep the first error */
+      err = 1;
+    }
+    if(w == last) break;
+  }
+  if(err) lua_error(L);
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Tasks
+** =======================================================
+*/
+
+typedef struct Task {
+  tc_Waiter w; /* must be the first field */
+  int blocked;
+} Task;
+
+/* stack: task; the task goes back to its run queue */
+static int taskfire (lua_State *L, tc_Waiter *w) {
+  Task *t = (Task *)w;
+  t->blocked = 0;
+  lua_getuservalue(L, -1); /* { co, runq, future } */
+  lua_rawgeti(L, -1, 2);
+  lua_rawgeti(L, -2, 1);
+  taggedcoro_pushpriority(L, -1);
+  taggedcoro_runqpush(L, -3, -2, lua_tonumber(L, -1));
+  lua_pop(L, 4);
+  return 0;
+}
+
+/*
+** Blocks the async task of the running coroutine: pushes the task, which
+** owns the returned node, and marks it blocked. The caller adds the node to
+** a wait list with the task as owner and yields to TC_ASYNC; the task will
+** not run again until it is woken.
+*/
+tc_Waiter *taggedcoro_block (lua_State *L) {
+  Task *t;
+  lua_pushliteral(L, TC_ASYNC);
+  if(!taggedcoro_pushhandler(L, -1))
+    luaL_error(L, "attempt to block outside of an async task");
+  lua_rawget(L, lua_upvalueindex(1)); /* coroset[handler] */
+  lua_rawgeti(L, -1, 11); /* task */
+  t = (Task *)luaL_testudata(L, -1, TC_TASK);
+  if(!t) luaL_error(L, "attempt to block outside of an async task");
+  lua_replace(L, -3);
+  lua_pop(L, 1);
+  taggedcoro_waitremove(L, &t->w); /* resumed by someone else while waiting */
+  t->blocked = 1;
+  return &t->w;
+}
+
+/* checks if the coroutine of the task at index task was closed */
+int taggedcoro_taskclosed (lua_State *L, int task) {
+  int top = lua_gettop(L), closed;
+  lua_getuservalue(L, task); /* { co, runq, future } */
+  lua_rawgeti(L, -1, 1);
+  closed = lua_rawget(L, lua_upvalueindex(1)) == LUA_TTABLE && /* coroset[co] */
+           lua_rawgeti(L, -1, 8) != LUA_TNIL;
+  lua_settop(L, top);
+  return closed;
+}
+
+/* pushes the task of coroutine at index co, or nil */
+static Task *pushtask (lua_State *L, int co) {
+  Task *t = NULL;
+  lua_pushvalue(L, co);
+  if(lua_rawget(L, lua_upvalueindex(1)) != LUA_TNIL) { /* coroset[co] */
+    lua_rawgeti(L, -1, 11);
+    lua_remove(L, -2);
+    t = (Task *)luaL_testudata(L, -1, TC_TASK);
+  }
+  return t;
+}
+
+static int isdead (lua_State *L, int status, lua_State *co) {
+  lua_Debug ar;
+  if(status != LUA_OK && status != LUA_YIELD) return 1;
+  return lua_status(co) == LUA_OK && lua_getstack(co, 0, &ar) == 0 && lua_gettop(co) == 0;
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Futures
+** =======================================================
+*/
+
+typedef struct Future {
+  int state;
+  int remaining; /* inputs that all or any are still waiting for */
+  tc_WaitList waiters;
+} Future;
+
+static Future *checkfuture (lua_State *L, int idx) {
+  return (Future *)luaL_checkudata(L, idx, TC_FUTURE);
+}
+
+static Future *newfuture (lua_State *L) {
+  Future *f = (Future *)lua_newuserdata(L, sizeof(Future));
+  memset(f, 0, sizeof(Future));
+  f->state = PENDING;
+  luaL_setmetatable(L, TC_FUTURE);
+  lua_newtable(L);
+  lua_setuservalue(L, -2);
+  return f;
+}
+
+void taggedcoro_newfuture (lua_State *L) {
+  newfuture(L);
+}
+
+int taggedcoro_pending (lua_State *L, int future) {
+  return checkfuture(L, future)->state == PENDING;
+}
+
+/* pushes the values (or error) of the completed future at index future */
+static int pushresult (lua_State *L, int future) {
+  int n, i, t;
+  lua_getuservalue(L, future);
+  t = lua_gettop(L);
+  lua_getfield(L, t, "n");
+  n = (int)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  luaL_checkstack(L, n, "too many results");
+  for(i = 1; i <= n; i++) lua_rawgeti(L, t, i);
+  lua_remove(L, t);
+  return n;
+}
+
+/* completes the future with the n values on top of the stack, popping them */
+void taggedcoro_complete (lua_State *L, int future, int ok, int n) {
+  Future *f = checkfuture(L, future);
+  int t, i;
+  future = lua_absindex(L, future);
+  if(f->state != PENDING) luaL_error(L, "future already completed");
+  lua_createtable(L, n, 1);
+  lua_insert(L, -(n + 1));
+  t = lua_gettop(L) - n;
+  for(i = n; i >= 1; i--) lua_rawseti(L, t, i);
+  lua_pushinteger(L, n);
+  lua_setfield(L, t, "n");
+  lua_setuservalue(L, future);
+  f->state = ok ? RESOLVED : REJECTED;
+  taggedcoro_wakeall(L, &f->waiters);
+}
+
+static int future_resolve (lua_State *L) {
+  checkfuture(L, 1);
+  taggedcoro_complete(L, 1, 1, lua_gettop(L) - 1);
+  return 0;
+}
+
+static int future_reject (lua_State *L) {
+  checkfuture(L, 1);
+  lua_settop(L, 2);
+  taggedcoro_complete(L, 1, 0, 1);
+  return 0;
+}
+
+LUA_KFUNCTION(awaitk) {
+  Future *f = (Future *)lua_touserdata(L, 1);
+  lua_settop(L, 1);
+  if(f->state == PENDING) {
+    taggedcoro_waitadd(L, &f->waiters, taggedcoro_block(L), 2);
+    lua_settop(L, 1);
+    lua_pushcfunction(L, taggedcoro_yield);
+    lua_pushliteral(L, TC_ASYNC);
+    lua_pushvalue(L, 1);
+    lua_callk(L, 2, 0, 0, awaitk);
+    return awaitk(L, LUA_OK, 0);
+  }
+  if(f->state == REJECTED) {
+    pushresult(L, 1);
+    lua_settop(L, 2);
+    return lua_error(L);
+  }
+  return pushresult(L, 1);
+}
+
+static int future_await (lua_State *L) {
+  Future *f = checkfuture(L, 1);
+  if(f->state == PENDING) {
+    lua_pushliteral(L, TC_ASYNC);
+    if(!taggedcoro_canyield(L, -1))
+      return luaL_error(L, "attempt to await a pending future outside of an async task");
+  }
+  return awaitk(L, LUA_OK, 0);
+}
+
+static int future_state (lua_State *L) {
+  lua_pushstring(L, states[checkfuture(L, 1)->state]);
+  return 1;
+}
+
+/*
+** Nodes that wait on futures on behalf of combinators and callbacks;
+** the uservalue is { result future, source future } or { future, callback }
+*/
+typedef struct Node {
+  tc_Waiter w; /* must be the first field */
+  int index;
+  int any;
+} Node;
+
+static void combine (lua_State *L, int r, int s, int index, int any) {
+  Future *rf = (Future *)lua_touserdata(L, r);
+  Future *sf = (Future *)lua_touserdata(L, s);
+  int top = lua_gettop(L), n;
+  if(rf->state != PENDING) return;
+  if(sf->state == RESOLVED && any) {
+    n = pushresult(L, s);
+    taggedcoro_complete(L, r, 1, n);
+  } else if(sf->state == RESOLVED) { /* all keeps the first value of each */
+    lua_getuservalue(L, r);
+    n = pushresult(L, s);
+    lua_settop(L, top + 2);
+    lua_rawseti(L, top + 1, index);
+    if(--rf->remaining == 0) {
+      lua_getfield(L, top + 1, "count");
+      n = (int)lua_tointeger(L, -1);
+      lua_pop(L, 1);
+      luaL_checkstack(L, n, "too many results");
+      for(index = 1; index <= n; index++) lua_rawgeti(L, top + 1, index);
+      taggedcoro_complete(L, r, 1, n);
+    }
+  } else if(!any || --rf->remaining == 0) { /* rejected */
+    pushresult(L, s);
+    lua_settop(L, top + 1);
+    taggedcoro_complete(L, r, 0, 1);
+  }
+  lua_settop(L, top);
+}
+
+static int combinefire (lua_State *L, tc_Waiter *w) {
+  Node *node = (Node *)w;
+  int top = lua_gettop(L);
+  lua_getuservalue(L, -1);
+  lua_rawgeti(L, -1, 1);
+  lua_rawgeti(L, -2, 2);
+  combine(L, top + 2, top + 3, node->index, node->any);
+  lua_settop(L, top);
+  return 0;
+}
+
+static int callbackfire (lua_State *L, tc_Waiter *w) {
+  Future *f;
+  int n;
+  (void)w;
+  lua_getuservalue(L, -1);
+  lua_rawgeti(L, -1, 2); /* callback */
+  lua_rawgeti(L, -2, 1); /* future */
+  f = (Future *)lua_touserdata(L, -1);
+  lua_pushboolean(L, f->state == RESOLVED);
+  n = pushresult(L, -2);
+  lua_remove(L, -(n + 2)); /* future */
+  if(lua_pcall(L, n + 1, 0, 0) != LUA_OK) {
+    lua_remove(L, -2);
+    return 1;
+  }
+  lua_pop(L, 1);
+  return 0;
+}
+
+static Node *newnode (lua_State *L, int (*firefn) (lua_State *L, tc_Waiter *w)) {
+  Node *node = (Node *)lua_newuserdata(L, sizeof(Node));
+  memset(node, 0, sizeof(Node));
+  node->w.fire = firefn;
+  node->w.ref = LUA_NOREF;
+  return node;
+}
+
+static int future_callback (lua_State *L) {
+  Future *f = checkfuture(L, 1);
+  Node *node;
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_settop(L, 2);
+  if(f->state != PENDING) {
+    lua_pushboolean(L, f->state == RESOLVED);
+    lua_call(L, pushresult(L, 1) + 1, 0);
+    return 0;
+  }
+  node = newnode(L, callbackfire);
+  lua_createtable(L, 2, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, 2);
+  lua_setuservalue(L, -2);
+  taggedcoro_waitadd(L, &f->waiters, &node->w, 3);
+  return 0;
+}
+
+static int combinator (lua_State *L, int any) {
+  int n = lua_gettop(L), i;
+  Future *r;
+  for(i = 1; i <= n; i++) checkfuture(L, i);
+  if(any) luaL_argcheck(L, n > 0, 1, "future expected");
+  r = newfuture(L);
+  r->remaining = n;
+  lua_getuservalue(L, n + 1);
+  lua_pushinteger(L, n);
+  lua_setfield(L, -2, "count");
+  lua_pop(L, 1);
+  if(n == 0) { /* all of nothing */
+    taggedcoro_complete(L, n + 1, 1, 0);
+    return 1;
+  }
+  for(i = 1; i <= n; i++) {
+    Future *s = (Future *)lua_touserdata(L, i);
+    if(s->state != PENDING) {
+      combine(L, n + 1, i, i, any);
+    } else {
+      Node *node = newnode(L, combinefire);
+      node->index = i;
+      node->any = any;
+      lua_createtable(L, 2, 0);
+      lua_pushvalue(L, n + 1);
+      lua_rawseti(L, -2, 1);
+      lua_pushvalue(L, i);
+      lua_rawseti(L, -2, 2);
+      lua_setuservalue(L, -2);
+      taggedcoro_waitadd(L, &s->waiters, &node->w, -1);
+      lua_pop(L, 1);
+    }
+  }
+  lua_settop(L, n + 1);
+  return 1;
+}
+
+static int future_all (lua_State *L) {
+  return combinator(L, 0);
+}
+
+static int future_any (lua_State *L) {
+  return combinator(L, 1);
+}
+
+static int future_new (lua_State *L) {
+  newfuture(L);
+  return 1;
+}
+
+static int future_tostring (lua_State *L) {
+  Future *f = checkfuture(L, 1);
+  lua_pushfstring(L, "future (%s) (%p)", states[f->state], (void *)f);
+  return 1;
+}
+
+static int future_gc (lua_State *L) {
+  Future *f = checkfuture(L, 1);
+  while(f->waiters.head) taggedcoro_waitremove(L, f->waiters.head);
+  return 0;
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Running tasks from run queues
+** =======================================================
+*/
+
+/*
+** Creates an async task in the run queue at index runq that runs the
+** function at index first with the nargs values after it as arguments,
+** and pushes its coroutine and its future.
+*/
+void taggedcoro_spawn (lua_State *L, int runq, int first, int nargs) {
+  int co, fut, i;
+  lua_State *NL;
+  Task *t;
+  runq = lua_absindex(L, runq);
+  first = lua_absindex(L, first);
+  luaL_checkstack(L, 8, "too many arguments to spawn");
+  NL = lua_newthread(L);
+  co = lua_gettop(L);
+  if(!lua_checkstack(NL, nargs + 1)) luaL_error(L, "too many arguments to spawn");
+  for(i = first; i <= first + nargs; i++) lua_pushvalue(L, i);
+  lua_xmove(L, NL, nargs + 1); /* the first resume passes them along */
+  newfuture(L);
+  fut = lua_gettop(L);
+  t = (Task *)lua_newuserdata(L, sizeof(Task));
+  memset(t, 0, sizeof(Task));
+  t->w.fire = taskfire;
+  t->w.ref = LUA_NOREF;
+  luaL_setmetatable(L, TC_TASK);
+  lua_createtable(L, 3, 0); /* { co, runq, future } */
+  lua_pushvalue(L, co);
+  lua_rawseti(L, -2, 1);
+  lua_pushvalue(L, runq);
+  lua_rawseti(L, -2, 2);
+  lua_pushvalue(L, fut);
+  lua_rawseti(L, -2, 3);
+  lua_setuservalue(L, -2);
+  lua_pushvalue(L, co);
+  lua_pushliteral(L, TC_ASYNC);
+  taggedcoro_newmeta(L, -1);
+  lua_remove(L, -2); /* tag */
+  lua_pushvalue(L, -3);
+  lua_rawseti(L, -2, 11); /* meta[11] = task */
+  lua_rawset(L, lua_upvalueindex(1)); /* coroset[co] = meta */
+  taggedcoro_pushpriority(L, co);
+  taggedcoro_runqpush(L, runq, co, lua_tonumber(L, -1));
+  lua_settop(L, fut);
+}
+
+static int runq_spawn (lua_State *L) {
+  luaL_checkudata(L, 1, TC_RUNQ);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  taggedcoro_spawn(L, 1, 2, lua_gettop(L) - 2);
+  return 1;
+}
+
+LUA_KFUNCTION(runk) {
+  /* stack: runq, co, <results of co, or error> */
+  while(1) {
+    if(ctx) {
+      Task *t;
+      int n = lua_gettop(L) - 2;
+      lua_State *co = lua_tothread(L, 2);
+      t = pushtask(L, 2);
+      if(isdead(L, status, co)) {
+        Future *f;
+        lua_getuservalue(L, -1);
+        lua_rawgeti(L, -1, 3);
+        f = (Future *)lua_touserdata(L, -1);
+        lua_insert(L, 3);
+        lua_settop(L, n + 3);
+        if(f->state == PENDING) taggedcoro_complete(L, 3, status == LUA_OK || status == LUA_YIELD, n);
+      } else if(!t->blocked) { /* it yielded to let others run */
+        taggedcoro_pushpriority(L, 2);
+        taggedcoro_runqpush(L, 1, 2, lua_tonumber(L, -1));
+      }
+      lua_settop(L, 1);
+    }
+    if(!taggedcoro_runqpop(L, 1)) return 0;
+    lua_pop(L, 1); /* key */
+    if(!lua_isthread(L, 2) || !pushtask(L, 2))
+      return luaL_error(L, "run queue entry is not an async task");
+    lua_pop(L, 1);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushcclosure(L, taggedcoro_cocall, 1);
+    lua_pushvalue(L, 2);
+    ctx = 1;
+    status = lua_pcallk(L, 1, LUA_MULTRET, 0, ctx, runk);
+  }
+}
+
+static int runq_run (lua_State *L) {
+  luaL_checkudata(L, 1, TC_RUNQ);
+  lua_settop(L, 1);
+  return runk(L, LUA_OK, 0);
+}
+
+/* }====================================================== */
+
+static const luaL_Reg future_methods[] = {
+  {"await", future_await},
+  {"resolve", future_resolve},
+  {"reject", future_reject},
+  {"state", future_state},
+  {"callback", future_callback},
+  {NULL, NULL}
+};
+
+static const luaL_Reg future_meta[] = {
+  {"__tostring", future_tostring},
+  {"__gc", future_gc},
+  {NULL, NULL}
+};
+
+static const luaL_Reg runq_methods[] = {
+  {"spawn", runq_spawn},
+  {"run", runq_run},
+  {NULL, NULL}
+};
+
+static const luaL_Reg funcs[] = {
+  {"future", future_new},
+  {"all", future_all},
+  {"any", future_any},
+  {NULL, NULL}
+};
+
+void taggedcoro_openasync (lua_State *L) {
+  /* stack: module, coroset */
+  luaL_newmetatable(L, TC_FUTURE);
+  luaL_newlibtable(L, future_methods);
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, future_methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, future_meta, 1);
+  lua_pop(L, 1);
+  luaL_newmetatable(L, TC_TASK);
+  lua_pop(L, 1);
+  luaL_getmetatable(L, TC_RUNQ); /* run queues learn to run tasks */
+  lua_getfield(L, -1, "__index");
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, runq_methods, 1);
+  lua_pop(L, 2);
+  lua_pushvalue(L, -2);
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, funcs, 1);
+  lua_pop(L, 1);
+}
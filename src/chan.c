@@ -0,0 +1,388 @@
+/*
+** Channels for async tasks: bounded first-in, first-out buffers with
+** blocking send and receive. A value sent to a channel with a waiting
+** receiver goes straight to it; otherwise it goes to the buffer, and the
+** sender only blocks when the buffer is full (always, for a channel with
+** no buffer, until a receiver comes). A select waits on several channels
+** at once with one node per case in the wait lists of the channels, and
+** the first case to fire removes the others.
+*/
+
+#include <limits.h>
+#include <string.h>
+
+#include "taggedcoro.h"
+
+#define TC_CHAN "taggedcoro.chan"
+
+typedef struct Chan {
+  int cap;
+  int head;
+  int count;
+  int closed;
+  tc_WaitList sendq;
+  tc_WaitList recvq;
+} Chan;
+
+struct Select;
+
+typedef struct Case {
+  tc_Waiter w; /* must be the first field */
+  struct Select *sel;
+  Chan *ch;
+  int index;
+  int send;
+} Case;
+
+/*
+** A blocked send, receive or select; the uservalue has the channel and
+** the value to send of case i at 2i-1 and 2i, and the received value
+** and the blocked task in fields "value" and "task"
+*/
+typedef struct Select {
+  tc_Waiter *task;
+  int chosen;
+  int ok; /* a value was passed, rather than the channel closed */
+  int n;
+  Case cases[1];
+} Select;
+
+static Chan *checkchan (lua_State *L, int idx) {
+  return (Chan *)luaL_checkudata(L, idx, TC_CHAN);
+}
+
+static void pushowner (lua_State *L, tc_Waiter *w) {
+  lua_rawgeti(L, LUA_REGISTRYINDEX, w->ref);
+}
+
+/* stack: select; commits it to the case and wakes its task */
+static int casefire (lua_State *L, tc_Waiter *w) {
+  Case *c = (Case *)w;
+  Select *s = c->sel;
+  int i;
+  s->chosen = c->index;
+  for(i = 0; i < s->n; i++) taggedcoro_waitremove(L, &s->cases[i].w);
+  lua_getuservalue(L, -1);
+  lua_getfield(L, -1, "task");
+  if(s->task->fire(L, s->task)) {
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    return 1;
+  }
+  lua_pop(L, 2);
+  return 0;
+}
+
+/*
+** drops the selects of closed tasks from the front of the wait list, so
+** nothing is handed to a task that will never run again
+*/
+static void prune (lua_State *L, tc_WaitList *l) {
+  while(l->head) {
+    Select *s = ((Case *)l->head)->sel;
+    int i, closed;
+    pushowner(L, l->head);
+    lua_getuservalue(L, -1);
+    lua_getfield(L, -1, "task");
+    closed = taggedcoro_taskclosed(L, -1);
+    lua_pop(L, 2);
+    if(closed) {
+      for(i = 0; i < s->n; i++) taggedcoro_waitremove(L, &s->cases[i].w);
+    }
+    lua_pop(L, 1);
+    if(!closed) break;
+  }
+}
+
+/* sends the value at index v without blocking, if possible */
+static int trysend (lua_State *L, int c, int v) {
+  Chan *ch = (Chan *)lua_touserdata(L, c);
+  if(ch->closed) luaL_error(L, "send on closed channel");
+  prune(L, &ch->recvq);
+  if(ch->recvq.head) { /* hand it to a waiting receiver */
+    Case *r = (Case *)ch->recvq.head;
+    pushowner(L, &r->w);
+    lua_getuservalue(L, -1);
+    lua_pushvalue(L, v);
+    lua_setfield(L, -2, "value");
+    lua_pop(L, 2);
+    r->sel->ok = 1;
+    taggedcoro_wakeone(L, &ch->recvq);
+    return 1;
+  }
+  if(ch->count < ch->cap) {
+    lua_getuservalue(L, c);
+    lua_pushvalue(L, v);
+    lua_rawseti(L, -2, (ch->head + ch->count) % ch->cap + 1);
+    lua_pop(L, 1);
+    ch->count++;
+    return 1;
+  }
+  return 0;
+}
+
+/* pushes the value of the first waiting sender, which the caller wakes */
+static void takesend (lua_State *L, Chan *ch) {
+  Case *s = (Case *)ch->sendq.head;
+  pushowner(L, &s->w);
+  lua_getuservalue(L, -1);
+  lua_rawgeti(L, -1, 2 * s->index);
+  lua_replace(L, -3);
+  lua_pop(L, 1);
+  s->sel->ok = 1;
+}
+
+/*
+** Receives a value without blocking, if possible, and pushes it; ok
+** is set to 0 if the channel is closed and empty
+*/
+static int tryrecv (lua_State *L, int c, int *ok) {
+  Chan *ch = (Chan *)lua_touserdata(L, c);
+  *ok = 1;
+  prune(L, &ch->sendq);
+  if(ch->count > 0) {
+    lua_getuservalue(L, c);
+    lua_rawgeti(L, -1, ch->head + 1);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, ch->head + 1);
+    ch->head = (ch->head + 1) % ch->cap;
+    ch->count--;
+    if(ch->sendq.head) { /* the first waiting sender takes the free slot */
+      takesend(L, ch);
+      lua_rawseti(L, -3, (ch->head + ch->count) % ch->cap + 1);
+      ch->count++;
+      lua_remove(L, -2);
+      taggedcoro_wakeone(L, &ch->sendq);
+    } else {
+      lua_remove(L, -2);
+    }
+    return 1;
+  }
+  if(ch->sendq.head) {
+    takesend(L, ch);
+    taggedcoro_wakeone(L, &ch->sendq);
+    return 1;
+  }
+  if(ch->closed) {
+    lua_pushnil(L);
+    *ok = 0;
+    return 1;
+  }
+  return 0;
+}
+
+static Select *newselect (lua_State *L, int n) {
+  size_t size = sizeof(Select) + (size_t)(n - 1) * sizeof(Case);
+  Select *s = (Select *)lua_newuserdata(L, size);
+  int i;
+  memset(s, 0, size);
+  s->n = n;
+  for(i = 0; i < n; i++) {
+    s->cases[i].w.fire = casefire;
+    s->cases[i].w.ref = LUA_NOREF;
+    s->cases[i].sel = s;
+    s->cases[i].index = i + 1;
+  }
+  lua_createtable(L, 2 * n, 2);
+  lua_setuservalue(L, -2);
+  return s;
+}
+
+/* sets case i of the select on top to the channel at c and the value at v */
+static void setcase (lua_State *L, int i, int c, int v, int send) {
+  Select *s = (Select *)lua_touserdata(L, -1);
+  s->cases[i - 1].ch = (Chan *)lua_touserdata(L, c);
+  s->cases[i - 1].send = send;
+  lua_getuservalue(L, -1);
+  lua_pushvalue(L, c);
+  lua_rawseti(L, -2, 2 * i - 1);
+  lua_pushvalue(L, v);
+  lua_rawseti(L, -2, 2 * i);
+  lua_pop(L, 1);
+}
+
+/* ctx is 1 for select, which also returns the index of the case */
+LUA_KFUNCTION(selectk) {
+  /* stack: ..., select */
+  Select *s = (Select *)lua_touserdata(L, -1);
+  int n = 0;
+  (void)status;
+  if(s->chosen == 0) return luaL_error(L, "channel task resumed while blocked");
+  if(ctx) {
+    lua_pushinteger(L, s->chosen);
+    n++;
+  }
+  if(s->cases[s->chosen - 1].send) {
+    if(!s->ok) return luaL_error(L, "send on closed channel");
+    return n;
+  }
+  lua_getuservalue(L, -(n + 1));
+  lua_getfield(L, -1, "value");
+  lua_remove(L, -2);
+  lua_pushboolean(L, s->ok);
+  return n + 2;
+}
+
+/* blocks the running task on the cases of the select on top of the stack */
+static int waitselect (lua_State *L, int ctx) {
+  Select *s = (Select *)lua_touserdata(L, -1);
+  int sel = lua_gettop(L), i;
+  lua_pushliteral(L, TC_ASYNC);
+  if(!taggedcoro_canyield(L, -1))
+    return luaL_error(L, "attempt to block on a channel outside of an async task");
+  lua_pop(L, 1);
+  s->task = taggedcoro_block(L);
+  lua_getuservalue(L, sel);
+  lua_insert(L, -2);
+  lua_setfield(L, -2, "task");
+  lua_pop(L, 1);
+  for(i = 0; i < s->n; i++) {
+    Case *c = &s->cases[i];
+    taggedcoro_waitadd(L, c->send ? &c->ch->sendq : &c->ch->recvq, &c->w, sel);
+  }
+  lua_pushcfunction(L, taggedcoro_yield);
+  lua_pushliteral(L, TC_ASYNC);
+  lua_callk(L, 1, 0, ctx, selectk);
+  return selectk(L, LUA_OK, ctx);
+}
+
+static int chan_send (lua_State *L) {
+  checkchan(L, 1);
+  luaL_checkany(L, 2);
+  lua_settop(L, 2);
+  if(trysend(L, 1, 2)) return 0;
+  newselect(L, 1);
+  setcase(L, 1, 1, 2, 1);
+  return waitselect(L, 0);
+}
+
+static int chan_recv (lua_State *L) {
+  int ok;
+  checkchan(L, 1);
+  lua_settop(L, 1);
+  if(tryrecv(L, 1, &ok)) {
+    lua_pushboolean(L, ok);
+    return 2;
+  }
+  lua_pushnil(L);
+  newselect(L, 1);
+  setcase(L, 1, 1, 2, 0);
+  return waitselect(L, 0);
+}
+
+static int chan_close (lua_State *L) {
+  Chan *ch = checkchan(L, 1);
+  if(ch->closed) return luaL_error(L, "channel already closed");
+  ch->closed = 1;
+  while(ch->recvq.head) taggedcoro_wakeone(L, &ch->recvq);
+  while(ch->sendq.head) taggedcoro_wakeone(L, &ch->sendq);
+  return 0;
+}
+
+static int chan_closed (lua_State *L) {
+  lua_pushboolean(L, checkchan(L, 1)->closed);
+  return 1;
+}
+
+static int chan_len (lua_State *L) {
+  lua_pushinteger(L, checkchan(L, 1)->count);
+  return 1;
+}
+
+static int chan_tostring (lua_State *L) {
+  Chan *ch = checkchan(L, 1);
+  lua_pushfstring(L, "channel (%d/%d) (%p)", ch->count, ch->cap, (void *)ch);
+  return 1;
+}
+
+static int chan_new (lua_State *L) {
+  lua_Integer cap = luaL_optinteger(L, 1, 0);
+  Chan *ch;
+  luaL_argcheck(L, cap >= 0 && cap < INT_MAX, 1, "invalid capacity");
+  ch = (Chan *)lua_newuserdata(L, sizeof(Chan));
+  memset(ch, 0, sizeof(Chan));
+  ch->cap = (int)cap;
+  luaL_setmetatable(L, TC_CHAN);
+  lua_createtable(L, (int)cap, 0);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+/* pushes the channel and the value to send of case i of the select */
+static int getcase (lua_State *L, int i) {
+  int send = lua_rawgeti(L, 1, i) == LUA_TTABLE;
+  if(send) {
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);
+    lua_remove(L, -3);
+  } else {
+    lua_pushnil(L);
+  }
+  if(!luaL_testudata(L, -2, TC_CHAN))
+    luaL_error(L, "select case %d is not a channel", i);
+  return send;
+}
+
+static int chan_select (lua_State *L) {
+  int n, i, ok;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 2);
+  n = (int)lua_rawlen(L, 1);
+  luaL_argcheck(L, n > 0, 1, "no cases to select");
+  for(i = 1; i <= n; i++) { /* the first case that is ready wins */
+    int send = getcase(L, i);
+    if(send ? trysend(L, 3, 4) : tryrecv(L, 3, &ok)) {
+      lua_pushinteger(L, i);
+      if(send) return 1;
+      lua_insert(L, -2);
+      lua_pushboolean(L, ok);
+      return 3;
+    }
+    lua_settop(L, 2);
+  }
+  if(lua_toboolean(L, 2)) return 0; /* do not block */
+  newselect(L, n);
+  for(i = 1; i <= n; i++) {
+    int send = getcase(L, i);
+    lua_pushvalue(L, 3);
+    setcase(L, i, 4, 5, send);
+    lua_settop(L, 3);
+  }
+  return waitselect(L, 1);
+}
+
+static const luaL_Reg chan_methods[] = {
+  {"send", chan_send},
+  {"recv", chan_recv},
+  {"close", chan_close},
+  {"closed", chan_closed},
+  {NULL, NULL}
+};
+
+static const luaL_Reg chan_meta[] = {
+  {"__len", chan_len},
+  {"__tostring", chan_tostring},
+  {NULL, NULL}
+};
+
+static const luaL_Reg funcs[] = {
+  {"chan", chan_new},
+  {"select", chan_select},
+  {NULL, NULL}
+};
+
+void taggedcoro_openchan (lua_State *L) {
+  /* stack: module, coroset */
+  luaL_newmetatable(L, TC_CHAN);
+  luaL_newlibtable(L, chan_methods);
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, chan_methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, chan_meta, 1);
+  lua_pop(L, 1);
+  lua_pushvalue(L, -2);
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, funcs, 1);
+  lua_pop(L, 1);
+}
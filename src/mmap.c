@@ -0,0 +1,185 @@
+/*
+** Memory-mapped files, read as records split on a delimiter. Records
+** are handed out as slices of the mapping (or as strings, on request)
+** without copying the file into Lua strings; the mapping is a blob, so
+** it stays alive while any slice points into it. Pages behind the
+** record iterator are dropped as it goes, so a full scan of a file much
+** larger than memory keeps the resident set small.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "taggedcoro.h"
+
+#define TC_MMAP "taggedcoro.mmap"
+
+/* bytes scanned between drops of the pages behind the iterator */
+#define DROPSTEP (64 * 1024 * 1024)
+
+typedef struct Mapped {
+  tc_Blob *b; /* NULL once closed */
+} Mapped;
+
+static void unmap (tc_Blob *b) {
+  if(b->data) munmap(b->data, b->size);
+}
+
+static tc_Blob *checkblob (lua_State *L, int idx) {
+  Mapped *m = (Mapped *)luaL_checkudata(L, idx, TC_MMAP);
+  if(!m->b) luaL_error(L, "attempt to use a closed file");
+  return m->b;
+}
+
+static int mmap_open (lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  Mapped *m = (Mapped *)lua_newuserdata(L, sizeof(Mapped));
+  tc_Blob *b;
+  struct stat st;
+  int fd;
+  m->b = NULL;
+  luaL_setmetatable(L, TC_MMAP);
+  b = (tc_Blob *)calloc(1, sizeof(tc_Blob));
+  if(!b) return luaL_error(L, "not enough memory");
+  fd = open(path, O_RDONLY);
+  if(fd < 0 || fstat(fd, &st) < 0) {
+    int en = errno;
+    if(fd >= 0) close(fd);
+    free(b);
+    errno = en;
+    return luaL_fileresult(L, 0, path);
+  }
+  if(st.st_size > 0) {
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED) {
+      int en = errno;
+      close(fd);
+      free(b);
+      errno = en;
+      return luaL_fileresult(L, 0, path);
+    }
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    b->data = (char *)data;
+  }
+  close(fd);
+  atomic_init(&b->refs, 1);
+  b->size = b->cap = (size_t)st.st_size;
+  b->release = unmap;
+  m->b = b;
+  return 1;
+}
+
+/* upvalues: file, delimiter, strings, position, dropped up to */
+static int records_next (lua_State *L) {
+  tc_Blob *b = checkblob(L, lua_upvalueindex(1));
+  size_t dlen, pos = (size_t)lua_tointeger(L, lua_upvalueindex(4)), end;
+  size_t dropped = (size_t)lua_tointeger(L, lua_upvalueindex(5));
+  const char *delim = lua_tolstring(L, lua_upvalueindex(2), &dlen);
+  const char *s, *limit, *p;
+  if(pos >= b->size) return 0;
+  s = p = b->data + pos;
+  limit = b->data + b->size;
+  while((p = (const char *)memchr(p, delim[0], (size_t)(limit - p))) != NULL) {
+    if((size_t)(limit - p) >= dlen && memcmp(p, delim, dlen) == 0) break;
+    p++;
+  }
+  end = p ? (size_t)(p - b->data) : b->size;
+  lua_pushinteger(L, (lua_Integer)(p ? end + dlen : b->size));
+  lua_replace(L, lua_upvalueindex(4));
+  if(pos - dropped >= DROPSTEP) { /* let the kernel reclaim what is behind */
+    size_t page = (size_t)sysconf(_SC_PAGESIZE), upto = pos / page * page;
+    madvise(b->data + dropped, upto - dropped, MADV_DONTNEED);
+    lua_pushinteger(L, (lua_Integer)upto);
+    lua_replace(L, lua_upvalueindex(5));
+  }
+  if(lua_toboolean(L, lua_upvalueindex(3)))
+    lua_pushlstring(L, s, end - pos);
+  else
+    taggedcoro_pushslice(L, b, s, end - pos);
+  return 1;
+}
+
+static int mmap_records (lua_State *L) {
+  size_t dlen;
+  checkblob(L, 1);
+  if(lua_isnoneornil(L, 2)) {
+    lua_pushliteral(L, "\n");
+    lua_replace(L, 2);
+  }
+  luaL_checklstring(L, 2, &dlen);
+  luaL_argcheck(L, dlen > 0, 2, "empty delimiter");
+  lua_settop(L, 3);
+  lua_pushboolean(L, lua_toboolean(L, 3));
+  lua_replace(L, 3);
+  lua_pushinteger(L, 0);
+  lua_pushinteger(L, 0);
+  lua_pushcclosure(L, records_next, 5);
+  return 1;
+}
+
+static int mmap_sub (lua_State *L) {
+  tc_Blob *b = checkblob(L, 1);
+  lua_Integer i = luaL_optinteger(L, 2, 1), j = luaL_optinteger(L, 3, -1);
+  lua_Integer len = (lua_Integer)b->size;
+  if(i < 0) i = i < -len ? 1 : len + i + 1;
+  else if(i == 0) i = 1;
+  if(j < 0) j = len + j + 1;
+  else if(j > len) j = len;
+  if(i > j) taggedcoro_pushslice(L, b, b->data, 0);
+  else taggedcoro_pushslice(L, b, b->data + i - 1, (size_t)(j - i + 1));
+  return 1;
+}
+
+static int mmap_close (lua_State *L) {
+  Mapped *m = (Mapped *)luaL_checkudata(L, 1, TC_MMAP);
+  if(m->b) { /* slices keep the mapping until they are collected */
+    taggedcoro_blobunref(m->b);
+    m->b = NULL;
+  }
+  return 0;
+}
+
+static int mmap_len (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)checkblob(L, 1)->size);
+  return 1;
+}
+
+static int mmap_tostring (lua_State *L) {
+  Mapped *m = (Mapped *)luaL_checkudata(L, 1, TC_MMAP);
+  if(m->b) lua_pushfstring(L, "mapped file (%p)", (void *)m);
+  else lua_pushliteral(L, "mapped file (closed)");
+  return 1;
+}
+
+static const luaL_Reg mmap_methods[] = {
+  {"records", mmap_records},
+  {"sub", mmap_sub},
+  {"close", mmap_close},
+  {NULL, NULL}
+};
+
+static const luaL_Reg mmap_meta[] = {
+  {"__len", mmap_len},
+  {"__tostring", mmap_tostring},
+  {"__gc", mmap_close},
+  {NULL, NULL}
+};
+
+void taggedcoro_openmmap (lua_State *L) {
+  /* stack: module, coroset */
+  luaL_newmetatable(L, TC_MMAP);
+  luaL_newlibtable(L, mmap_methods);
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, mmap_methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, mmap_meta, 1);
+  lua_pop(L, 1);
+  lua_pushcfunction(L, mmap_open);
+  lua_setfield(L, -3, "mmap");
+}
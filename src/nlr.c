@@ -0,0 +1,74 @@
+/*
+** Non-local returns without coroutines: nlrrun calls its body in a
+** protected call, and nlrret raises a token carrying the values to
+** return, which the innermost nlrrun catches and returns. The call has a
+** continuation, so the body can still yield other tags through it.
+*/
+
+#include "taggedcoro.h"
+
+#define TC_NLR "taggedcoro.nlr"
+
+static int nlr_tostring (lua_State *L) {
+  lua_pushliteral(L, "non-local return outside of nlr.run");
+  return 1;
+}
+
+static int nlr_ret (lua_State *L) {
+  int n = lua_gettop(L), i;
+  lua_createtable(L, n, 1);
+  for(i = 1; i <= n; i++) {
+    lua_pushvalue(L, i);
+    lua_rawseti(L, -2, i);
+  }
+  lua_pushinteger(L, n);
+  lua_setfield(L, -2, "n");
+  luaL_setmetatable(L, TC_NLR);
+  return lua_error(L);
+}
+
+static int istoken (lua_State *L, int idx) {
+  int r;
+  if(!lua_istable(L, idx) || !lua_getmetatable(L, idx)) return 0;
+  luaL_getmetatable(L, TC_NLR);
+  r = lua_rawequal(L, -1, -2);
+  lua_pop(L, 2);
+  return r;
+}
+
+LUA_KFUNCTION(nlrk) {
+  int n, i;
+  if(status == LUA_OK || status == LUA_YIELD) /* returned normally */
+    return lua_gettop(L) - (int)ctx;
+  if(!istoken(L, -1)) return lua_error(L); /* not ours, rethrow */
+  lua_getfield(L, -1, "n");
+  n = (int)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  luaL_checkstack(L, n, "too many results");
+  for(i = 1; i <= n; i++) lua_rawgeti(L, -i, i);
+  return n;
+}
+
+static int nlr_isnlr (lua_State *L) {
+  lua_pushboolean(L, istoken(L, 1));
+  return 1;
+}
+
+static int nlr_run (lua_State *L) {
+  luaL_checkany(L, 1);
+  return nlrk(L, lua_pcallk(L, lua_gettop(L) - 1, LUA_MULTRET, 0, 0, nlrk), 0);
+}
+
+void taggedcoro_opennlr (lua_State *L) {
+  /* stack: module, coroset */
+  luaL_newmetatable(L, TC_NLR);
+  lua_pushcfunction(L, nlr_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pop(L, 1);
+  lua_pushcfunction(L, nlr_run);
+  lua_setfield(L, -3, "nlrrun");
+  lua_pushcfunction(L, nlr_ret);
+  lua_setfield(L, -3, "nlrret");
+  lua_pushcfunction(L, nlr_isnlr);
+  lua_setfield(L, -3, "isnlr");
+}
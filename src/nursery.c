@@ -0,0 +1,297 @@
+/*
+** Nurseries for structured concurrency. A nursery runs its body and
+** every coroutine spawned into it round-robin, moving to the next one
+** whenever a coroutine yields with the nursery's tag, and only returns
+** when all of them are dead. Cancelling a nursery closes every coroutine
+** in its subtree (including the ones stacked above them and the ones
+** in nested nurseries) without resuming them.
+*/
+
+#include "taggedcoro.h"
+
+#define TC_NURSERY "taggedcoro.nursery"
+
+typedef struct Nursery {
+  int cancelled;
+  int done;
+} Nursery;
+
+static Nursery *checknursery (lua_State *L, int idx) {
+  return (Nursery *)luaL_checkudata(L, idx, TC_NURSERY);
+}
+
+/*
+** Creates a coroutine in the nursery at index nursery, running the function
+** at index first with the nargs values after it as arguments, and pushes it.
+*/
+static void spawn (lua_State *L, int nursery, int first, int nargs) {
+  lua_State *NL;
+  int i;
+  luaL_checkstack(L, nargs + 4, "too many arguments to spawn");
+  lua_getuservalue(L, nursery);
+  NL = lua_newthread(L);
+  if(!lua_checkstack(NL, nargs + 1)) luaL_error(L, "too many arguments to spawn");
+  for(i = 0; i <= nargs; i++) lua_pushvalue(L, first + i);
+  lua_xmove(L, NL, nargs + 1); /* the first resume passes them along */
+  lua_pushvalue(L, -1);
+  lua_getfield(L, -3, "tag");
+  taggedcoro_newmeta(L, -1);
+  lua_remove(L, -2); /* tag */
+  lua_pushvalue(L, nursery);
+  lua_rawseti(L, -2, 9); /* meta[9] = nursery */
+  lua_rawset(L, lua_upvalueindex(1)); /* coroset[co] = meta */
+  /* stack: uservalue, co */
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, -3, (lua_Integer)lua_rawlen(L, -3) + 1);
+  lua_remove(L, -2);
+}
+
+/*
+** Cancels the nursery at index idx and its nested nurseries. Returns 1
+** if some coroutine could not be closed because it is running, that is,
+** the cancel came from inside the nursery.
+*/
+static int cancel (lua_State *L, int idx) {
+  Nursery *n = (Nursery *)lua_touserdata(L, idx);
+  int inside = 0, count, i;
+  idx = lua_absindex(L, idx);
+  n->cancelled = 1;
+  lua_getuservalue(L, idx);
+  lua_getfield(L, -1, "subs");
+  lua_pushnil(L);
+  while(lua_next(L, -2)) {
+    lua_pop(L, 1);
+    inside |= cancel(L, -1);
+  }
+  lua_pop(L, 1); /* subs */
+  count = (int)lua_rawlen(L, -1);
+  for(i = 1; i <= count; i++) {
+    lua_rawgeti(L, -1, i);
+    if(!taggedcoro_close(L, -1)) inside = 1;
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1); /* uservalue */
+  return inside;
+}
+
+static int isdead (lua_State *L, int idx) {
+  lua_State *co = lua_tothread(L, idx);
+  lua_Debug ar;
+  int closed;
+  switch(lua_status(co)) {
+    case LUA_OK:
+      return lua_getstack(co, 0, &ar) == 0 && lua_gettop(co) == 0;
+    case LUA_YIELD:
+      lua_pushvalue(L, idx);
+      if(lua_rawget(L, lua_upvalueindex(1)) == LUA_TNIL) { /* coroset[co] */
+        lua_pop(L, 1);
+        return 0;
+      }
+      closed = lua_rawgeti(L, -1, 8) != LUA_TNIL;
+      lua_pop(L, 2);
+      return closed;
+    default:
+      return 1;
+  }
+}
+
+/* stack: nursery, uservalue, ... */
+static void leave (lua_State *L) {
+  Nursery *n = (Nursery *)lua_touserdata(L, 1);
+  n->done = 1;
+  if(lua_getfield(L, 2, "parent") != LUA_TNIL) { /* leave the enclosing nursery */
+    lua_getuservalue(L, -1);
+    lua_getfield(L, -1, "subs");
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 2);
+  }
+  lua_pop(L, 1);
+}
+
+/* stack: nursery, uservalue */
+static int finish (lua_State *L) {
+  Nursery *n = (Nursery *)lua_touserdata(L, 1);
+  int nres, i;
+  leave(L);
+  if(n->cancelled) {
+    cancel(L, 1); /* close the leftovers */
+    lua_pushnil(L);
+    taggedcoro_pushcancelled(L);
+    return 2;
+  }
+  lua_getfield(L, 2, "nresults");
+  nres = (int)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  lua_getfield(L, 2, "results");
+  luaL_checkstack(L, nres, "too many results");
+  for(i = 1; i <= nres; i++) lua_rawgeti(L, 3, i);
+  return nres;
+}
+
+LUA_KFUNCTION(nurseryk) {
+  /* stack: nursery, uservalue, <results of child ctx, or error> */
+  Nursery *n = (Nursery *)lua_touserdata(L, 1);
+  int i = (int)ctx, count;
+  while(1) {
+    if(i > 0) {
+      lua_rawgeti(L, 2, i);
+      if(status != LUA_OK && status != LUA_YIELD) { /* child failed */
+        taggedcoro_pushcancelled(L);
+        if(!lua_rawequal(L, -1, -3)) { /* cancel the others and propagate */
+          lua_pop(L, 2);
+          cancel(L, 1);
+          leave(L);
+          return lua_error(L);
+        }
+        lua_pop(L, 1);
+      }
+      if(isdead(L, -1)) {
+        lua_getfield(L, 2, "body");
+        if((status == LUA_OK || status == LUA_YIELD) && lua_rawequal(L, -1, -2)) {
+          int nres = lua_gettop(L) - 4, j; /* keep the results of the body */
+          lua_pop(L, 2);
+          lua_createtable(L, nres, 0);
+          lua_insert(L, 3);
+          for(j = nres; j >= 1; j--) lua_rawseti(L, 3, j);
+          lua_setfield(L, 2, "results");
+          lua_pushinteger(L, nres);
+          lua_setfield(L, 2, "nresults");
+        }
+        count = (int)lua_rawlen(L, 2);
+        for(; i < count; i++) { /* remove it */
+          lua_rawgeti(L, 2, i + 1);
+          lua_rawseti(L, 2, i);
+        }
+        lua_pushnil(L);
+        lua_rawseti(L, 2, count);
+        i--;
+      }
+      lua_settop(L, 2);
+    }
+    count = (int)lua_rawlen(L, 2);
+    if(n->cancelled || count == 0) return finish(L);
+    i = i < count ? i + 1 : 1;
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushcclosure(L, taggedcoro_cocall, 1);
+    lua_rawgeti(L, 2, i);
+    status = lua_pcallk(L, 1, LUA_MULTRET, 0, i, nurseryk);
+  }
+}
+
+static int nursery_spawn (lua_State *L) {
+  Nursery *n = checknursery(L, 1);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  if(n->done) return luaL_error(L, "nursery is finished");
+  if(n->cancelled) return luaL_error(L, "nursery is cancelled");
+  spawn(L, 1, 2, lua_gettop(L) - 2);
+  return 1;
+}
+
+static int nursery_cancel (lua_State *L) {
+  checknursery(L, 1);
+  if(cancel(L, 1)) { /* unwind the running coroutine */
+    taggedcoro_pushcancelled(L);
+    return lua_error(L);
+  }
+  return 0;
+}
+
+static int nursery_cancelled (lua_State *L) {
+  lua_pushboolean(L, checknursery(L, 1)->cancelled);
+  return 1;
+}
+
+static int nursery_len (lua_State *L) {
+  checknursery(L, 1);
+  lua_getuservalue(L, 1);
+  lua_pushinteger(L, (lua_Integer)lua_rawlen(L, -1));
+  return 1;
+}
+
+static int nursery_tostring (lua_State *L) {
+  lua_pushfstring(L, "nursery (%p)", lua_touserdata(L, 1));
+  return 1;
+}
+
+static int nursery_new (lua_State *L) {
+  Nursery *n;
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  if(lua_isnoneornil(L, 2)) {
+    lua_pushliteral(L, "nursery");
+    lua_replace(L, 2);
+  }
+  lua_settop(L, 2);
+  n = (Nursery *)lua_newuserdata(L, sizeof(Nursery));
+  n->cancelled = 0;
+  n->done = 0;
+  luaL_setmetatable(L, TC_NURSERY);
+  lua_newtable(L);
+  lua_pushvalue(L, 2);
+  lua_setfield(L, -2, "tag");
+  lua_newtable(L); /* nested nurseries */
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, -2, "subs");
+  lua_setuservalue(L, 3);
+  lua_pushthread(L); /* find the enclosing nursery, if any */
+  while(lua_rawget(L, lua_upvalueindex(1)) != LUA_TNIL) {
+    if(lua_rawgeti(L, -1, 9) != LUA_TNIL) { /* coroset[co].nursery */
+      lua_getuservalue(L, 3);
+      lua_pushvalue(L, -2);
+      lua_setfield(L, -2, "parent");
+      lua_pop(L, 1);
+      lua_getuservalue(L, -1);
+      lua_getfield(L, -1, "subs");
+      lua_pushvalue(L, 3);
+      lua_pushboolean(L, 1);
+      lua_rawset(L, -3);
+      break;
+    }
+    lua_pop(L, 1);
+    if(lua_rawgeti(L, -1, 3) == LUA_TNIL) break; /* coroset[co].parent */
+    lua_remove(L, -2);
+  }
+  lua_settop(L, 3);
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, 3);
+  spawn(L, 3, 4, 1); /* the body receives the nursery */
+  lua_getuservalue(L, 3);
+  lua_insert(L, -2);
+  lua_setfield(L, -2, "body");
+  lua_replace(L, 2);
+  lua_settop(L, 3);
+  lua_replace(L, 1); /* stack: nursery, uservalue */
+  return nurseryk(L, LUA_OK, 0);
+}
+
+static const luaL_Reg nursery_methods[] = {
+  {"spawn", nursery_spawn},
+  {"cancel", nursery_cancel},
+  {"cancelled", nursery_cancelled},
+  {NULL, NULL}
+};
+
+static const luaL_Reg nursery_meta[] = {
+  {"__len", nursery_len},
+  {"__tostring", nursery_tostring},
+  {NULL, NULL}
+};
+
+void taggedcoro_opennursery (lua_State *L) {
+  /* stack: module, coroset */
+  luaL_newmetatable(L, TC_NURSERY);
+  luaL_newlibtable(L, nursery_methods);
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, nursery_methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, nursery_meta, 1);
+  lua_pop(L, 1);
+  lua_pushvalue(L, -1);
+  lua_pushcclosure(L, nursery_new, 1);
+  lua_setfield(L, -3, "nursery");
+}
@@ -0,0 +1,485 @@
+/*
+** Bounded lock-free queues that can be shared between lua_States
+** running on different OS threads. SPSC queues are Lamport ring
+** buffers with cached indices; MPMC queues use per-cell sequence
+** numbers (Vyukov). Blocking operations sleep on an eventfd (a pipe
+** outside Linux), or hand the descriptor to the scheduler with a
+** tagged yield if there is a coroutine for that tag.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "taggedcoro.h"
+
+#define CACHELINE 64
+#define DEFAULT_CAPACITY 1024
+
+static const char *const kinds[] = { "mpmc", "spsc", NULL };
+
+typedef struct Waitpoint {
+  int fd[2]; /* read and write ends, the same eventfd on Linux */
+  atomic_int waiters;
+} Waitpoint;
+
+typedef struct Cell {
+  atomic_size_t seq; /* MPMC only */
+  tc_Value v;
+} Cell;
+
+struct tc_Queue {
+  atomic_int refs;
+  int spsc;
+  size_t mask; /* capacity - 1 */
+  Waitpoint notempty;
+  Waitpoint notfull;
+  alignas(CACHELINE) atomic_size_t head; /* next slot to pop */
+  size_t tailcache; /* consumer's last view of tail (SPSC) */
+  alignas(CACHELINE) atomic_size_t tail; /* next slot to push */
+  size_t headcache; /* producer's last view of head (SPSC) */
+  alignas(CACHELINE) Cell cells[];
+};
+
+/*
+** {======================================================
+** Wait points
+** =======================================================
+*/
+
+static int wp_init (Waitpoint *w) {
+  atomic_init(&w->waiters, 0);
+#ifdef __linux__
+  w->fd[0] = w->fd[1] = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE | EFD_CLOEXEC);
+  return w->fd[0] >= 0;
+#else
+  if(pipe(w->fd) < 0) return 0;
+  fcntl(w->fd[0], F_SETFL, O_NONBLOCK);
+  fcntl(w->fd[1], F_SETFL, O_NONBLOCK);
+  return 1;
+#endif
+}
+
+static void wp_close (Waitpoint *w) {
+  close(w->fd[0]);
+  if(w->fd[1] != w->fd[0]) close(w->fd[1]);
+}
+
+/* called after making progress, wakes one waiter if there is any */
+static void wp_signal (Waitpoint *w) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if(atomic_load_explicit(&w->waiters, memory_order_relaxed) > 0) {
+#ifdef __linux__
+    uint64_t one = 1;
+#else
+    char one = 1;
+#endif
+    ssize_t r = write(w->fd[1], &one, sizeof(one));
+    (void)r; /* a full pipe is already readable */
+  }
+}
+
+/* eats one wakeup token, if there is one */
+static void wp_consume (Waitpoint *w) {
+#ifdef __linux__
+  uint64_t token;
+#else
+  char token;
+#endif
+  ssize_t r = read(w->fd[0], &token, sizeof(token));
+  (void)r;
+}
+
+static void wp_enter (Waitpoint *w) {
+  atomic_fetch_add(&w->waiters, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void wp_leave (Waitpoint *w) {
+  atomic_fetch_sub(&w->waiters, 1);
+}
+
+/* blocks the OS thread until the wait point is signaled */
+static void wp_block (Waitpoint *w) {
+  struct pollfd p;
+  p.fd = w->fd[0];
+  p.events = POLLIN;
+  p.revents = 0;
+  while(poll(&p, 1, -1) < 0 && errno == EINTR);
+  wp_consume(w);
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Ring buffers
+** =======================================================
+*/
+
+/* largest capacity whose cells, after rounding up, fit in a size_t */
+static size_t q_maxcapacity (void) {
+  size_t max = (SIZE_MAX - sizeof(tc_Queue)) / sizeof(Cell), size = 1;
+  while(size <= max / 2) size <<= 1;
+  return size;
+}
+
+static tc_Queue *q_new (size_t capacity, int spsc) {
+  size_t size = 1, i;
+  while(size < capacity) size <<= 1;
+  tc_Queue *q;
+  if(posix_memalign((void**)&q, CACHELINE, sizeof(tc_Queue) + size * sizeof(Cell)))
+    return NULL;
+  if(!wp_init(&q->notempty)) {
+    free(q);
+    return NULL;
+  }
+  if(!wp_init(&q->notfull)) {
+    wp_close(&q->notempty);
+    free(q);
+    return NULL;
+  }
+  atomic_init(&q->refs, 1);
+  q->spsc = spsc;
+  q->mask = size - 1;
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  q->headcache = q->tailcache = 0;
+  for(i = 0; i < size; i++) {
+    atomic_init(&q->cells[i].seq, i);
+    q->cells[i].v.type = TC_VNIL;
+  }
+  return q;
+}
+
+static int spsc_push (tc_Queue *q, tc_Value *v) {
+  size_t t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  if(t - q->headcache > q->mask) {
+    q->headcache = atomic_load_explicit(&q->head, memory_order_acquire);
+    if(t - q->headcache > q->mask) return 0; /* full */
+  }
+  q->cells[t & q->mask].v = *v;
+  atomic_store_explicit(&q->tail, t + 1, memory_order_release);
+  return 1;
+}
+
+static int spsc_pop (tc_Queue *q, tc_Value *v) {
+  size_t h = atomic_load_explicit(&q->head, memory_order_relaxed);
+  if(h == q->tailcache) {
+    q->tailcache = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if(h == q->tailcache) return 0; /* empty */
+  }
+  *v = q->cells[h & q->mask].v;
+  atomic_store_explicit(&q->head, h + 1, memory_order_release);
+  return 1;
+}
+
+static int mpmc_push (tc_Queue *q, tc_Value *v) {
+  size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  Cell *cell;
+  for(;;) {
+    cell = &q->cells[pos & q->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+    if(dif == 0) {
+      if(atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                               memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if(dif < 0) {
+      return 0; /* full */
+    } else {
+      pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+  }
+  cell->v = *v;
+  atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+  return 1;
+}
+
+static int mpmc_pop (tc_Queue *q, tc_Value *v) {
+  size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  Cell *cell;
+  for(;;) {
+    cell = &q->cells[pos & q->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+    if(dif == 0) {
+      if(atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                               memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if(dif < 0) {
+      return 0; /* empty */
+    } else {
+      pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+  }
+  *v = cell->v;
+  atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+  return 1;
+}
+
+static int q_push (tc_Queue *q, tc_Value *v) {
+  if(!(q->spsc ? spsc_push(q, v) : mpmc_push(q, v))) return 0;
+  wp_signal(&q->notempty);
+  return 1;
+}
+
+static int q_pop (tc_Queue *q, tc_Value *v) {
+  if(!(q->spsc ? spsc_pop(q, v) : mpmc_pop(q, v))) return 0;
+  wp_signal(&q->notfull);
+  return 1;
+}
+
+static size_t q_len (tc_Queue *q) {
+  size_t h = atomic_load_explicit(&q->head, memory_order_relaxed);
+  size_t t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  return t > h ? t - h : 0;
+}
+
+void taggedcoro_queueref (tc_Queue *q) {
+  atomic_fetch_add(&q->refs, 1);
+}
+
+void taggedcoro_queueunref (tc_Queue *q) {
+  if(atomic_fetch_sub(&q->refs, 1) == 1) {
+    tc_Value v;
+    while(q_pop(q, &v)) taggedcoro_freevalue(&v);
+    wp_close(&q->notempty);
+    wp_close(&q->notfull);
+    free(q);
+  }
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Lua interface
+** =======================================================
+*/
+
+void taggedcoro_pushqueue (lua_State *L, tc_Queue *q) {
+  tc_Queue **b = (tc_Queue **)lua_newuserdata(L, sizeof(tc_Queue *));
+  *b = q;
+  luaL_setmetatable(L, TC_QUEUE);
+}
+
+tc_Queue *taggedcoro_toqueue (lua_State *L, int idx) {
+  tc_Queue **b = (tc_Queue **)luaL_testudata(L, idx, TC_QUEUE);
+  return b ? *b : NULL;
+}
+
+static tc_Queue *checkqueue (lua_State *L, int idx) {
+  tc_Queue *q = *(tc_Queue **)luaL_checkudata(L, idx, TC_QUEUE);
+  if(!q) luaL_error(L, "attempt to use a collected queue");
+  return q;
+}
+
+static void checktag (lua_State *L, int idx) {
+  if(lua_isnoneornil(L, idx)) {
+    lua_pushliteral(L, "queue");
+    lua_replace(L, idx);
+  }
+}
+
+/*
+** Blocking operations try the fast path, then register as waiters and
+** try again before waiting: with a tagged yield of the queue and the
+** descriptor to poll if a coroutine for the tag is reachable, or by
+** blocking the OS thread otherwise.
+*/
+
+LUA_KFUNCTION(popk) {
+  /* stack: queue, tag */
+  tc_Queue *q = checkqueue(L, 1);
+  tc_Value v;
+  if(status == LUA_YIELD) {
+    lua_settop(L, 2);
+    wp_consume(&q->notempty);
+    wp_leave(&q->notempty);
+  }
+  while(!q_pop(q, &v)) {
+    wp_enter(&q->notempty);
+    if(q_pop(q, &v)) {
+      wp_leave(&q->notempty);
+      break;
+    }
+    if(taggedcoro_canyield(L, 2)) {
+      lua_pushcfunction(L, taggedcoro_yield);
+      lua_pushvalue(L, 2);
+      lua_pushvalue(L, 1);
+      lua_pushinteger(L, q->notempty.fd[0]);
+      lua_callk(L, 3, 0, 0, popk);
+      return popk(L, LUA_YIELD, 0);
+    }
+    wp_block(&q->notempty);
+    wp_leave(&q->notempty);
+  }
+  taggedcoro_pushvalue(L, &v);
+  return 1;
+}
+
+static int queue_pop (lua_State *L) {
+  checkqueue(L, 1);
+  lua_settop(L, 2);
+  checktag(L, 2);
+  return popk(L, LUA_OK, 0);
+}
+
+static void tovalue (lua_State *L, int idx, tc_Value *v) {
+  if(!taggedcoro_tovalue(L, idx, v))
+    luaL_argerror(L, idx, lua_pushfstring(L, "cannot send a %s to another state",
+                                          luaL_typename(L, idx)));
+}
+
+LUA_KFUNCTION(pushk) {
+  /* stack: queue, value, tag */
+  tc_Queue *q = checkqueue(L, 1);
+  tc_Value v;
+  if(status == LUA_YIELD) {
+    lua_settop(L, 3);
+    wp_consume(&q->notfull);
+    wp_leave(&q->notfull);
+  }
+  tovalue(L, 2, &v);
+  while(!q_push(q, &v)) {
+    wp_enter(&q->notfull);
+    if(q_push(q, &v)) {
+      wp_leave(&q->notfull);
+      break;
+    }
+    if(taggedcoro_canyield(L, 3)) {
+      taggedcoro_freevalue(&v); /* converted again when resumed */
+      lua_pushcfunction(L, taggedcoro_yield);
+      lua_pushvalue(L, 3);
+      lua_pushvalue(L, 1);
+      lua_pushinteger(L, q->notfull.fd[0]);
+      lua_callk(L, 3, 0, 0, pushk);
+      return pushk(L, LUA_YIELD, 0);
+    }
+    wp_block(&q->notfull);
+    wp_leave(&q->notfull);
+  }
+  return 0;
+}
+
+static int queue_push (lua_State *L) {
+  checkqueue(L, 1);
+  lua_settop(L, 3);
+  checktag(L, 3);
+  return pushk(L, LUA_OK, 0);
+}
+
+static int queue_trypush (lua_State *L) {
+  tc_Queue *q = checkqueue(L, 1);
+  tc_Value v;
+  tovalue(L, 2, &v);
+  if(q_push(q, &v)) {
+    lua_pushboolean(L, 1);
+  } else {
+    taggedcoro_freevalue(&v);
+    lua_pushboolean(L, 0);
+  }
+  return 1;
+}
+
+static int queue_trypop (lua_State *L) {
+  tc_Queue *q = checkqueue(L, 1);
+  tc_Value v;
+  if(!q_pop(q, &v)) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  lua_pushboolean(L, 1);
+  taggedcoro_pushvalue(L, &v);
+  return 2;
+}
+
+static int queue_fd (lua_State *L) {
+  tc_Queue *q = checkqueue(L, 1);
+  lua_pushinteger(L, q->notempty.fd[0]);
+  lua_pushinteger(L, q->notfull.fd[0]);
+  return 2;
+}
+
+static int queue_capacity (lua_State *L) {
+  tc_Queue *q = checkqueue(L, 1);
+  lua_pushinteger(L, (lua_Integer)(q->mask + 1));
+  lua_pushstring(L, kinds[q->spsc]);
+  return 2;
+}
+
+static int queue_len (lua_State *L) {
+  tc_Queue *q = checkqueue(L, 1);
+  lua_pushinteger(L, (lua_Integer)q_len(q));
+  return 1;
+}
+
+static int queue_tostring (lua_State *L) {
+  tc_Queue *q = checkqueue(L, 1);
+  lua_pushfstring(L, "%s queue (%p)", kinds[q->spsc], (void *)q);
+  return 1;
+}
+
+static int queue_gc (lua_State *L) {
+  tc_Queue **b = (tc_Queue **)luaL_checkudata(L, 1, TC_QUEUE);
+  if(*b) {
+    taggedcoro_queueunref(*b);
+    *b = NULL;
+  }
+  return 0;
+}
+
+static int queue_new (lua_State *L) {
+  lua_Integer capacity = luaL_optinteger(L, 1, DEFAULT_CAPACITY);
+  int spsc = luaL_checkoption(L, 2, "mpmc", kinds);
+  luaL_argcheck(L, capacity > 0, 1, "capacity must be positive");
+  luaL_argcheck(L, (uintmax_t)capacity <= q_maxcapacity(), 1, "capacity too large");
+  tc_Queue *q = q_new((size_t)capacity, spsc);
+  if(!q) return luaL_error(L, "cannot create queue: %s", strerror(errno));
+  taggedcoro_pushqueue(L, q);
+  return 1;
+}
+
+static const luaL_Reg queue_methods[] = {
+  {"push", queue_push},
+  {"pop", queue_pop},
+  {"trypush", queue_trypush},
+  {"trypop", queue_trypop},
+  {"fd", queue_fd},
+  {"capacity", queue_capacity},
+  {NULL, NULL}
+};
+
+static const luaL_Reg queue_meta[] = {
+  {"__len", queue_len},
+  {"__tostring", queue_tostring},
+  {"__gc", queue_gc},
+  {NULL, NULL}
+};
+
+void taggedcoro_openqueue (lua_State *L) {
+  /* stack: module, coroset */
+  luaL_newmetatable(L, TC_QUEUE);
+  luaL_newlibtable(L, queue_methods);
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, queue_methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, queue_meta, 1);
+  lua_pop(L, 1);
+  lua_pushvalue(L, -1);
+  lua_pushcclosure(L, queue_new, 1);
+  lua_setfield(L, -3, "queue");
+}
+
+/* }====================================================== */
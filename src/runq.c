@@ -0,0 +1,284 @@
+/*
+** Run queues for scheduler loops: a pairing heap of tasks ordered by
+** a numeric key (a priority, or a deadline for earliest-deadline-first
+** scheduling), with ties broken in first-in, first-out order. Nodes live
+** in a single array and are linked by index; the tasks themselves are
+** kept in the uservalue table of the run queue, indexed by node.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "taggedcoro.h"
+
+#define NONE (-1)
+
+typedef struct Node {
+  lua_Number key;
+  uint64_t seq;
+  int child;
+  int sibling; /* next sibling, or next free node */
+} Node;
+
+typedef struct RunQ {
+  Node *nodes;
+  int cap;
+  int size;
+  int root;
+  int free;
+  uint64_t seq;
+} RunQ;
+
+static RunQ *checkrunq (lua_State *L, int idx) {
+  return (RunQ *)luaL_checkudata(L, idx, TC_RUNQ);
+}
+
+static int before (RunQ *q, int a, int b) {
+  Node *na = &q->nodes[a], *nb = &q->nodes[b];
+  return na->key < nb->key || (na->key == nb->key && na->seq < nb->seq);
+}
+
+static int meld (RunQ *q, int a, int b) {
+  if(a == NONE) return b;
+  if(b == NONE) return a;
+  if(before(q, b, a)) {
+    int t = a;
+    a = b;
+    b = t;
+  }
+  q->nodes[b].sibling = q->nodes[a].child;
+  q->nodes[a].child = b;
+  return a;
+}
+
+/* standard two-pass merge of the children of a removed root */
+static int mergepairs (RunQ *q, int first) {
+  int pairs = NONE, root = NONE;
+  while(first != NONE) {
+    int a = first, b = q->nodes[a].sibling, m;
+    if(b == NONE) {
+      first = NONE;
+    } else {
+      first = q->nodes[b].sibling;
+      q->nodes[b].sibling = NONE;
+    }
+    q->nodes[a].sibling = NONE;
+    m = meld(q, a, b);
+    q->nodes[m].sibling = pairs; /* reversed list of melded pairs */
+    pairs = m;
+  }
+  while(pairs != NONE) {
+    int next = q->nodes[pairs].sibling;
+    q->nodes[pairs].sibling = NONE;
+    root = meld(q, root, pairs);
+    pairs = next;
+  }
+  return root;
+}
+
+static int newnode (lua_State *L, RunQ *q) {
+  int n;
+  if(q->free == NONE) {
+    int cap = q->cap ? q->cap * 2 : 16, i;
+    Node *nodes;
+    if(cap <= q->cap) luaL_error(L, "run queue overflow");
+    nodes = (Node *)realloc(q->nodes, (size_t)cap * sizeof(Node));
+    if(!nodes) luaL_error(L, "not enough memory");
+    for(i = q->cap; i < cap; i++) nodes[i].sibling = i + 1 < cap ? i + 1 : NONE;
+    q->nodes = nodes;
+    q->free = q->cap;
+    q->cap = cap;
+  }
+  n = q->free;
+  q->free = q->nodes[n].sibling;
+  return n;
+}
+
+/* the key of a task pushed without one: its priority, if it is a coroutine */
+static lua_Number defaultkey (lua_State *L, int task) {
+  lua_Number key = 0;
+  if(lua_isthread(L, task)) {
+    taggedcoro_pushpriority(L, task);
+    key = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+  }
+  return key;
+}
+
+void taggedcoro_runqpush (lua_State *L, int runq, int task, lua_Number key) {
+  RunQ *q = checkrunq(L, runq);
+  int n;
+  runq = lua_absindex(L, runq);
+  task = lua_absindex(L, task);
+  lua_getuservalue(L, runq);
+  n = newnode(L, q);
+  lua_pushvalue(L, task);
+  lua_rawseti(L, -2, n + 1);
+  lua_pop(L, 1);
+  q->nodes[n].key = key;
+  q->nodes[n].seq = q->seq++;
+  q->nodes[n].child = NONE;
+  q->nodes[n].sibling = NONE;
+  q->root = meld(q, q->root, n);
+  q->size++;
+}
+
+int taggedcoro_runqpop (lua_State *L, int runq) {
+  RunQ *q = checkrunq(L, runq);
+  int n = q->root;
+  if(n == NONE) return 0;
+  q->root = mergepairs(q, q->nodes[n].child);
+  q->nodes[n].sibling = q->free;
+  q->free = n;
+  q->size--;
+  lua_getuservalue(L, runq);
+  lua_rawgeti(L, -1, n + 1);
+  lua_pushnil(L);
+  lua_rawseti(L, -3, n + 1);
+  lua_remove(L, -2);
+  lua_pushnumber(L, q->nodes[n].key);
+  return 2;
+}
+
+/* key of the first task in the queue, without removing it; 0 if empty */
+int taggedcoro_runqtop (lua_State *L, int runq, lua_Number *key) {
+  RunQ *q = checkrunq(L, runq);
+  if(q->root == NONE) return 0;
+  *key = q->nodes[q->root].key;
+  return 1;
+}
+
+static int runq_push (lua_State *L) {
+  lua_Number key;
+  checkrunq(L, 1);
+  luaL_checkany(L, 2);
+  key = lua_isnoneornil(L, 3) ? defaultkey(L, 2) : luaL_checknumber(L, 3);
+  luaL_argcheck(L, key == key, 3, "key is NaN");
+  taggedcoro_runqpush(L, 1, 2, key);
+  return 0;
+}
+
+static int runq_pop (lua_State *L) {
+  int n = taggedcoro_runqpop(L, 1);
+  if(n == 0) lua_pushnil(L);
+  return n ? n : 1;
+}
+
+static int runq_peek (lua_State *L) {
+  RunQ *q = checkrunq(L, 1);
+  if(q->root == NONE) return 0;
+  lua_getuservalue(L, 1);
+  lua_rawgeti(L, -1, q->root + 1);
+  lua_pushnumber(L, q->nodes[q->root].key);
+  return 2;
+}
+
+static int runq_len (lua_State *L) {
+  lua_pushinteger(L, checkrunq(L, 1)->size);
+  return 1;
+}
+
+static int runq_tostring (lua_State *L) {
+  lua_pushfstring(L, "run queue (%p)", lua_touserdata(L, 1));
+  return 1;
+}
+
+static int runq_gc (lua_State *L) {
+  RunQ *q = checkrunq(L, 1);
+  free(q->nodes);
+  q->nodes = NULL;
+  q->cap = 0;
+  q->size = 0;
+  q->root = q->free = NONE;
+  return 0;
+}
+
+void taggedcoro_newrunq (lua_State *L) {
+  RunQ *q = (RunQ *)lua_newuserdata(L, sizeof(RunQ));
+  q->nodes = NULL;
+  q->cap = 0;
+  q->size = 0;
+  q->root = q->free = NONE;
+  q->seq = 0;
+  luaL_setmetatable(L, TC_RUNQ);
+  lua_newtable(L);
+  lua_setuservalue(L, -2);
+}
+
+static int runq_new (lua_State *L) {
+  taggedcoro_newrunq(L);
+  return 1;
+}
+
+/*
+** Priority of a coroutine: its own, or the priority of the coroutine
+** that last resumed it, and so on down the chain; 0 by default.
+*/
+void taggedcoro_pushpriority (lua_State *L, int co) {
+  int top = lua_gettop(L);
+  lua_pushvalue(L, co);
+  while(lua_rawget(L, lua_upvalueindex(1)) != LUA_TNIL) { /* coroset[co] */
+    if(lua_rawgeti(L, -1, 7) != LUA_TNIL) { /* coroset[co].priority */
+      lua_replace(L, top + 1);
+      lua_settop(L, top + 1);
+      return;
+    }
+    lua_pop(L, 1);
+    if(lua_rawgeti(L, -1, 3) == LUA_TNIL) break; /* coroset[co].parent */
+    lua_remove(L, -2);
+  }
+  lua_settop(L, top);
+  lua_pushinteger(L, 0);
+}
+
+static int taggedcoro_priority (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTHREAD);
+  if(!lua_isnone(L, 2)) {
+    if(!lua_isnil(L, 2)) luaL_checknumber(L, 2);
+    lua_pushvalue(L, 1);
+    if(lua_rawget(L, lua_upvalueindex(1)) == LUA_TNIL) { /* coroset[co] */
+      return luaL_error(L, "cannot set priority of untagged coroutine");
+    }
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, 7);
+    lua_settop(L, 1);
+  }
+  taggedcoro_pushpriority(L, 1);
+  return 1;
+}
+
+static const luaL_Reg runq_methods[] = {
+  {"push", runq_push},
+  {"pop", runq_pop},
+  {"peek", runq_peek},
+  {NULL, NULL}
+};
+
+static const luaL_Reg runq_meta[] = {
+  {"__len", runq_len},
+  {"__tostring", runq_tostring},
+  {"__gc", runq_gc},
+  {NULL, NULL}
+};
+
+static const luaL_Reg funcs[] = {
+  {"runq", runq_new},
+  {"priority", taggedcoro_priority},
+  {NULL, NULL}
+};
+
+void taggedcoro_openrunq (lua_State *L) {
+  /* stack: module, coroset */
+  luaL_newmetatable(L, TC_RUNQ);
+  luaL_newlibtable(L, runq_methods);
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, runq_methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, runq_meta, 1);
+  lua_pop(L, 1);
+  lua_pushvalue(L, -2);
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, funcs, 1);
+  lua_pop(L, 1);
+}
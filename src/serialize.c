@@ -0,0 +1,740 @@
+/*
+** Compact binary serialization of Lua values into reusable buffers.
+** A buffer's memory is a reference counted tc_Blob, so it can be shared
+** with other states, and strings decoded from it can be borrowed as
+** slices instead of being copied into new Lua strings.
+**
+** Format: a varint count of values, then each value as a type byte
+** followed by its payload. Tables and functions get reference numbers
+** in the order they are first seen, so shared subtables and cycles
+** are written once and then referenced.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "taggedcoro.h"
+
+#define MAXDEPTH 200
+#define MINCAP 64
+
+enum {
+  S_NIL, S_FALSE, S_TRUE, S_INT, S_FLOAT, S_STR,
+  S_TABLE, S_END, S_REF, S_FUNC, S_GLOBALS, S_QUEUE
+};
+
+/*
+** {======================================================
+** Blobs
+** =======================================================
+*/
+
+static tc_Blob *blob_new (size_t cap) {
+  tc_Blob *b = (tc_Blob *)malloc(sizeof(tc_Blob));
+  if(!b) return NULL;
+  if(cap < MINCAP) cap = MINCAP;
+  b->data = (char *)malloc(cap);
+  if(!b->data) {
+    free(b);
+    return NULL;
+  }
+  atomic_init(&b->refs, 1);
+  b->release = NULL;
+  b->size = 0;
+  b->cap = cap;
+  b->nobjs = 0;
+  b->objs = NULL;
+  return b;
+}
+
+static void blob_clear (tc_Blob *b) {
+  int i;
+  for(i = 0; i < b->nobjs; i++) taggedcoro_queueunref(b->objs[i]);
+  free(b->objs);
+  b->objs = NULL;
+  b->nobjs = 0;
+  b->size = 0;
+}
+
+void taggedcoro_blobref (tc_Blob *b) {
+  atomic_fetch_add(&b->refs, 1);
+}
+
+void taggedcoro_blobunref (tc_Blob *b) {
+  if(atomic_fetch_sub(&b->refs, 1) == 1) {
+    blob_clear(b);
+    if(b->release) b->release(b);
+    else free(b->data);
+    free(b);
+  }
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Buffers
+** =======================================================
+*/
+
+typedef struct Buffer {
+  tc_Blob *b;
+} Buffer;
+
+static Buffer *checkbuffer (lua_State *L, int idx) {
+  Buffer *buf = (Buffer *)luaL_checkudata(L, idx, TC_BUFFER);
+  if(!buf->b) luaL_error(L, "attempt to use a released buffer");
+  return buf;
+}
+
+void taggedcoro_pushbuffer (lua_State *L, tc_Blob *b) {
+  Buffer *buf = (Buffer *)lua_newuserdata(L, sizeof(Buffer));
+  buf->b = b;
+  luaL_setmetatable(L, TC_BUFFER);
+}
+
+tc_Blob *taggedcoro_tobuffer (lua_State *L, int idx) {
+  Buffer *buf = (Buffer *)luaL_testudata(L, idx, TC_BUFFER);
+  return buf ? buf->b : NULL;
+}
+
+/*
+** Gets a buffer ready to be written again. Its blob is replaced if
+** someone else (another state or a slice) still holds a reference.
+*/
+static void resetbuffer (lua_State *L, Buffer *buf) {
+  if(atomic_load(&buf->b->refs) > 1) {
+    tc_Blob *b = blob_new(buf->b->cap);
+    if(!b) luaL_error(L, "not enough memory");
+    taggedcoro_blobunref(buf->b);
+    buf->b = b;
+  } else {
+    blob_clear(buf->b);
+  }
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Encoder
+** =======================================================
+*/
+
+typedef struct Encoder {
+  lua_State *L;
+  tc_Blob *b;
+  int refs; /* index of table mapping tables and functions to numbers */
+  lua_Integer nrefs;
+  int depth;
+} Encoder;
+
+static void put (Encoder *e, const void *p, size_t n) {
+  tc_Blob *b = e->b;
+  if(b->cap - b->size < n) {
+    size_t cap = b->cap * 2;
+    char *data;
+    while(cap - b->size < n) cap *= 2;
+    data = (char *)realloc(b->data, cap);
+    if(!data) luaL_error(e->L, "not enough memory");
+    b->data = data;
+    b->cap = cap;
+  }
+  memcpy(b->data + b->size, p, n);
+  b->size += n;
+}
+
+static void putbyte (Encoder *e, int c) {
+  unsigned char byte = (unsigned char)c;
+  put(e, &byte, 1);
+}
+
+static void putvarint (Encoder *e, uint64_t x) {
+  unsigned char buff[10];
+  int n = 0;
+  while(x >= 0x80) {
+    buff[n++] = (unsigned char)(x | 0x80);
+    x >>= 7;
+  }
+  buff[n++] = (unsigned char)x;
+  put(e, buff, n);
+}
+
+static void encode (Encoder *e, int idx);
+
+/* writes a reference if the object was seen before, numbers it otherwise */
+static int putref (Encoder *e, int idx) {
+  lua_State *L = e->L;
+  lua_pushvalue(L, idx);
+  if(lua_rawget(L, e->refs) != LUA_TNIL) {
+    putbyte(e, S_REF);
+    putvarint(e, (uint64_t)lua_tointeger(L, -1));
+    lua_pop(L, 1);
+    return 1;
+  }
+  lua_pop(L, 1);
+  lua_pushvalue(L, idx);
+  lua_pushinteger(L, ++e->nrefs);
+  lua_rawset(L, e->refs);
+  return 0;
+}
+
+static void encodetable (Encoder *e, int idx) {
+  lua_State *L = e->L;
+  if(putref(e, idx)) return;
+  putbyte(e, S_TABLE);
+  putvarint(e, (uint64_t)lua_rawlen(L, idx));
+  lua_pushnil(L);
+  while(lua_next(L, idx)) {
+    encode(e, lua_gettop(L) - 1);
+    encode(e, lua_gettop(L));
+    lua_pop(L, 1);
+  }
+  putbyte(e, S_END);
+}
+
+static int writer (lua_State *L, const void *p, size_t sz, void *ud) {
+  (void)L;
+  put((Encoder *)ud, p, sz);
+  return 0;
+}
+
+static void encodefunction (Encoder *e, int idx) {
+  lua_State *L = e->L;
+  size_t mark;
+  uint64_t len;
+  int nups = 0, i;
+  if(lua_iscfunction(L, idx))
+    luaL_error(L, "cannot serialize a C function");
+  if(putref(e, idx)) return;
+  putbyte(e, S_FUNC);
+  mark = e->b->size;
+  put(e, &len, sizeof(len)); /* placeholder for the bytecode size */
+  lua_pushvalue(L, idx);
+  lua_dump(L, writer, e, 0);
+  lua_pop(L, 1);
+  len = e->b->size - mark - sizeof(len);
+  memcpy(e->b->data + mark, &len, sizeof(len));
+  while(lua_getupvalue(L, idx, nups + 1)) {
+    lua_pop(L, 1);
+    nups++;
+  }
+  putvarint(e, (uint64_t)nups);
+  for(i = 1; i <= nups; i++) {
+    lua_getupvalue(L, idx, i);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    if(lua_rawequal(L, -1, -2)) { /* the receiving state uses its own globals */
+      putbyte(e, S_GLOBALS);
+    } else {
+      encode(e, lua_gettop(L) - 1);
+    }
+    lua_pop(L, 2);
+  }
+}
+
+static void encodequeue (Encoder *e, tc_Queue *q) {
+  tc_Blob *b = e->b;
+  tc_Queue **objs = (tc_Queue **)realloc(b->objs, (b->nobjs + 1) * sizeof(tc_Queue *));
+  if(!objs) luaL_error(e->L, "not enough memory");
+  b->objs = objs;
+  taggedcoro_queueref(q);
+  b->objs[b->nobjs++] = q;
+  putbyte(e, S_QUEUE);
+  putvarint(e, (uint64_t)(b->nobjs - 1));
+}
+
+static void encode (Encoder *e, int idx) {
+  lua_State *L = e->L;
+  if(e->depth++ > MAXDEPTH)
+    luaL_error(L, "value too deeply nested to serialize");
+  luaL_checkstack(L, 6, "value too deeply nested to serialize");
+  switch(lua_type(L, idx)) {
+    case LUA_TNIL:
+      putbyte(e, S_NIL);
+      break;
+    case LUA_TBOOLEAN:
+      putbyte(e, lua_toboolean(L, idx) ? S_TRUE : S_FALSE);
+      break;
+    case LUA_TNUMBER:
+      if(lua_isinteger(L, idx)) {
+        uint64_t i = (uint64_t)lua_tointeger(L, idx);
+        putbyte(e, S_INT);
+        putvarint(e, (i << 1) ^ (uint64_t)-(int64_t)(i >> 63)); /* zigzag */
+      } else {
+        lua_Number n = lua_tonumber(L, idx);
+        putbyte(e, S_FLOAT);
+        put(e, &n, sizeof(n));
+      }
+      break;
+    case LUA_TSTRING: {
+      size_t len;
+      const char *s = lua_tolstring(L, idx, &len);
+      putbyte(e, S_STR);
+      putvarint(e, (uint64_t)len);
+      put(e, s, len);
+      break;
+    }
+    case LUA_TTABLE:
+      encodetable(e, idx);
+      break;
+    case LUA_TFUNCTION:
+      encodefunction(e, idx);
+      break;
+    case LUA_TUSERDATA: {
+      tc_Queue *q = taggedcoro_toqueue(L, idx);
+      size_t len;
+      const char *s;
+      if(q) {
+        encodequeue(e, q);
+        break;
+      }
+      s = taggedcoro_toslice(L, idx, &len);
+      if(s) {
+        putbyte(e, S_STR);
+        putvarint(e, (uint64_t)len);
+        put(e, s, len);
+        break;
+      }
+    } /* FALLTHROUGH */
+    default:
+      luaL_error(L, "cannot serialize a %s", luaL_typename(L, idx));
+  }
+  e->depth--;
+}
+
+/* encodes the values into the buffer at index buffer, which must be clean */
+static void encodeinto (lua_State *L, int buffer, int first, int n) {
+  Encoder e;
+  int i;
+  first = lua_absindex(L, first);
+  buffer = lua_absindex(L, buffer);
+  lua_newtable(L);
+  e.L = L;
+  e.b = checkbuffer(L, buffer)->b;
+  e.refs = lua_gettop(L);
+  e.nrefs = 0;
+  e.depth = 0;
+  putvarint(&e, (uint64_t)n);
+  for(i = 0; i < n; i++) encode(&e, first + i);
+  lua_pop(L, 1);
+}
+
+tc_Blob *taggedcoro_encode (lua_State *L, int first, int n) {
+  tc_Blob *b = blob_new(0);
+  Buffer *buf;
+  if(!b) luaL_error(L, "not enough memory");
+  first = lua_absindex(L, first);
+  taggedcoro_pushbuffer(L, b); /* collects the blob if encoding fails */
+  encodeinto(L, -1, first, n);
+  buf = (Buffer *)lua_touserdata(L, -1);
+  buf->b = NULL;
+  lua_pop(L, 1);
+  return b;
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Decoder
+** =======================================================
+*/
+
+typedef struct Decoder {
+  lua_State *L;
+  tc_Blob *b; /* NULL when decoding a Lua string */
+  int buffer; /* index of the buffer, for slices */
+  const char *p;
+  const char *end;
+  int refs; /* index of table mapping numbers to tables and functions */
+  lua_Integer nrefs;
+  size_t minslice;
+  int depth;
+} Decoder;
+
+static const char *get (Decoder *d, size_t n) {
+  const char *p = d->p;
+  if((size_t)(d->end - d->p) < n) luaL_error(d->L, "truncated serialized data");
+  d->p += n;
+  return p;
+}
+
+static int getbyte (Decoder *d) {
+  return *(const unsigned char *)get(d, 1);
+}
+
+static uint64_t getvarint (Decoder *d) {
+  uint64_t x = 0;
+  int shift = 0, c;
+  do {
+    if(shift > 63) luaL_error(d->L, "malformed serialized data");
+    c = getbyte(d);
+    x |= (uint64_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while(c & 0x80);
+  return x;
+}
+
+
+static void decode (Decoder *d);
+
+static void newref (Decoder *d) {
+  lua_pushvalue(d->L, -1);
+  lua_rawseti(d->L, d->refs, ++d->nrefs);
+}
+
+static void decodetable (Decoder *d) {
+  lua_State *L = d->L;
+  uint64_t narr = getvarint(d);
+  lua_createtable(L, narr > (uint64_t)(d->end - d->p) ? 0 : (int)narr, 0);
+  newref(d);
+  while(d->p < d->end && *(const unsigned char *)d->p != S_END) {
+    decode(d);
+    if(lua_isnil(L, -1)) luaL_error(L, "malformed serialized data");
+    decode(d);
+    lua_rawset(L, -3);
+  }
+  getbyte(d); /* S_END */
+}
+
+static void decodefunction (Decoder *d) {
+  lua_State *L = d->L;
+  uint64_t len;
+  int nups, i;
+  memcpy(&len, get(d, sizeof(len)), sizeof(len));
+  if(len > (uint64_t)(d->end - d->p)) luaL_error(L, "truncated serialized data");
+  if(luaL_loadbufferx(L, get(d, (size_t)len), (size_t)len, "=(decode)", "b") != LUA_OK)
+    lua_error(L);
+  newref(d);
+  nups = (int)getvarint(d);
+  for(i = 1; i <= nups; i++) {
+    if(d->p < d->end && *(const unsigned char *)d->p == S_GLOBALS) {
+      getbyte(d);
+      lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    } else {
+      decode(d);
+    }
+    if(!lua_setupvalue(L, -2, i)) lua_pop(L, 1);
+  }
+}
+
+static void decode (Decoder *d) {
+  lua_State *L = d->L;
+  if(d->depth++ > MAXDEPTH) luaL_error(L, "serialized value too deeply nested");
+  luaL_checkstack(L, 4, "serialized value too deeply nested");
+  switch(getbyte(d)) {
+    case S_NIL: lua_pushnil(L); break;
+    case S_FALSE: lua_pushboolean(L, 0); break;
+    case S_TRUE: lua_pushboolean(L, 1); break;
+    case S_INT: {
+      uint64_t z = getvarint(d);
+      lua_pushinteger(L, (lua_Integer)((z >> 1) ^ -(z & 1)));
+      break;
+    }
+    case S_FLOAT: {
+      lua_Number n;
+      memcpy(&n, get(d, sizeof(n)), sizeof(n));
+      lua_pushnumber(L, n);
+      break;
+    }
+    case S_STR: {
+      uint64_t len = getvarint(d);
+      const char *s;
+      if(len > (uint64_t)(d->end - d->p)) luaL_error(L, "truncated serialized data");
+      s = get(d, (size_t)len);
+      if(d->b && len >= d->minslice) taggedcoro_pushslice(L, d->b, s, (size_t)len);
+      else lua_pushlstring(L, s, (size_t)len);
+      break;
+    }
+    case S_TABLE:
+      decodetable(d);
+      break;
+    case S_FUNC:
+      decodefunction(d);
+      break;
+    case S_REF: {
+      uint64_t ref = getvarint(d);
+      if(ref == 0 || ref > (uint64_t)d->nrefs) luaL_error(L, "malformed serialized data");
+      lua_rawgeti(L, d->refs, (lua_Integer)ref);
+      break;
+    }
+    case S_QUEUE: {
+      uint64_t i = getvarint(d);
+      if(!d->b || i >= (uint64_t)d->b->nobjs) luaL_error(L, "malformed serialized data");
+      taggedcoro_queueref(d->b->objs[i]);
+      taggedcoro_pushqueue(L, d->b->objs[i]);
+      break;
+    }
+    default:
+      luaL_error(L, "malformed serialized data");
+  }
+  d->depth--;
+}
+
+static int decodefrom (lua_State *L, tc_Blob *b, const char *s, size_t len, size_t minslice) {
+  Decoder d;
+  uint64_t n, i;
+  lua_newtable(L);
+  d.L = L;
+  d.b = b;
+  d.p = s;
+  d.end = s + len;
+  d.refs = lua_gettop(L);
+  d.nrefs = 0;
+  d.minslice = minslice;
+  d.depth = 0;
+  n = getvarint(&d);
+  if(n > (uint64_t)len) luaL_error(L, "malformed serialized data");
+  luaL_checkstack(L, (int)n, "too many values to decode");
+  for(i = 0; i < n; i++) decode(&d);
+  lua_remove(L, d.refs);
+  return (int)n;
+}
+
+int taggedcoro_decode (lua_State *L, int buffer, size_t minslice) {
+  tc_Blob *b = checkbuffer(L, buffer)->b;
+  return decodefrom(L, b, b->data, b->size, minslice);
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Slices
+** =======================================================
+*/
+
+typedef struct Slice {
+  tc_Blob *b;
+  const char *s;
+  size_t len;
+} Slice;
+
+void taggedcoro_pushslice (lua_State *L, tc_Blob *b, const char *s, size_t len) {
+  Slice *sl = (Slice *)lua_newuserdata(L, sizeof(Slice));
+  sl->b = NULL;
+  luaL_setmetatable(L, TC_SLICE);
+  taggedcoro_blobref(b);
+  sl->b = b;
+  sl->s = s;
+  sl->len = len;
+}
+
+const char *taggedcoro_toslice (lua_State *L, int idx, size_t *len) {
+  Slice *sl = (Slice *)luaL_testudata(L, idx, TC_SLICE);
+  if(!sl) return NULL;
+  *len = sl->len;
+  return sl->s;
+}
+
+static Slice *checkslice (lua_State *L, int idx) {
+  return (Slice *)luaL_checkudata(L, idx, TC_SLICE);
+}
+
+/* translates relative string position, like string.sub */
+static size_t posrelat (lua_Integer pos, size_t len) {
+  if(pos >= 0) return (size_t)pos;
+  else if(0u - (size_t)pos > len) return 0;
+  else return len - ((size_t)-pos) + 1;
+}
+
+static int slice_sub (lua_State *L) {
+  Slice *sl = checkslice(L, 1);
+  size_t i = posrelat(luaL_checkinteger(L, 2), sl->len);
+  size_t j = posrelat(luaL_optinteger(L, 3, -1), sl->len);
+  if(i < 1) i = 1;
+  if(j > sl->len) j = sl->len;
+  if(i <= j) lua_pushlstring(L, sl->s + i - 1, j - i + 1);
+  else lua_pushliteral(L, "");
+  return 1;
+}
+
+static int slice_byte (lua_State *L) {
+  Slice *sl = checkslice(L, 1);
+  size_t i = posrelat(luaL_optinteger(L, 2, 1), sl->len);
+  if(i < 1 || i > sl->len) return 0;
+  lua_pushinteger(L, (unsigned char)sl->s[i - 1]);
+  return 1;
+}
+
+static int slice_tostring (lua_State *L) {
+  Slice *sl = checkslice(L, 1);
+  lua_pushlstring(L, sl->s, sl->len);
+  return 1;
+}
+
+static int slice_len (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)checkslice(L, 1)->len);
+  return 1;
+}
+
+static const char *tobytes (lua_State *L, int idx, size_t *len) {
+  const char *s = taggedcoro_toslice(L, idx, len);
+  return s ? s : luaL_checklstring(L, idx, len);
+}
+
+static int slice_eq (lua_State *L) {
+  size_t l1, l2;
+  const char *s1 = tobytes(L, 1, &l1);
+  const char *s2 = tobytes(L, 2, &l2);
+  lua_pushboolean(L, l1 == l2 && memcmp(s1, s2, l1) == 0);
+  return 1;
+}
+
+static int slice_concat (lua_State *L) {
+  size_t l1, l2;
+  const char *s1 = tobytes(L, 1, &l1);
+  const char *s2 = tobytes(L, 2, &l2);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  luaL_addlstring(&b, s1, l1);
+  luaL_addlstring(&b, s2, l2);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static int slice_gc (lua_State *L) {
+  Slice *sl = checkslice(L, 1);
+  if(sl->b) {
+    taggedcoro_blobunref(sl->b);
+    sl->b = NULL;
+  }
+  return 0;
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Lua interface
+** =======================================================
+*/
+
+static size_t checkminslice (lua_State *L, int idx) {
+  if(lua_isnoneornil(L, idx)) return (size_t)-1; /* no slices */
+  if(lua_isboolean(L, idx)) return lua_toboolean(L, idx) ? 0 : (size_t)-1;
+  lua_Integer n = luaL_checkinteger(L, idx);
+  return n < 0 ? 0 : (size_t)n;
+}
+
+static int buffer_new (lua_State *L) {
+  lua_Integer cap = luaL_optinteger(L, 1, MINCAP);
+  tc_Blob *b = blob_new(cap > 0 ? (size_t)cap : 0);
+  if(!b) return luaL_error(L, "not enough memory");
+  taggedcoro_pushbuffer(L, b);
+  return 1;
+}
+
+static int buffer_encode (lua_State *L) {
+  Buffer *buf = checkbuffer(L, 1);
+  resetbuffer(L, buf);
+  encodeinto(L, 1, 2, lua_gettop(L) - 1);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int buffer_decode (lua_State *L) {
+  size_t minslice = checkminslice(L, 2);
+  lua_settop(L, 1);
+  return taggedcoro_decode(L, 1, minslice);
+}
+
+static int buffer_bytes (lua_State *L) {
+  tc_Blob *b = checkbuffer(L, 1)->b;
+  lua_pushlstring(L, b->data, b->size);
+  return 1;
+}
+
+static int buffer_len (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)checkbuffer(L, 1)->b->size);
+  return 1;
+}
+
+static int buffer_gc (lua_State *L) {
+  Buffer *buf = (Buffer *)luaL_checkudata(L, 1, TC_BUFFER);
+  if(buf->b) {
+    taggedcoro_blobunref(buf->b);
+    buf->b = NULL;
+  }
+  return 0;
+}
+
+static int taggedcoro_encodestr (lua_State *L) {
+  int n = lua_gettop(L);
+  tc_Blob *b = blob_new(0);
+  if(!b) return luaL_error(L, "not enough memory");
+  taggedcoro_pushbuffer(L, b);
+  encodeinto(L, -1, 1, n);
+  if(b->nobjs > 0) return luaL_error(L, "cannot serialize a queue into a string");
+  lua_pushlstring(L, b->data, b->size);
+  return 1;
+}
+
+static int taggedcoro_decodestr (lua_State *L) {
+  size_t len;
+  const char *s;
+  if(taggedcoro_tobuffer(L, 1)) { /* same as buffer:decode() */
+    return buffer_decode(L);
+  }
+  s = luaL_checklstring(L, 1, &len);
+  lua_settop(L, 1);
+  return decodefrom(L, NULL, s, len, (size_t)-1);
+}
+
+static const luaL_Reg buffer_methods[] = {
+  {"encode", buffer_encode},
+  {"decode", buffer_decode},
+  {"bytes", buffer_bytes},
+  {NULL, NULL}
+};
+
+static const luaL_Reg slice_methods[] = {
+  {"sub", slice_sub},
+  {"byte", slice_byte},
+  {NULL, NULL}
+};
+
+static const luaL_Reg slice_meta[] = {
+  {"__len", slice_len},
+  {"__tostring", slice_tostring},
+  {"__eq", slice_eq},
+  {"__concat", slice_concat},
+  {"__gc", slice_gc},
+  {NULL, NULL}
+};
+
+static const luaL_Reg funcs[] = {
+  {"buffer", buffer_new},
+  {"encode", taggedcoro_encodestr},
+  {"decode", taggedcoro_decodestr},
+  {NULL, NULL}
+};
+
+void taggedcoro_openserialize (lua_State *L) {
+  /* stack: module, coroset */
+  luaL_newmetatable(L, TC_BUFFER);
+  luaL_newlibtable(L, buffer_methods);
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, buffer_methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, buffer_len);
+  lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, buffer_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+  luaL_newmetatable(L, TC_SLICE);
+  luaL_newlibtable(L, slice_methods);
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, slice_methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, slice_meta, 1);
+  lua_pop(L, 1);
+  lua_pushvalue(L, -2);
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, funcs, 1);
+  lua_pop(L, 1);
+}
+
+/* }====================================================== */
@@ -0,0 +1,282 @@
+/*
+** Simulations: async tasks on a run queue with a virtual clock. Sleeps
+** and timeouts are timers in a second run queue keyed by their deadline;
+** whenever no task is ready to run, the clock jumps to the earliest
+** deadline and the timers due then fire, so simulated time passes as
+** fast as the tasks can run. Everything is ordered by the two queues,
+** so a simulation runs the same way every time; with a seed, timers due
+** at the same instant fire in an order drawn from it instead of in the
+** order they were set.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "taggedcoro.h"
+
+#define TC_SIM "taggedcoro.sim"
+#define TC_TIMER "taggedcoro.timer"
+
+/* uservalue of a simulation */
+#define S_READY  1  /* run queue of its tasks */
+#define S_TIMERS 2  /* timers, futures from after, and { future } from timeout */
+
+typedef struct Sim {
+  lua_Number now;
+  uint64_t rng; /* 0 without a seed */
+} Sim;
+
+/* wait list of the task sleeping on it */
+typedef struct Timer {
+  tc_WaitList sleepers;
+} Timer;
+
+static Sim *checksim (lua_State *L, int idx) {
+  return (Sim *)luaL_checkudata(L, idx, TC_SIM);
+}
+
+/* xorshift64* */
+static uint64_t nextrand (Sim *s) {
+  s->rng ^= s->rng >> 12;
+  s->rng ^= s->rng << 25;
+  s->rng ^= s->rng >> 27;
+  return s->rng * 2685821657736338717ull;
+}
+
+/* taggedcoro.simulation([seed]) */
+static int sim_new (lua_State *L) {
+  lua_Integer seed = luaL_optinteger(L, 1, 0);
+  Sim *s = (Sim *)lua_newuserdata(L, sizeof(Sim));
+  s->now = 0;
+  s->rng = (uint64_t)seed;
+  if(s->rng) s->rng ^= 0x9e3779b97f4a7c15ull; /* no weak small seeds */
+  luaL_setmetatable(L, TC_SIM);
+  lua_createtable(L, 2, 0);
+  taggedcoro_newrunq(L);
+  lua_rawseti(L, -2, S_READY);
+  taggedcoro_newrunq(L);
+  lua_rawseti(L, -2, S_TIMERS);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+static void pushqueue (lua_State *L, int sim, int which) {
+  lua_getuservalue(L, sim);
+  lua_rawgeti(L, -1, which);
+  lua_remove(L, -2);
+}
+
+/* fires the timer entry on top of the stack, popping it */
+static void fire (lua_State *L, Sim *s) {
+  Timer *t = (Timer *)luaL_testudata(L, -1, TC_TIMER);
+  if(t) {
+    taggedcoro_wakeall(L, &t->sleepers);
+  } else if(lua_istable(L, -1)) { /* a timeout */
+    lua_rawgeti(L, -1, 1);
+    if(taggedcoro_pending(L, -1)) {
+      lua_pushliteral(L, "timeout");
+      taggedcoro_complete(L, -2, 0, 1);
+    }
+    lua_pop(L, 1);
+  } else if(taggedcoro_pending(L, -1)) {
+    lua_pushnumber(L, s->now);
+    taggedcoro_complete(L, -2, 1, 1);
+  }
+  lua_pop(L, 1);
+}
+
+/*
+** moves the clock to the earliest deadline and fires the timers due
+** then; returns 0 if there are none
+*/
+static int advance (lua_State *L, Sim *s, int timers) {
+  lua_Number key;
+  int n = 0, i;
+  if(!taggedcoro_runqpop(L, timers)) return 0;
+  s->now = lua_tonumber(L, -1);
+  lua_pop(L, 1);
+  if(!taggedcoro_runqtop(L, timers, &key) || key != s->now) {
+    fire(L, s); /* the common case: alone at its instant */
+    return 1;
+  }
+  lua_newtable(L);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, ++n);
+  while(taggedcoro_runqtop(L, timers, &key) && key == s->now) {
+    taggedcoro_runqpop(L, timers);
+    lua_pop(L, 1);
+    lua_rawseti(L, -2, ++n);
+  }
+  if(s->rng) { /* Fisher-Yates */
+    for(i = n; i > 1; i--) {
+      int j = (int)(nextrand(s) % (uint64_t)i) + 1;
+      lua_rawgeti(L, -1, i);
+      lua_rawgeti(L, -2, j);
+      lua_rawseti(L, -3, i);
+      lua_rawseti(L, -2, j);
+    }
+  }
+  for(i = 1; i <= n; i++) {
+    lua_rawgeti(L, -1, i);
+    fire(L, s);
+  }
+  lua_pop(L, 1);
+  return 1;
+}
+
+LUA_KFUNCTION(simk) {
+  /* stack: sim, ready, timers */
+  Sim *s = (Sim *)lua_touserdata(L, 1);
+  while(1) {
+    if(!ctx) { /* run the ready tasks until all of them block or end */
+      lua_settop(L, 3);
+      lua_getfield(L, 2, "run");
+      lua_pushvalue(L, 2);
+      lua_callk(L, 1, 0, 1, simk);
+    }
+    ctx = 0;
+    lua_settop(L, 3);
+    if(!advance(L, s, 3)) return 0;
+  }
+}
+
+/*
+** sim:run() runs the tasks, and the clock, until every task has ended
+** or blocked on something other than a timer
+*/
+static int sim_run (lua_State *L) {
+  checksim(L, 1);
+  lua_settop(L, 1);
+  pushqueue(L, 1, S_READY);
+  pushqueue(L, 1, S_TIMERS);
+  return simk(L, LUA_OK, 0);
+}
+
+/* sim:spawn(f, ...) creates an async task in the simulation */
+static int sim_spawn (lua_State *L) {
+  checksim(L, 1);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  pushqueue(L, 1, S_READY);
+  lua_insert(L, 2);
+  taggedcoro_spawn(L, 2, 3, lua_gettop(L) - 3);
+  return 1;
+}
+
+static int sim_now (lua_State *L) {
+  lua_pushnumber(L, checksim(L, 1)->now);
+  return 1;
+}
+
+static lua_Number checkdelay (lua_State *L, int idx) {
+  lua_Number d = luaL_checknumber(L, idx);
+  luaL_argcheck(L, d >= 0, idx, "negative delay");
+  return d;
+}
+
+LUA_KFUNCTION(sleepk) {
+  return 0;
+}
+
+/* sim:sleep(d) blocks the running task for d units of simulated time */
+static int sim_sleep (lua_State *L) {
+  Sim *s = checksim(L, 1);
+  lua_Number d = checkdelay(L, 2);
+  Timer *t;
+  lua_settop(L, 2);
+  pushqueue(L, 1, S_TIMERS); /* 3 */
+  t = (Timer *)lua_newuserdata(L, sizeof(Timer)); /* 4 */
+  memset(t, 0, sizeof(Timer));
+  luaL_setmetatable(L, TC_TIMER);
+  taggedcoro_waitadd(L, &t->sleepers, taggedcoro_block(L), 5);
+  taggedcoro_runqpush(L, 3, 4, s->now + d);
+  lua_settop(L, 0);
+  lua_pushcfunction(L, taggedcoro_yield);
+  lua_pushliteral(L, TC_ASYNC);
+  lua_callk(L, 1, 0, 0, sleepk);
+  return 0;
+}
+
+/* sim:after(d) returns a future resolved with the time d units from now */
+static int sim_after (lua_State *L) {
+  Sim *s = checksim(L, 1);
+  lua_Number d = checkdelay(L, 2);
+  pushqueue(L, 1, S_TIMERS);
+  taggedcoro_newfuture(L);
+  taggedcoro_runqpush(L, -2, -1, s->now + d);
+  return 1;
+}
+
+/* upvalues: coroset, future */
+static int timeoutdone (lua_State *L) {
+  if(taggedcoro_pending(L, lua_upvalueindex(2))) {
+    int ok = lua_toboolean(L, 1);
+    lua_remove(L, 1);
+    taggedcoro_complete(L, lua_upvalueindex(2), ok, lua_gettop(L));
+  }
+  return 0;
+}
+
+/*
+** sim:timeout(f, d) returns a future that completes like f, or is
+** rejected with "timeout" if f is still pending d units from now
+*/
+static int sim_timeout (lua_State *L) {
+  Sim *s = checksim(L, 1);
+  lua_Number d;
+  luaL_checkudata(L, 2, TC_FUTURE);
+  d = checkdelay(L, 3);
+  lua_settop(L, 3);
+  pushqueue(L, 1, S_TIMERS); /* 4 */
+  taggedcoro_newfuture(L); /* 5 */
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 5);
+  lua_rawseti(L, -2, 1);
+  taggedcoro_runqpush(L, 4, -1, s->now + d);
+  lua_pop(L, 1);
+  lua_getfield(L, 2, "callback");
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_pushvalue(L, 5);
+  lua_pushcclosure(L, timeoutdone, 2);
+  lua_call(L, 2, 0);
+  return 1;
+}
+
+static int sim_tostring (lua_State *L) {
+  lua_pushfstring(L, "simulation (%f)", checksim(L, 1)->now);
+  return 1;
+}
+
+static int timer_gc (lua_State *L) {
+  Timer *t = (Timer *)luaL_checkudata(L, 1, TC_TIMER);
+  while(t->sleepers.head) taggedcoro_waitremove(L, t->sleepers.head);
+  return 0;
+}
+
+static const luaL_Reg sim_methods[] = {
+  {"run", sim_run},
+  {"spawn", sim_spawn},
+  {"now", sim_now},
+  {"sleep", sim_sleep},
+  {"after", sim_after},
+  {"timeout", sim_timeout},
+  {NULL, NULL}
+};
+
+void taggedcoro_opensim (lua_State *L) {
+  /* stack: module, coroset */
+  luaL_newmetatable(L, TC_SIM);
+  luaL_newlibtable(L, sim_methods);
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, sim_methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, sim_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pop(L, 1);
+  luaL_newmetatable(L, TC_TIMER);
+  lua_pushcfunction(L, timer_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+  lua_pushcfunction(L, sim_new);
+  lua_setfield(L, -3, "simulation");
+}
@@ -0,0 +1,224 @@
+/*
+** Fresh lua_States running on their own OS threads. The chunk and its
+** arguments are copied as tc_Values, so the new state shares nothing
+** with its creator except what crosses through queues. Collecting the
+** handle of a state that is still running detaches its thread, which
+** then frees the state when the chunk ends.
+*/
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "taggedcoro.h"
+#include "lualib.h"
+
+#define TC_STATE "taggedcoro.state"
+
+LUAMOD_API int luaopen_taggedcoro (lua_State *L);
+
+typedef struct State {
+  pthread_t thread;
+  atomic_int refs; /* the handle, and the thread while it runs */
+  int running; /* thread started and not joined yet */
+  int joined;
+  char *chunk;
+  size_t chunklen;
+  int nargs;
+  tc_Value *args;
+  int ok; /* chunk ran without errors */
+  int nres;
+  tc_Value *res; /* results, or the error message */
+} State;
+
+typedef struct Handle {
+  State *st; /* NULL once collected */
+} Handle;
+
+static void freevalues (tc_Value *vs, int n) {
+  int i;
+  if(!vs) return;
+  for(i = 0; i < n; i++) taggedcoro_freevalue(&vs[i]);
+  free(vs);
+}
+
+/* copies the values on top of the stack from 'first' into a new array */
+static tc_Value *tovalues (lua_State *L, int first, int n, const char *what) {
+  int i;
+  tc_Value *vs;
+  if(n == 0) return NULL;
+  vs = (tc_Value *)calloc((size_t)n, sizeof(tc_Value));
+  if(!vs) luaL_error(L, "not enough memory");
+  for(i = 0; i < n; i++) {
+    if(!taggedcoro_tovalue(L, first + i, &vs[i])) {
+      freevalues(vs, i);
+      luaL_error(L, "cannot move %s #%d (a %s) to another state", what, i + 1,
+                 luaL_typename(L, first + i));
+    }
+  }
+  return vs;
+}
+
+static int pmain (lua_State *L) {
+  State *st = (State *)lua_touserdata(L, 1);
+  int i, base;
+  lua_settop(L, 0);
+  luaL_openlibs(L);
+  luaL_requiref(L, "taggedcoro", luaopen_taggedcoro, 0);
+  lua_pop(L, 1);
+  if(luaL_loadbuffer(L, st->chunk, st->chunklen, "=newstate") != LUA_OK)
+    return lua_error(L);
+  luaL_checkstack(L, st->nargs, "too many arguments");
+  for(i = 0; i < st->nargs; i++) taggedcoro_pushvalue(L, &st->args[i]);
+  freevalues(st->args, st->nargs);
+  st->args = NULL;
+  base = lua_gettop(L) - st->nargs;
+  lua_call(L, st->nargs, LUA_MULTRET);
+  st->nres = lua_gettop(L) - base + 1;
+  st->res = tovalues(L, base, st->nres, "result");
+  return 0;
+}
+
+/* keeps the error message at index 1 */
+static int pmsg (lua_State *L) {
+  State *st = (State *)lua_touserdata(L, 2);
+  if(!lua_isstring(L, 1)) {
+    lua_pushfstring(L, "(error object is a %s value)", luaL_typename(L, 1));
+    lua_replace(L, 1);
+  }
+  st->res = tovalues(L, 1, 1, "error");
+  st->nres = 1;
+  return 0;
+}
+
+static void unref (State *st) {
+  if(atomic_fetch_sub(&st->refs, 1) == 1) {
+    free(st->chunk);
+    freevalues(st->args, st->nargs);
+    freevalues(st->res, st->nres);
+    free(st);
+  }
+}
+
+static void *run (void *ud) {
+  State *st = (State *)ud;
+  lua_State *L = luaL_newstate();
+  st->ok = 0;
+  if(!L) {
+    unref(st);
+    return NULL;
+  }
+  lua_pushcfunction(L, pmain);
+  lua_pushlightuserdata(L, st);
+  st->ok = (lua_pcall(L, 1, 0, 0) == LUA_OK);
+  if(!st->ok) {
+    lua_pushcfunction(L, pmsg);
+    lua_insert(L, -2);
+    lua_pushlightuserdata(L, st);
+    lua_pcall(L, 2, 0, 0);
+  }
+  lua_close(L);
+  unref(st);
+  return NULL;
+}
+
+static int writer (lua_State *L, const void *p, size_t sz, void *ud) {
+  (void)L;
+  luaL_addlstring((luaL_Buffer *)ud, (const char *)p, sz);
+  return 0;
+}
+
+static int state_new (lua_State *L) {
+  int nargs = lua_gettop(L) - 1;
+  size_t len;
+  const char *chunk;
+  if(lua_isfunction(L, 1)) { /* send it as bytecode, upvalues are lost */
+    luaL_Buffer b;
+    luaL_argcheck(L, !lua_iscfunction(L, 1), 1, "cannot dump a C function");
+    lua_pushvalue(L, 1);
+    luaL_buffinit(L, &b);
+    lua_dump(L, writer, &b, 0);
+    luaL_pushresult(&b);
+    lua_replace(L, 1);
+    lua_pop(L, 1);
+  }
+  chunk = luaL_checklstring(L, 1, &len);
+  Handle *h = (Handle *)lua_newuserdata(L, sizeof(Handle));
+  h->st = NULL;
+  luaL_setmetatable(L, TC_STATE);
+  State *st = (State *)calloc(1, sizeof(State));
+  if(!st) return luaL_error(L, "not enough memory");
+  atomic_init(&st->refs, 1);
+  h->st = st;
+  st->chunk = (char *)malloc(len ? len : 1);
+  if(!st->chunk) return luaL_error(L, "not enough memory");
+  memcpy(st->chunk, chunk, len);
+  st->chunklen = len;
+  st->args = tovalues(L, 2, nargs, "argument");
+  st->nargs = nargs;
+  atomic_fetch_add(&st->refs, 1);
+  if(pthread_create(&st->thread, NULL, run, st) != 0) {
+    atomic_fetch_sub(&st->refs, 1);
+    return luaL_error(L, "cannot create thread");
+  }
+  st->running = 1;
+  return 1;
+}
+
+static State *checkstate (lua_State *L) {
+  return ((Handle *)luaL_checkudata(L, 1, TC_STATE))->st;
+}
+
+static int state_join (lua_State *L) {
+  State *st = checkstate(L);
+  int i, n;
+  if(st->joined) return luaL_error(L, "state already joined");
+  if(st->running) {
+    pthread_join(st->thread, NULL);
+    st->running = 0;
+  }
+  st->joined = 1;
+  n = st->nres;
+  luaL_checkstack(L, n, "too many results");
+  for(i = 0; i < n; i++) taggedcoro_pushvalue(L, &st->res[i]);
+  freevalues(st->res, n);
+  st->res = NULL;
+  st->nres = 0;
+  if(!st->ok) {
+    if(n == 0) lua_pushliteral(L, "cannot create state");
+    return lua_error(L);
+  }
+  return n;
+}
+
+/* does not wait for the chunk, which may be blocked on a queue forever */
+static int state_gc (lua_State *L) {
+  Handle *h = (Handle *)luaL_checkudata(L, 1, TC_STATE);
+  if(h->st) {
+    if(h->st->running) pthread_detach(h->st->thread);
+    unref(h->st);
+    h->st = NULL;
+  }
+  return 0;
+}
+
+static const luaL_Reg state_methods[] = {
+  {"join", state_join},
+  {NULL, NULL}
+};
+
+void taggedcoro_openstate (lua_State *L) {
+  /* stack: module, coroset */
+  luaL_newmetatable(L, TC_STATE);
+  luaL_newlibtable(L, state_methods);
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, state_methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, state_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+  lua_pushvalue(L, -1);
+  lua_pushcclosure(L, state_new, 1);
+  lua_setfield(L, -3, "newstate");
+}
@@ -0,0 +1,1445 @@
+/*
+** Transaction logs for software transactional memory, in the style of
+** TL2. Every transactional variable carries the version of the commit
+** that wrote its current value, taken from a global version clock. A
+** transaction samples the clock when it starts and fails a read of any
+** variable newer than that, so what it has read is always consistent;
+** reads and writes go to flat arrays, commit validates the reads in one
+** pass and installs the writes in another, and a transaction that wrote
+** nothing commits without validating at all.
+**
+** Shared variables live outside any Lua heap, hold their values
+** serialized, and can be used from several lua_States on different OS
+** threads. Their versions are kept in a table of striped versioned
+** locks: commit locks the stripes it writes, validates, installs, and
+** releases them stamped with its version. A transaction that retries
+** on shared variables sleeps on a futex until a commit writes one of
+** the variables it read, or, when it can yield to a scheduler, yields
+** it a descriptor that becomes readable on such a commit.
+**
+** A variable can be durable: it carries a name and a write-ahead log,
+** and a commit that writes it encodes the names and values of its
+** durable writes beforehand and appends them to the log while it still
+** holds its stripes, so the log has the writes to each variable in the
+** order of their versions, whichever state committed them.
+**
+** Variables can also keep a bounded history of their old values, each
+** with the version that wrote it. A snapshot transaction registers its
+** start version and only reads, taking from each variable the newest
+** value at that version, so its reads never see a newer commit; commits
+** drop the old values that no running snapshot can read any more.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+#include "taggedcoro.h"
+
+#define TC_TVAR "taggedcoro.tvar"
+#define TC_TX "taggedcoro.stmtx"
+
+/* uservalue of a transaction */
+#define X_READS   1  /* variables read, by read slot */
+#define X_WRITES  2  /* variables written, by write slot */
+#define X_VALUES  3  /* values written, by write slot */
+#define X_CONFLICT 4  /* variable that made it fail */
+#define X_PARENT  5  /* enclosing transaction, for nested ones */
+
+#define NSTRIPES 4096 /* must be a power of 2 */
+#define SPINS 128 /* tries to lock a stripe before giving up */
+#define NSNAPSHOTS 256 /* snapshot transactions that hold back old values */
+#define MAXVERSIONS 64 /* old values a variable can keep */
+
+typedef long long Version;
+
+static atomic_llong clock_ = 0;
+
+/*
+** {======================================================
+** Shared cells
+** =======================================================
+*/
+
+/* version << 1, or the address of the committing log | 1 while locked */
+static atomic_llong stripes[NSTRIPES];
+
+#define LOCKED(w) ((w) & 1)
+#define VERSION(w) ((w) >> 1)
+
+struct tc_Cell {
+  atomic_int refs;
+  atomic_flag busy; /* held while the values are swapped or referenced */
+  atomic_int watchers;
+  tc_Blob *value;
+  Version version; /* of the commit that wrote value */
+  int depth; /* old values it can keep */
+  int nold;
+  Version *oldv; /* versions of the old values, newest first */
+  tc_Blob **old;
+  char *name; /* durable name, or NULL */
+  tc_Wal *log; /* where commits log writes, or NULL */
+};
+
+static atomic_llong *stripeof (tc_Cell *c) {
+  uintptr_t h = ((uintptr_t)c >> 4) * 2654435761u;
+  return &stripes[h & (NSTRIPES - 1)];
+}
+
+static tc_Blob *cellget (tc_Cell *c) {
+  tc_Blob *b;
+  while(atomic_flag_test_and_set_explicit(&c->busy, memory_order_acquire));
+  b = c->value;
+  taggedcoro_blobref(b);
+  atomic_flag_clear_explicit(&c->busy, memory_order_release);
+  return b;
+}
+
+/* the newest value written at or before version rv, or NULL */
+static tc_Blob *cellat (tc_Cell *c, Version rv) {
+  tc_Blob *b = NULL;
+  int i;
+  while(atomic_flag_test_and_set_explicit(&c->busy, memory_order_acquire));
+  if(c->version <= rv) {
+    b = c->value;
+  } else {
+    for(i = 0; i < c->nold; i++)
+      if(c->oldv[i] <= rv) {
+        b = c->old[i];
+        break;
+      }
+  }
+  if(b) taggedcoro_blobref(b);
+  atomic_flag_clear_explicit(&c->busy, memory_order_release);
+  return b;
+}
+
+/*
+** installs b with version wv, taking its reference; the old value goes
+** into the history, which keeps what snapshots from oldest on can read
+*/
+static void cellinstall (tc_Cell *c, tc_Blob *b, Version wv, Version oldest) {
+  tc_Blob *drop[MAXVERSIONS + 1];
+  Version succ = wv;
+  int n = 0, i, keep;
+  while(atomic_flag_test_and_set_explicit(&c->busy, memory_order_acquire));
+  if(c->depth == 0) {
+    drop[n++] = c->value;
+  } else {
+    if(c->nold == c->depth) drop[n++] = c->old[--c->nold];
+    memmove(c->old + 1, c->old, (size_t)c->nold * sizeof(tc_Blob *));
+    memmove(c->oldv + 1, c->oldv, (size_t)c->nold * sizeof(Version));
+    c->old[0] = c->value;
+    c->oldv[0] = c->version;
+    c->nold++;
+    /* an old value is needed while the one after it is newer than oldest */
+    for(keep = 0; keep < c->nold && succ > oldest; keep++) succ = c->oldv[keep];
+    for(i = keep; i < c->nold; i++) drop[n++] = c->old[i];
+    c->nold = keep;
+  }
+  c->value = b;
+  c->version = wv;
+  atomic_flag_clear_explicit(&c->busy, memory_order_release);
+  for(i = 0; i < n; i++) taggedcoro_blobunref(drop[i]);
+}
+
+void taggedcoro_cellref (tc_Cell *c) {
+  atomic_fetch_add(&c->refs, 1);
+}
+
+void taggedcoro_cellunref (tc_Cell *c) {
+  if(atomic_fetch_sub(&c->refs, 1) == 1) {
+    int i;
+    taggedcoro_blobunref(c->value);
+    for(i = 0; i < c->nold; i++) taggedcoro_blobunref(c->old[i]);
+    if(c->log) taggedcoro_walunref(c->log);
+    free(c->name);
+    free(c);
+  }
+}
+
+/* pushes the value of blob b, taking its reference */
+static void pushblob (lua_State *L, tc_Blob *b) {
+  taggedcoro_pushbuffer(L, b);
+  taggedcoro_decode(L, -1, (size_t)-1);
+  lua_remove(L, -2);
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Waiting for commits
+** =======================================================
+*/
+
+/* bumped by commits that write variables some transaction waits on */
+static atomic_int wakeseq;
+
+#ifdef __linux__
+
+static void sleepon (int seq) {
+  syscall(SYS_futex, (int *)&wakeseq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+}
+
+static void wakeall (void) {
+  atomic_fetch_add(&wakeseq, 1);
+  syscall(SYS_futex, (int *)&wakeseq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+#else
+
+static pthread_mutex_t wakemutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakecond = PTHREAD_COND_INITIALIZER;
+
+static void sleepon (int seq) {
+  pthread_mutex_lock(&wakemutex);
+  while(atomic_load(&wakeseq) == seq) pthread_cond_wait(&wakecond, &wakemutex);
+  pthread_mutex_unlock(&wakemutex);
+}
+
+static void wakeall (void) {
+  pthread_mutex_lock(&wakemutex);
+  atomic_fetch_add(&wakeseq, 1);
+  pthread_cond_broadcast(&wakecond);
+  pthread_mutex_unlock(&wakemutex);
+}
+
+#endif
+
+/*
+** Descriptors of the transactions that wait by yielding; every commit
+** that wakes the sleepers also makes all of them readable, and so does
+** the end of every flush of a write-ahead log
+*/
+typedef struct Waitpoint {
+  int fd[2]; /* read and write ends, the same eventfd on Linux */
+  struct Waitpoint *next;
+  struct Waitpoint *prev;
+} Waitpoint;
+
+static pthread_mutex_t waitmutex = PTHREAD_MUTEX_INITIALIZER;
+static Waitpoint *waitpoints;
+static atomic_int nwaitpoints;
+
+static Waitpoint *wpopen (void) {
+  Waitpoint *w = (Waitpoint *)malloc(sizeof(Waitpoint));
+  if(!w) return NULL;
+#ifdef __linux__
+  w->fd[0] = w->fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(w->fd[0] < 0) {
+#else
+  if(pipe(w->fd) < 0) {
+#endif
+    free(w);
+    return NULL;
+  }
+#ifndef __linux__
+  fcntl(w->fd[0], F_SETFL, O_NONBLOCK);
+  fcntl(w->fd[1], F_SETFL, O_NONBLOCK);
+#endif
+  pthread_mutex_lock(&waitmutex);
+  w->prev = NULL;
+  w->next = waitpoints;
+  if(waitpoints) waitpoints->prev = w;
+  waitpoints = w;
+  atomic_fetch_add(&nwaitpoints, 1);
+  pthread_mutex_unlock(&waitmutex);
+  return w;
+}
+
+static void wpclose (Waitpoint *w) {
+  pthread_mutex_lock(&waitmutex);
+  if(w->prev) w->prev->next = w->next;
+  else waitpoints = w->next;
+  if(w->next) w->next->prev = w->prev;
+  atomic_fetch_sub(&nwaitpoints, 1);
+  pthread_mutex_unlock(&waitmutex);
+  close(w->fd[0]);
+  if(w->fd[1] != w->fd[0]) close(w->fd[1]);
+  free(w);
+}
+
+void taggedcoro_wpsignal (void) {
+  Waitpoint *w;
+  if(atomic_load(&nwaitpoints) == 0) return;
+  pthread_mutex_lock(&waitmutex);
+  for(w = waitpoints; w; w = w->next) {
+#ifdef __linux__
+    uint64_t one = 1;
+#else
+    char one = 1;
+#endif
+    ssize_t r = write(w->fd[1], &one, sizeof(one));
+    (void)r; /* a full pipe is already readable */
+  }
+  pthread_mutex_unlock(&waitmutex);
+}
+
+/* eats the wakeups of the descriptor */
+static void wpdrain (Waitpoint *w) {
+#ifdef __linux__
+  uint64_t n;
+  ssize_t r = read(w->fd[0], &n, sizeof(n)); /* resets the counter */
+  (void)r;
+#else
+  char buf[64];
+  while(read(w->fd[0], buf, sizeof(buf)) > 0);
+#endif
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Snapshots
+** =======================================================
+*/
+
+/* start version + 1 of each running snapshot transaction, or 0 */
+static atomic_llong snapshots[NSNAPSHOTS];
+
+/* start version of a snapshot in slot i that is not older than any commit
+** that already decided which old values to drop without seeing it */
+static Version pinat (int i) {
+  Version c;
+  do {
+    c = atomic_load(&clock_);
+    atomic_store(&snapshots[i], c + 1);
+  } while(atomic_load(&clock_) != c);
+  return c;
+}
+
+/* takes a free slot, or returns -1 when every slot is taken */
+static int pinslot (void) {
+  int i;
+  for(i = 0; i < NSNAPSHOTS; i++) {
+    long long free_ = 0;
+    if(atomic_load(&snapshots[i]) == 0 &&
+       atomic_compare_exchange_strong(&snapshots[i], &free_, 1)) /* holds everything */
+      return i;
+  }
+  return -1;
+}
+
+/* start version of the oldest running snapshot, or wv if it is older */
+static Version oldest (Version wv) {
+  int i;
+  for(i = 0; i < NSNAPSHOTS; i++) {
+    long long s = atomic_load(&snapshots[i]);
+    if(s && s - 1 < wv) wv = s - 1;
+  }
+  return wv;
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Variables and logs
+** =======================================================
+*/
+
+/*
+** the current value of a local variable is at 1 in its uservalue, and
+** its old values follow it, newest first
+*/
+typedef struct TVar {
+  Version version; /* local variables only */
+  int watchers;
+  int depth; /* old values it can keep, local variables only */
+  int nold;
+  Version *old; /* versions of the old values */
+  tc_Cell *cell; /* NULL for local variables */
+  char *name; /* durable name, local variables only */
+  tc_Wal *log; /* where commits log writes, local variables only */
+} TVar;
+
+typedef struct Lock {
+  atomic_llong *stripe;
+  long long old; /* word before it was locked */
+} Lock;
+
+/* record of the durable writes of a commit that go to one log */
+typedef struct Logged {
+  tc_Wal *log;
+  tc_Blob *record; /* until the commit appends it */
+  long long ticket; /* once appended, or 0 */
+} Logged;
+
+typedef struct Tx {
+  Version rv; /* clock when it started */
+  Version wv; /* version of its commit, once it wrote something */
+  int state;
+  int nreads, rcap;
+  TVar **reads;
+  int nwrites, wcap;
+  TVar **writes;
+  tc_Blob **blobs; /* encoded values of shared writes, by write slot */
+  int hcap; /* open addressing index of writes, by variable */
+  int *hslots; /* write slot + 1, or 0 */
+  int nlocks;
+  Lock *locks; /* stripes locked by commit */
+  int nwatched;
+  TVar **watched; /* variables watched, or NULL */
+  struct Tx *parent; /* log of the enclosing transaction, or NULL */
+  int snapshot; /* reads at rv and never writes */
+  int slot; /* in snapshots, or -1 */
+  Waitpoint *wp; /* while it waits by yielding, or NULL */
+  int nlogged;
+  Logged *logged; /* one for each log its durable writes go to */
+} Tx;
+
+enum { ACTIVE, COMMITTED, FAILED };
+
+static const char *const kinds[] = { "local", "shared", NULL };
+static const char *const modes[] = { "update", "snapshot", NULL };
+
+static TVar *checktvar (lua_State *L, int idx) {
+  return (TVar *)luaL_checkudata(L, idx, TC_TVAR);
+}
+
+static Tx *checktx (lua_State *L, int idx) {
+  Tx *tx = (Tx *)luaL_checkudata(L, idx, TC_TX);
+  if(tx->state != ACTIVE) luaL_error(L, "transaction is not active");
+  return tx;
+}
+
+static void *grow (lua_State *L, void *p, int *cap, size_t size) {
+  int ncap = *cap ? *cap * 2 : 16;
+  void *np;
+  if(ncap <= *cap) luaL_error(L, "transaction too large");
+  np = realloc(p, (size_t)ncap * size);
+  if(!np) luaL_error(L, "not enough memory");
+  *cap = ncap;
+  return np;
+}
+
+/* two handles of the same shared variable are the same variable */
+static void *keyof (TVar *v) {
+  return v->cell ? (void *)v->cell : (void *)v;
+}
+
+static unsigned hashvar (TVar *v, int cap) {
+  uintptr_t h = (uintptr_t)keyof(v) >> 4;
+  return (unsigned)((h * 2654435761u) & (uintptr_t)(cap - 1));
+}
+
+/* write slot of variable v, or -1 */
+static int findwrite (Tx *tx, TVar *v) {
+  unsigned i;
+  if(!tx->nwrites) return -1;
+  for(i = hashvar(v, tx->hcap); tx->hslots[i]; i = (i + 1) & (tx->hcap - 1))
+    if(keyof(tx->writes[tx->hslots[i] - 1]) == keyof(v)) return tx->hslots[i] - 1;
+  return -1;
+}
+
+static void indexwrite (Tx *tx, int slot) {
+  unsigned i = hashvar(tx->writes[slot], tx->hcap);
+  while(tx->hslots[i]) i = (i + 1) & (tx->hcap - 1);
+  tx->hslots[i] = slot + 1;
+}
+
+static void reindex (lua_State *L, Tx *tx) {
+  int cap = tx->hcap ? tx->hcap * 2 : 32, i;
+  int *slots = (int *)calloc((size_t)cap, sizeof(int));
+  if(!slots) luaL_error(L, "not enough memory");
+  free(tx->hslots);
+  tx->hslots = slots;
+  tx->hcap = cap;
+  for(i = 0; i < tx->nwrites; i++) indexwrite(tx, i);
+}
+
+static TVar *newtvar (lua_State *L, tc_Cell *c, int depth) {
+  TVar *v = (TVar *)lua_newuserdata(L, sizeof(TVar));
+  v->version = 0;
+  v->watchers = 0;
+  v->depth = v->nold = 0;
+  v->old = NULL;
+  v->cell = c;
+  v->name = NULL;
+  v->log = NULL;
+  luaL_setmetatable(L, TC_TVAR);
+  if(depth) {
+    v->old = (Version *)malloc((size_t)depth * sizeof(Version));
+    if(!v->old) luaL_error(L, "not enough memory");
+    v->depth = depth;
+  }
+  return v;
+}
+
+void taggedcoro_pushcell (lua_State *L, tc_Cell *c) {
+  newtvar(L, c, 0);
+}
+
+tc_Cell *taggedcoro_tocell (lua_State *L, int idx) {
+  TVar *v = (TVar *)luaL_testudata(L, idx, TC_TVAR);
+  return v ? v->cell : NULL;
+}
+
+/* taggedcoro.tvar(v[, kind[, versions]]) */
+static int tvar_new (lua_State *L) {
+  int shared = luaL_checkoption(L, 2, "local", kinds);
+  int depth = (int)luaL_optinteger(L, 3, 0);
+  luaL_argcheck(L, depth >= 0 && depth <= MAXVERSIONS, 3, "invalid number of versions");
+  lua_settop(L, 1);
+  if(shared) {
+    tc_Blob *b = taggedcoro_encode(L, 1, 1);
+    tc_Cell *c = (tc_Cell *)malloc(sizeof(tc_Cell) +
+                                   (size_t)depth * (sizeof(Version) + sizeof(tc_Blob *)));
+    if(!c) {
+      taggedcoro_blobunref(b);
+      return luaL_error(L, "not enough memory");
+    }
+    atomic_init(&c->refs, 1);
+    atomic_flag_clear(&c->busy);
+    atomic_init(&c->watchers, 0);
+    c->value = b;
+    c->version = 0;
+    c->depth = depth;
+    c->nold = 0;
+    c->oldv = (Version *)(c + 1);
+    c->old = (tc_Blob **)(c->oldv + depth);
+    c->name = NULL;
+    c->log = NULL;
+    newtvar(L, c, 0);
+    return 1;
+  }
+  newtvar(L, NULL, depth);
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+/* the committed value, outside of any transaction */
+static int tvar_get (lua_State *L) {
+  TVar *v = checktvar(L, 1);
+  if(v->cell) {
+    pushblob(L, cellget(v->cell));
+    return 1;
+  }
+  lua_getuservalue(L, 1);
+  lua_rawgeti(L, -1, 1);
+  return 1;
+}
+
+/* for shared variables, the version of their stripe */
+static int tvar_version (lua_State *L) {
+  TVar *v = checktvar(L, 1);
+  if(v->cell) {
+    long long w = atomic_load(stripeof(v->cell));
+    lua_pushinteger(L, LOCKED(w) ? (lua_Integer)atomic_load(&clock_)
+                                 : (lua_Integer)VERSION(w));
+  } else {
+    lua_pushinteger(L, (lua_Integer)v->version);
+  }
+  return 1;
+}
+
+/* the log that the writes to v go to, and the name they go under */
+static tc_Wal *durableof (TVar *v, const char **name) {
+  if(v->cell) {
+    *name = v->cell->name;
+    return v->cell->log;
+  }
+  *name = v->name;
+  return v->log;
+}
+
+/*
+** var:durable(name, log) makes every commit that writes the variable
+** append its value under name to the write-ahead log; for a shared
+** variable it holds in every state, so mark it before passing it on
+*/
+static int tvar_durable (lua_State *L) {
+  TVar *v = checktvar(L, 1);
+  const char *name = luaL_checkstring(L, 2);
+  tc_Wal *w = taggedcoro_towal(L, 3);
+  char **pname = v->cell ? &v->cell->name : &v->name;
+  tc_Wal **plog = v->cell ? &v->cell->log : &v->log;
+  char *s = strdup(name);
+  if(!s) return luaL_error(L, "not enough memory");
+  taggedcoro_walref(w);
+  if(*plog) taggedcoro_walunref(*plog);
+  free(*pname);
+  *pname = s;
+  *plog = w;
+  return 0;
+}
+
+static int tvar_tostring (lua_State *L) {
+  TVar *v = checktvar(L, 1);
+  lua_pushfstring(L, "%s tvar (%p)", kinds[v->cell != NULL], keyof(v));
+  return 1;
+}
+
+static int tvar_gc (lua_State *L) {
+  TVar *v = checktvar(L, 1);
+  if(v->cell) {
+    taggedcoro_cellunref(v->cell);
+    v->cell = NULL;
+  }
+  if(v->log) taggedcoro_walunref(v->log);
+  free(v->name);
+  v->log = NULL;
+  v->name = NULL;
+  free(v->old);
+  v->old = NULL;
+  v->depth = v->nold = 0;
+  return 0;
+}
+
+static Tx *newtx (lua_State *L) {
+  Tx *tx = (Tx *)lua_newuserdata(L, sizeof(Tx));
+  memset(tx, 0, sizeof(Tx));
+  tx->slot = -1;
+  tx->rv = atomic_load(&clock_);
+  luaL_setmetatable(L, TC_TX);
+  lua_createtable(L, 5, 0);
+  lua_newtable(L);
+  lua_rawseti(L, -2, X_READS);
+  lua_newtable(L);
+  lua_rawseti(L, -2, X_WRITES);
+  lua_newtable(L);
+  lua_rawseti(L, -2, X_VALUES);
+  lua_setuservalue(L, -2);
+  return tx;
+}
+
+static void unpin (Tx *tx) {
+  if(tx->slot >= 0) {
+    atomic_store(&snapshots[tx->slot], 0);
+    tx->slot = -1;
+  }
+}
+
+/*
+** taggedcoro.stmtx([mode]) starts a log; a "snapshot" log only reads,
+** and holds back the old values it may read until it ends. At most
+** NSNAPSHOTS snapshot logs can run at once in the process.
+*/
+static int tx_new (lua_State *L) {
+  int snapshot = luaL_checkoption(L, 1, "update", modes);
+  int slot = -1;
+  Tx *tx;
+  if(snapshot && (slot = pinslot()) < 0)
+    return luaL_error(L, "too many snapshot transactions (limit is %d)", NSNAPSHOTS);
+  tx = newtx(L); /* cannot fail once the slot is taken */
+  if(snapshot) {
+    tx->snapshot = 1;
+    tx->slot = slot;
+    tx->rv = pinat(slot);
+  }
+  return 1;
+}
+
+/*
+** tx:nest() starts the log of a transaction nested in this one; it sees
+** the writes of its ancestors, and merges into its parent when it ends
+*/
+static int tx_nest (lua_State *L) {
+  Tx *parent = checktx(L, 1);
+  Tx *tx = newtx(L);
+  tx->rv = parent->rv;
+  tx->parent = parent;
+  tx->snapshot = parent->snapshot;
+  lua_getuservalue(L, -1);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, X_PARENT);
+  lua_pop(L, 1);
+  return 1;
+}
+
+/* marks the transaction failed because of the variable at idx */
+static int fail (lua_State *L, Tx *tx, int uv, int idx) {
+  tx->state = FAILED;
+  unpin(tx);
+  lua_pushvalue(L, idx);
+  lua_rawseti(L, uv, X_CONFLICT);
+  lua_pushboolean(L, 0);
+  return 1;
+}
+
+/* the stripe word of c as the log last saw it, if it is the one locking it */
+static long long stripeword (Tx *tx, tc_Cell *c) {
+  atomic_llong *s = stripeof(c);
+  long long w = atomic_load(s);
+  if(w == ((long long)(intptr_t)tx | 1)) {
+    int i;
+    for(i = 0; i < tx->nlocks; i++)
+      if(tx->locks[i].stripe == s) return tx->locks[i].old;
+  }
+  return w;
+}
+
+static int isstale (Tx *tx, TVar *v) {
+  long long w;
+  if(!v->cell) return v->version > tx->rv;
+  w = stripeword(tx, v->cell);
+  return LOCKED(w) || VERSION(w) > tx->rv;
+}
+
+/*
+** pushes the value that tx or one of its ancestors wrote to v, if any;
+** uv is the uservalue of tx
+*/
+static int pushwritten (lua_State *L, Tx *tx, int uv, TVar *v) {
+  int slot;
+  lua_pushvalue(L, uv);
+  while((slot = findwrite(tx, v)) < 0) {
+    if(!(tx = tx->parent)) {
+      lua_pop(L, 1);
+      return 0;
+    }
+    lua_rawgeti(L, -1, X_PARENT);
+    lua_getuservalue(L, -1);
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+  }
+  lua_rawgeti(L, -1, X_VALUES);
+  lua_rawgeti(L, -1, slot + 1);
+  lua_replace(L, -3);
+  lua_pop(L, 1);
+  return 1;
+}
+
+/* records the read of the variable at 2 by tx, with uservalue at 3 */
+static void addread (lua_State *L, Tx *tx, TVar *v) {
+  tx->reads[tx->nreads++] = v;
+  lua_rawgeti(L, 3, X_READS);
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, tx->nreads);
+  lua_pop(L, 1);
+}
+
+/*
+** reads the newest value of v at the start of a snapshot; a commit that
+** is older than the snapshot holds the stripe until it installs, so a
+** free stripe means the value is there
+*/
+static int snapshotread (lua_State *L, Tx *tx, TVar *v) {
+  if(v->cell) {
+    tc_Blob *b;
+    while(LOCKED(atomic_load(stripeof(v->cell))));
+    if(!(b = cellat(v->cell, tx->rv))) return fail(L, tx, 3, 2);
+    addread(L, tx, v);
+    lua_pushboolean(L, 1);
+    pushblob(L, b);
+  } else {
+    int i = 1;
+    if(v->version > tx->rv) {
+      while(i <= v->nold && v->old[i - 1] > tx->rv) i++;
+      if(i > v->nold) return fail(L, tx, 3, 2);
+      i++;
+    }
+    addread(L, tx, v);
+    lua_pushboolean(L, 1);
+    lua_getuservalue(L, 2);
+    lua_rawgeti(L, -1, i);
+    lua_remove(L, -2);
+  }
+  return 2;
+}
+
+/* tx:read(tvar) returns true and the value, or false on a conflict */
+static int tx_read (lua_State *L) {
+  Tx *tx = checktx(L, 1);
+  TVar *v = checktvar(L, 2);
+  tc_Blob *b = NULL;
+  lua_settop(L, 2);
+  lua_getuservalue(L, 1);
+  lua_pushboolean(L, 1);
+  if(pushwritten(L, tx, 3, v)) return 2; /* read your own write */
+  lua_pop(L, 1);
+  if(tx->nreads == tx->rcap)
+    tx->reads = (TVar **)grow(L, tx->reads, &tx->rcap, sizeof(TVar *));
+  if(tx->snapshot) return snapshotread(L, tx, v);
+  if(v->cell) { /* the stripe must not change while the value is taken */
+    long long w = atomic_load(stripeof(v->cell));
+    if(!LOCKED(w) && VERSION(w) <= tx->rv) {
+      b = cellget(v->cell);
+      if(atomic_load(stripeof(v->cell)) != w) {
+        taggedcoro_blobunref(b);
+        b = NULL;
+      }
+    }
+    if(!b) return fail(L, tx, 3, 2);
+  } else if(v->version > tx->rv) {
+    return fail(L, tx, 3, 2);
+  }
+  addread(L, tx, v);
+  lua_pushboolean(L, 1);
+  if(b) {
+    pushblob(L, b);
+  } else {
+    lua_getuservalue(L, 2);
+    lua_rawgeti(L, -1, 1);
+    lua_remove(L, -2);
+  }
+  return 2;
+}
+
+/*
+** finds or makes room for the write slot of the variable at idx, which
+** is anchored in the log (with uservalue uv) if it is new
+*/
+static int writeslot (lua_State *L, Tx *tx, int uv, int idx, int *isnew) {
+  int slot = findwrite(tx, (TVar *)lua_touserdata(L, idx));
+  *isnew = slot < 0;
+  if(slot >= 0) return slot;
+  if(tx->nwrites == tx->wcap) {
+    int cap = tx->wcap;
+    tc_Blob **blobs;
+    tx->writes = (TVar **)grow(L, tx->writes, &cap, sizeof(TVar *));
+    blobs = (tc_Blob **)realloc(tx->blobs, (size_t)cap * sizeof(tc_Blob *));
+    if(!blobs) luaL_error(L, "not enough memory");
+    memset(blobs + tx->wcap, 0, (size_t)(cap - tx->wcap) * sizeof(tc_Blob *));
+    tx->blobs = blobs;
+    tx->wcap = cap;
+  }
+  if((tx->nwrites + 1) * 2 > tx->hcap) reindex(L, tx);
+  lua_rawgeti(L, uv, X_WRITES);
+  lua_pushvalue(L, idx);
+  lua_rawseti(L, -2, tx->nwrites + 1);
+  lua_pop(L, 1);
+  return tx->nwrites;
+}
+
+/* fills the slot from writeslot with v, taking the reference of blob b */
+static void setwrite (Tx *tx, int slot, int isnew, TVar *v, tc_Blob *b) {
+  if(isnew) {
+    tx->nwrites++;
+    tx->writes[slot] = v;
+    indexwrite(tx, slot);
+  }
+  if(b) {
+    if(tx->blobs[slot]) taggedcoro_blobunref(tx->blobs[slot]);
+    tx->blobs[slot] = b;
+  }
+}
+
+static int tx_write (lua_State *L) {
+  Tx *tx = checktx(L, 1);
+  TVar *v = checktvar(L, 2);
+  int slot, isnew;
+  luaL_checkany(L, 3);
+  if(tx->snapshot) return luaL_error(L, "snapshot transactions are read-only");
+  lua_settop(L, 3);
+  lua_getuservalue(L, 1);
+  slot = writeslot(L, tx, 4, 2, &isnew); /* room before anything can fail halfway */
+  setwrite(tx, slot, isnew, v, v->cell ? taggedcoro_encode(L, 3, 1) : NULL);
+  lua_rawgeti(L, 4, X_VALUES);
+  lua_pushvalue(L, 3);
+  lua_rawseti(L, -2, slot + 1);
+  return 0;
+}
+
+/*
+** slot of the first read of tx newer than the start of the transaction,
+** -2 if it is a read of an ancestor, or -1 if every read is current
+*/
+static int validate (Tx *tx) {
+  Tx *t;
+  int i;
+  for(t = tx; t; t = t->parent)
+    for(i = 0; i < t->nreads; i++)
+      if(isstale(tx, t->reads[i])) return t == tx ? i : -2;
+  return -1;
+}
+
+static void unlock (Tx *tx, int restore, Version wv) {
+  int i;
+  for(i = 0; i < tx->nlocks; i++)
+    atomic_store(tx->locks[i].stripe, restore ? tx->locks[i].old : wv << 1);
+  tx->nlocks = 0;
+}
+
+/* locks the stripes of the shared writes; returns the slot that failed, or -1 */
+static int lockwrites (Tx *tx) {
+  long long mine = (long long)(intptr_t)tx | 1;
+  int i;
+  for(i = 0; i < tx->nwrites; i++) {
+    atomic_llong *s;
+    long long w;
+    int spins = SPINS;
+    if(!tx->writes[i]->cell) continue;
+    s = stripeof(tx->writes[i]->cell);
+    w = atomic_load(s);
+    if(w == mine) continue;
+    while(LOCKED(w) || !atomic_compare_exchange_weak(s, &w, mine)) {
+      if(--spins == 0) {
+        unlock(tx, 1, 0);
+        return i;
+      }
+      w = atomic_load(s);
+    }
+    tx->locks[tx->nlocks].stripe = s;
+    tx->locks[tx->nlocks++].old = w;
+  }
+  return -1;
+}
+
+/*
+** moves the current value of local variable v, with its uservalue on
+** top, into its history before a commit at wv overwrites it
+*/
+static void keepold (lua_State *L, TVar *v, Version wv, Version oldest) {
+  int uv = lua_gettop(L), i, keep;
+  Version succ = wv;
+  if(v->nold == v->depth) v->nold--;
+  for(i = v->nold; i > 0; i--) {
+    lua_rawgeti(L, uv, i + 1);
+    lua_rawseti(L, uv, i + 2);
+    v->old[i] = v->old[i - 1];
+  }
+  lua_rawgeti(L, uv, 1);
+  lua_rawseti(L, uv, 2);
+  v->old[0] = v->version;
+  v->nold++;
+  for(keep = 0; keep < v->nold && succ > oldest; keep++) succ = v->old[keep];
+  for(i = keep; i < v->nold; i++) {
+    lua_pushnil(L);
+    lua_rawseti(L, uv, i + 2);
+  }
+  v->nold = keep;
+}
+
+/*
+** encodes the durable writes of tx, with uservalue uv, into a record
+** for each log they go to: an array with their names, one with their
+** values, and their count
+*/
+static void encodelogged (lua_State *L, Tx *tx, int uv) {
+  int i, j;
+  for(i = 0; i < tx->nwrites; i++) {
+    const char *name;
+    tc_Wal *w = durableof(tx->writes[i], &name);
+    tc_Blob *rec;
+    int n = 0;
+    if(!w) continue;
+    for(j = 0; j < tx->nlogged && tx->logged[j].log != w; j++);
+    if(j < tx->nlogged) continue; /* already in its record */
+    if(!tx->logged &&
+       !(tx->logged = (Logged *)malloc((size_t)tx->nwrites * sizeof(Logged))))
+      luaL_error(L, "not enough memory");
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_rawgeti(L, uv, X_VALUES);
+    for(j = i; j < tx->nwrites; j++) {
+      if(durableof(tx->writes[j], &name) != w) continue;
+      lua_pushstring(L, name);
+      lua_rawseti(L, -4, ++n);
+      lua_rawgeti(L, -1, j + 1);
+      lua_rawseti(L, -3, n);
+    }
+    lua_pop(L, 1);
+    lua_pushinteger(L, n);
+    rec = taggedcoro_encode(L, -3, 3);
+    lua_pop(L, 3);
+    if(rec->nobjs > 0) {
+      taggedcoro_blobunref(rec);
+      luaL_error(L, "cannot log a queue");
+    }
+    taggedcoro_walref(w);
+    tx->logged[tx->nlogged].log = w;
+    tx->logged[tx->nlogged].record = rec;
+    tx->logged[tx->nlogged++].ticket = 0;
+  }
+}
+
+/*
+** tx:commit() returns true and the written local variables that
+** transactions are waiting on, or false on a conflict
+*/
+static int tx_commit (lua_State *L) {
+  Tx *tx = checktx(L, 1);
+  Version wv, old;
+  luaL_argcheck(L, !tx->parent, 1, "nested transactions merge instead");
+  int i, bad, nwoken = 0, wake = 0, unlogged = 0;
+  lua_settop(L, 1);
+  lua_getuservalue(L, 1);
+  if(!tx->nwrites) { /* every read was consistent when it was made */
+    tx->state = COMMITTED;
+    unpin(tx);
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  encodelogged(L, tx, 2);
+  tx->locks = (Lock *)realloc(tx->locks, (size_t)tx->nwrites * sizeof(Lock));
+  if(!tx->locks) return luaL_error(L, "not enough memory");
+  if((bad = lockwrites(tx)) >= 0) {
+    lua_rawgeti(L, 2, X_WRITES);
+    lua_rawgeti(L, -1, bad + 1);
+    return fail(L, tx, 2, -1);
+  }
+  wv = atomic_fetch_add(&clock_, 1) + 1;
+  if(wv != tx->rv + 1 && (bad = validate(tx)) >= 0) {
+    unlock(tx, 1, 0);
+    lua_rawgeti(L, 2, X_READS);
+    lua_rawgeti(L, -1, bad + 1);
+    return fail(L, tx, 2, -1);
+  }
+  for(i = 0; i < tx->nwrites; i++) {
+    TVar *v = tx->writes[i];
+    if(v->cell ? v->cell->depth : v->depth) break;
+  }
+  old = i < tx->nwrites ? oldest(wv) : wv;
+  for(i = 0; i < tx->nwrites; i++) { /* no Lua calls while the stripes are locked */
+    tc_Cell *c = tx->writes[i]->cell;
+    if(c) {
+      cellinstall(c, tx->blobs[i], wv, old);
+      tx->blobs[i] = NULL;
+      if(atomic_load(&c->watchers) > 0) wake = 1;
+    }
+  }
+  for(i = 0; i < tx->nlogged; i++) { /* before any later commit of the same stripes */
+    Logged *lg = &tx->logged[i];
+    lg->ticket = taggedcoro_walappend(lg->log, lg->record->data, lg->record->size, wv);
+    taggedcoro_blobunref(lg->record);
+    lg->record = NULL;
+    if(!lg->ticket) unlogged = 1;
+  }
+  unlock(tx, 0, wv);
+  tx->wv = wv;
+  if(wake) {
+    wakeall();
+    taggedcoro_wpsignal();
+  }
+  lua_rawgeti(L, 2, X_WRITES);
+  lua_rawgeti(L, 2, X_VALUES);
+  lua_pushboolean(L, 1);
+  for(i = 0; i < tx->nwrites; i++) {
+    TVar *v = tx->writes[i];
+    if(v->cell) continue;
+    lua_rawgeti(L, 3, i + 1);
+    lua_getuservalue(L, -1);
+    if(v->depth) keepold(L, v, wv, old);
+    lua_rawgeti(L, 4, i + 1);
+    lua_rawseti(L, -2, 1);
+    lua_pop(L, 1);
+    v->version = wv;
+    if(v->watchers) { /* keep the variable on the stack */
+      luaL_checkstack(L, 3, "too many variables to wake");
+      nwoken++;
+    } else {
+      lua_pop(L, 1);
+    }
+  }
+  tx->state = COMMITTED;
+  unpin(tx);
+  if(unlogged) return luaL_error(L, "not enough memory to log the commit");
+  return 1 + nwoken;
+}
+
+/* tx:validate() tells if everything read is still current */
+static int tx_validate (lua_State *L) {
+  Tx *tx = checktx(L, 1);
+  lua_pushboolean(L, validate(tx) == -1);
+  return 1;
+}
+
+static void unwatch (Tx *tx) {
+  int i;
+  if(!tx->watched) return;
+  for(i = 0; i < tx->nwatched; i++) {
+    TVar *v = tx->watched[i];
+    if(v->cell) atomic_fetch_sub(&v->cell->watchers, 1);
+    else v->watchers--;
+  }
+  free(tx->watched);
+  tx->watched = NULL;
+  tx->nwatched = 0;
+}
+
+/* watches the reads of tx and of its ancestors */
+static void watch (lua_State *L, Tx *tx) {
+  Tx *t;
+  int i, n = 0;
+  if(tx->watched) return;
+  for(t = tx; t; t = t->parent) n += t->nreads;
+  tx->watched = (TVar **)malloc((size_t)(n ? n : 1) * sizeof(TVar *));
+  if(!tx->watched) luaL_error(L, "not enough memory");
+  for(t = tx; t; t = t->parent) {
+    for(i = 0; i < t->nreads; i++) {
+      TVar *v = t->reads[i];
+      if(v->cell) atomic_fetch_add(&v->cell->watchers, 1);
+      else v->watchers++;
+      tx->watched[tx->nwatched++] = v;
+    }
+  }
+}
+
+/*
+** tx:watch() marks the variables read by the transaction and the ones
+** enclosing it as waited on, so commits that write them return them,
+** and returns an array with them
+*/
+static int tx_watch (lua_State *L) {
+  Tx *tx = (Tx *)luaL_checkudata(L, 1, TC_TX);
+  int i, n = 0;
+  watch(L, tx);
+  lua_createtable(L, tx->nwatched, 0);
+  lua_getuservalue(L, 1);
+  while(1) {
+    lua_rawgeti(L, -1, X_READS);
+    for(i = 1; i <= tx->nreads; i++) {
+      lua_rawgeti(L, -1, i);
+      lua_rawseti(L, -4, ++n);
+    }
+    lua_pop(L, 1);
+    if(!(tx = tx->parent)) break;
+    lua_rawgeti(L, -1, X_PARENT);
+    lua_getuservalue(L, -1);
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return 1;
+}
+
+static int tx_unwatch (lua_State *L) {
+  unwatch((Tx *)luaL_checkudata(L, 1, TC_TX));
+  return 0;
+}
+
+static int countshared (Tx *tx) {
+  int i, n = 0;
+  for(; tx; tx = tx->parent)
+    for(i = 0; i < tx->nreads; i++) n += tx->reads[i]->cell != NULL;
+  return n;
+}
+
+static void endwait (Tx *tx) {
+  unwatch(tx);
+  if(tx->wp) {
+    wpclose(tx->wp);
+    tx->wp = NULL;
+  }
+}
+
+/*
+** tx:abort() ends a log that will not commit, so it stops holding back
+** old values and watching variables
+*/
+static int tx_abort (lua_State *L) {
+  Tx *tx = (Tx *)luaL_checkudata(L, 1, TC_TX);
+  if(tx->state == ACTIVE) tx->state = FAILED;
+  endwait(tx);
+  unpin(tx);
+  return 0;
+}
+
+LUA_KFUNCTION(waitk) {
+  /* stack: tx, tag */
+  Tx *tx = (Tx *)lua_touserdata(L, 1);
+  (void)ctx;
+  if(status == LUA_YIELD) lua_settop(L, 2);
+  if(!lua_isnil(L, 2) && taggedcoro_canyield(L, 2)) {
+    if(!tx->wp && !(tx->wp = wpopen()))
+      return luaL_error(L, "cannot wait for commits: %s", strerror(errno));
+    wpdrain(tx->wp); /* before validating, so no commit after it is missed */
+    if(validate(tx) == -1) {
+      lua_pushcfunction(L, taggedcoro_yield);
+      lua_pushvalue(L, 2);
+      lua_pushvalue(L, 1);
+      lua_pushinteger(L, tx->wp->fd[0]);
+      lua_callk(L, 3, 0, 0, waitk);
+      return waitk(L, LUA_YIELD, 0);
+    }
+  } else {
+    while(1) {
+      int seq = atomic_load(&wakeseq);
+      if(validate(tx) != -1) break;
+      sleepon(seq);
+    }
+  }
+  endwait(tx);
+  return 0;
+}
+
+/*
+** tx:wait([tag]) watches the variables read and waits until a commit
+** changes one of the shared ones. If there is a coroutine for the tag
+** it yields the log and a descriptor that such a commit makes readable
+** to it, and looks again each time it is resumed; otherwise it blocks
+** the OS thread on a futex that the commit wakes
+*/
+static int tx_wait (lua_State *L) {
+  Tx *tx = checktx(L, 1);
+  luaL_argcheck(L, countshared(tx) > 0, 1, "no shared variables to wait on");
+  lua_settop(L, 2);
+  watch(L, tx);
+  return waitk(L, LUA_OK, 0);
+}
+
+/*
+** tx:shared() tells how many of the reads of the transaction and the
+** ones enclosing it were of shared variables
+*/
+static int tx_shared (lua_State *L) {
+  lua_pushinteger(L, countshared((Tx *)luaL_checkudata(L, 1, TC_TX)));
+  return 1;
+}
+
+/*
+** tx:merge() ends a nested transaction, moving its reads and writes
+** into its parent
+*/
+static int tx_merge (lua_State *L) {
+  Tx *tx = checktx(L, 1);
+  Tx *parent = tx->parent;
+  int i;
+  luaL_argcheck(L, parent != NULL, 1, "not a nested transaction");
+  lua_settop(L, 1);
+  lua_getuservalue(L, 1); /* 2 */
+  lua_rawgeti(L, 2, X_PARENT);
+  lua_getuservalue(L, -1); /* 4 */
+  lua_rawgeti(L, 2, X_READS); /* 5 */
+  lua_rawgeti(L, 4, X_READS); /* 6 */
+  for(i = 0; i < tx->nreads; i++) {
+    if(parent->nreads == parent->rcap)
+      parent->reads = (TVar **)grow(L, parent->reads, &parent->rcap, sizeof(TVar *));
+    lua_rawgeti(L, 5, i + 1);
+    lua_rawseti(L, 6, ++parent->nreads);
+    parent->reads[parent->nreads - 1] = tx->reads[i];
+  }
+  lua_rawgeti(L, 2, X_WRITES); /* 7 */
+  lua_rawgeti(L, 2, X_VALUES); /* 8 */
+  lua_rawgeti(L, 4, X_VALUES); /* 9 */
+  for(i = 0; i < tx->nwrites; i++) {
+    int slot, isnew;
+    lua_rawgeti(L, 7, i + 1);
+    slot = writeslot(L, parent, 4, lua_gettop(L), &isnew);
+    setwrite(parent, slot, isnew, tx->writes[i], tx->blobs[i]);
+    tx->blobs[i] = NULL;
+    lua_rawgeti(L, 8, i + 1);
+    lua_rawseti(L, 9, slot + 1);
+    lua_pop(L, 1);
+  }
+  tx->state = COMMITTED;
+  return 0;
+}
+
+/*
+** tx:extend() moves the start of the transaction (and of the ones
+** enclosing it) to now if everything they read is still current, so a
+** nested transaction that failed can run again without them; returns
+** whether it could
+*/
+static int tx_extend (lua_State *L) {
+  Tx *tx = checktx(L, 1);
+  Version now = atomic_load(&clock_);
+  int ok = validate(tx) == -1;
+  if(ok) {
+    Tx *t;
+    for(t = tx; t->parent; t = t->parent);
+    if(t->slot >= 0) now = pinat(t->slot); /* the snapshot moves with it */
+    for(t = tx; t; t = t->parent) t->rv = now;
+  }
+  lua_pushboolean(L, ok);
+  return 1;
+}
+
+/* tx:size() returns the number of reads and of writes */
+static int tx_size (lua_State *L) {
+  Tx *tx = (Tx *)luaL_checkudata(L, 1, TC_TX);
+  lua_pushinteger(L, tx->nreads);
+  lua_pushinteger(L, tx->nwrites);
+  return 2;
+}
+
+/*
+** tx:writes() returns arrays with the variables written and their
+** values, and the version of the commit that installed them (or 0)
+*/
+static int tx_writes (lua_State *L) {
+  Tx *tx = (Tx *)luaL_checkudata(L, 1, TC_TX);
+  int i;
+  lua_settop(L, 1);
+  lua_getuservalue(L, 1);
+  lua_createtable(L, tx->nwrites, 0);
+  lua_createtable(L, tx->nwrites, 0);
+  lua_rawgeti(L, 2, X_WRITES);
+  lua_rawgeti(L, 2, X_VALUES);
+  for(i = 1; i <= tx->nwrites; i++) {
+    lua_rawgeti(L, 5, i);
+    lua_rawseti(L, 3, i);
+    lua_rawgeti(L, 6, i);
+    lua_rawseti(L, 4, i);
+  }
+  lua_pop(L, 2);
+  lua_pushinteger(L, (lua_Integer)tx->wv);
+  return 3;
+}
+
+/* tx:logged() returns how many records its commit appended to logs */
+static int tx_logged (lua_State *L) {
+  Tx *tx = (Tx *)luaL_checkudata(L, 1, TC_TX);
+  int i, n = 0;
+  for(i = 0; i < tx->nlogged; i++) n += tx->logged[i].ticket != 0;
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+LUA_KFUNCTION(synck) {
+  /* stack: tx, tag */
+  Tx *tx = (Tx *)lua_touserdata(L, 1);
+  int i, yield;
+  (void)ctx;
+  if(status == LUA_YIELD) lua_settop(L, 2);
+  yield = !lua_isnil(L, 2) && taggedcoro_canyield(L, 2);
+  for(i = 0; i < tx->nlogged; i++) {
+    Logged *lg = &tx->logged[i];
+    if(!lg->ticket) continue;
+    if(tx->wp) wpdrain(tx->wp); /* before looking, so no flush after it is missed */
+    while(!taggedcoro_walsync(L, lg->log, lg->ticket, !yield)) {
+      if(!tx->wp) { /* look again once it is open */
+        if(!(tx->wp = wpopen()))
+          return luaL_error(L, "cannot wait for flushes: %s", strerror(errno));
+        continue;
+      }
+      lua_pushcfunction(L, taggedcoro_yield);
+      lua_pushvalue(L, 2);
+      lua_pushvalue(L, 1);
+      lua_pushinteger(L, tx->wp->fd[0]);
+      lua_callk(L, 3, 0, 0, synck);
+      return synck(L, LUA_YIELD, 0);
+    }
+  }
+  if(tx->wp) {
+    wpclose(tx->wp);
+    tx->wp = NULL;
+  }
+  return 0;
+}
+
+/*
+** tx:sync([tag]) waits until the records that its commit appended are
+** on disk. When another thread is flushing them and there is a
+** coroutine for the tag, it yields the log and a descriptor that the
+** end of the flush makes readable to it, and looks again each time it
+** is resumed; otherwise it blocks the OS thread, also to lead a flush
+*/
+static int tx_sync (lua_State *L) {
+  luaL_checkudata(L, 1, TC_TX);
+  lua_settop(L, 2);
+  return synck(L, LUA_OK, 0);
+}
+
+/* tx:conflict() returns the variable that made the transaction fail */
+static int tx_conflict (lua_State *L) {
+  luaL_checkudata(L, 1, TC_TX);
+  lua_getuservalue(L, 1);
+  lua_rawgeti(L, -1, X_CONFLICT);
+  return 1;
+}
+
+static int tx_tostring (lua_State *L) {
+  static const char *const states[] = { "active", "committed", "failed" };
+  Tx *tx = (Tx *)lua_touserdata(L, 1);
+  lua_pushfstring(L, "transaction (%s, %d reads, %d writes)",
+                  states[tx->state], tx->nreads, tx->nwrites);
+  return 1;
+}
+
+static int tx_gc (lua_State *L) {
+  Tx *tx = (Tx *)luaL_checkudata(L, 1, TC_TX);
+  int i;
+  endwait(tx);
+  unpin(tx);
+  for(i = 0; i < tx->nwrites; i++)
+    if(tx->blobs[i]) taggedcoro_blobunref(tx->blobs[i]);
+  for(i = 0; i < tx->nlogged; i++) {
+    if(tx->logged[i].record) taggedcoro_blobunref(tx->logged[i].record);
+    taggedcoro_walunref(tx->logged[i].log);
+  }
+  free(tx->logged);
+  tx->logged = NULL;
+  tx->nlogged = 0;
+  free(tx->reads);
+  free(tx->writes);
+  free(tx->blobs);
+  free(tx->hslots);
+  free(tx->locks);
+  tx->reads = tx->writes = NULL;
+  tx->blobs = NULL;
+  tx->hslots = NULL;
+  tx->locks = NULL;
+  tx->nreads = tx->nwrites = tx->rcap = tx->wcap = tx->hcap = 0;
+  return 0;
+}
+
+static const luaL_Reg tvar_methods[] = {
+  {"get", tvar_get},
+  {"version", tvar_version},
+  {"durable", tvar_durable},
+  {NULL, NULL}
+};
+
+static const luaL_Reg tx_methods[] = {
+  {"read", tx_read},
+  {"write", tx_write},
+  {"commit", tx_commit},
+  {"abort", tx_abort},
+  {"validate", tx_validate},
+  {"watch", tx_watch},
+  {"unwatch", tx_unwatch},
+  {"wait", tx_wait},
+  {"shared", tx_shared},
+  {"nest", tx_nest},
+  {"merge", tx_merge},
+  {"extend", tx_extend},
+  {"size", tx_size},
+  {"writes", tx_writes},
+  {"logged", tx_logged},
+  {"sync", tx_sync},
+  {"conflict", tx_conflict},
+  {NULL, NULL}
+};
+
+static const luaL_Reg tx_meta[] = {
+  {"__tostring", tx_tostring},
+  {"__gc", tx_gc},
+  {NULL, NULL}
+};
+
+void taggedcoro_openstm (lua_State *L) {
+  /* stack: module, coroset */
+  luaL_newmetatable(L, TC_TVAR);
+  luaL_newlibtable(L, tvar_methods);
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, tvar_methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, tvar_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushcfunction(L, tvar_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+  luaL_newmetatable(L, TC_TX);
+  luaL_newlibtable(L, tx_methods);
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, tx_methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, tx_meta, 1);
+  lua_pop(L, 1);
+  lua_pushcfunction(L, tvar_new);
+  lua_setfield(L, -3, "tvar");
+  lua_pushcfunction(L, tx_new);
+  lua_setfield(L, -3, "stmtx");
+}
+
+/* }====================================================== */
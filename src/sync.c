@@ -0,0 +1,431 @@
+/*
+** Synchronization between async tasks: mutexes, counting semaphores,
+** readers-writer locks and wait groups. Acquiring a free primitive never
+** yields; otherwise the task blocks in a first-in, first-out wait list,
+** and a release hands the primitive to the first waiters directly, so a
+** woken task already owns what it waited for and nothing can barge in
+** ahead of the queue.
+*/
+
+#include <string.h>
+
+#include "taggedcoro.h"
+
+#define TC_MUTEX "taggedcoro.mutex"
+#define TC_SEMAPHORE "taggedcoro.semaphore"
+#define TC_RWLOCK "taggedcoro.rwlock"
+#define TC_WAITGROUP "taggedcoro.waitgroup"
+
+/*
+** A blocked acquire, which owns itself while in a wait list; its
+** uservalue is { task }, as a closed task drops it from its stack
+*/
+typedef struct Wait {
+  tc_Waiter w; /* must be the first field */
+  tc_Waiter *task;
+  int n; /* units it waits for, or 0 for a writer */
+} Wait;
+
+static void pushwaittask (lua_State *L, int wait) {
+  lua_getuservalue(L, wait);
+  lua_rawgeti(L, -1, 1);
+  lua_remove(L, -2);
+}
+
+/* stack: wait */
+static int waitfire (lua_State *L, tc_Waiter *w) {
+  Wait *wt = (Wait *)w;
+  pushwaittask(L, -1);
+  if(wt->task->fire(L, wt->task)) {
+    lua_remove(L, -2);
+    return 1;
+  }
+  lua_pop(L, 1);
+  return 0;
+}
+
+/*
+** drops the waits of closed tasks from the front of the wait list, so
+** nothing is handed to a task that will never run again to release it
+*/
+static void prune (lua_State *L, tc_WaitList *l) {
+  while(l->head) {
+    int closed;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, l->head->ref);
+    pushwaittask(L, -1);
+    closed = taggedcoro_taskclosed(L, -1);
+    lua_pop(L, 1);
+    if(closed) taggedcoro_waitremove(L, l->head);
+    lua_pop(L, 1);
+    if(!closed) break;
+  }
+}
+
+LUA_KFUNCTION(wokenk) {
+  (void)status;
+  (void)ctx;
+  return 0; /* the waker already handed over what it waited for */
+}
+
+/* blocks the running task in the wait list until it is handed n units */
+static int blockon (lua_State *L, tc_WaitList *l, int n) {
+  Wait *wt;
+  lua_pushliteral(L, TC_ASYNC);
+  if(!taggedcoro_canyield(L, -1))
+    return luaL_error(L, "attempt to block outside of an async task");
+  lua_pop(L, 1);
+  wt = (Wait *)lua_newuserdata(L, sizeof(Wait));
+  memset(wt, 0, sizeof(Wait));
+  wt->w.fire = waitfire;
+  wt->w.ref = LUA_NOREF;
+  wt->n = n;
+  lua_createtable(L, 1, 0);
+  wt->task = taggedcoro_block(L);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+  taggedcoro_waitadd(L, l, &wt->w, -1);
+  lua_pushcfunction(L, taggedcoro_yield);
+  lua_pushliteral(L, TC_ASYNC);
+  lua_callk(L, 1, 0, 0, wokenk);
+  return wokenk(L, LUA_OK, 0);
+}
+
+static int firstn (tc_WaitList *l) {
+  return ((Wait *)l->head)->n;
+}
+
+static int sync_tostring (lua_State *L) {
+  lua_pushfstring(L, "%s (%p)", lua_tostring(L, lua_upvalueindex(1)),
+                  lua_touserdata(L, 1));
+  return 1;
+}
+
+/*
+** {======================================================
+** Mutexes
+** =======================================================
+*/
+
+typedef struct Mutex {
+  int locked;
+  tc_WaitList waiters;
+} Mutex;
+
+static Mutex *checkmutex (lua_State *L, int idx) {
+  return (Mutex *)luaL_checkudata(L, idx, TC_MUTEX);
+}
+
+static int mutex_lock (lua_State *L) {
+  Mutex *m = checkmutex(L, 1);
+  if(!m->locked) {
+    m->locked = 1;
+    return 0;
+  }
+  return blockon(L, &m->waiters, 1);
+}
+
+static int mutex_trylock (lua_State *L) {
+  Mutex *m = checkmutex(L, 1);
+  int ok = !m->locked;
+  m->locked = 1;
+  lua_pushboolean(L, ok);
+  return 1;
+}
+
+static int mutex_unlock (lua_State *L) {
+  Mutex *m = checkmutex(L, 1);
+  if(!m->locked) return luaL_error(L, "unlock of unlocked mutex");
+  prune(L, &m->waiters);
+  if(!taggedcoro_wakeone(L, &m->waiters)) m->locked = 0; /* else it passes on */
+  return 0;
+}
+
+static int mutex_locked (lua_State *L) {
+  lua_pushboolean(L, checkmutex(L, 1)->locked);
+  return 1;
+}
+
+static int mutex_new (lua_State *L) {
+  Mutex *m = (Mutex *)lua_newuserdata(L, sizeof(Mutex));
+  memset(m, 0, sizeof(Mutex));
+  luaL_setmetatable(L, TC_MUTEX);
+  return 1;
+}
+
+static const luaL_Reg mutex_methods[] = {
+  {"lock", mutex_lock},
+  {"trylock", mutex_trylock},
+  {"unlock", mutex_unlock},
+  {"locked", mutex_locked},
+  {NULL, NULL}
+};
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Semaphores
+** =======================================================
+*/
+
+typedef struct Semaphore {
+  lua_Integer count;
+  tc_WaitList waiters;
+} Semaphore;
+
+static Semaphore *checksem (lua_State *L, int idx) {
+  return (Semaphore *)luaL_checkudata(L, idx, TC_SEMAPHORE);
+}
+
+static int checkunits (lua_State *L, int idx) {
+  lua_Integer n = luaL_optinteger(L, idx, 1);
+  luaL_argcheck(L, n > 0 && n <= 0x7fffffff, idx, "invalid count");
+  return (int)n;
+}
+
+static int sem_acquire (lua_State *L) {
+  Semaphore *s = checksem(L, 1);
+  int n = checkunits(L, 2);
+  if(!s->waiters.head && s->count >= n) {
+    s->count -= n;
+    return 0;
+  }
+  return blockon(L, &s->waiters, n);
+}
+
+static int sem_tryacquire (lua_State *L) {
+  Semaphore *s = checksem(L, 1);
+  int n = checkunits(L, 2);
+  int ok = !s->waiters.head && s->count >= n;
+  if(ok) s->count -= n;
+  lua_pushboolean(L, ok);
+  return 1;
+}
+
+static int sem_release (lua_State *L) {
+  Semaphore *s = checksem(L, 1);
+  s->count += checkunits(L, 2);
+  while(prune(L, &s->waiters), s->waiters.head && firstn(&s->waiters) <= s->count) {
+    s->count -= firstn(&s->waiters);
+    taggedcoro_wakeone(L, &s->waiters);
+  }
+  return 0;
+}
+
+static int sem_len (lua_State *L) {
+  lua_pushinteger(L, checksem(L, 1)->count);
+  return 1;
+}
+
+static int sem_new (lua_State *L) {
+  lua_Integer n = luaL_optinteger(L, 1, 0);
+  Semaphore *s;
+  luaL_argcheck(L, n >= 0, 1, "invalid count");
+  s = (Semaphore *)lua_newuserdata(L, sizeof(Semaphore));
+  memset(s, 0, sizeof(Semaphore));
+  s->count = n;
+  luaL_setmetatable(L, TC_SEMAPHORE);
+  return 1;
+}
+
+static const luaL_Reg sem_methods[] = {
+  {"acquire", sem_acquire},
+  {"tryacquire", sem_tryacquire},
+  {"release", sem_release},
+  {NULL, NULL}
+};
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Readers-writer locks
+** =======================================================
+*/
+
+typedef struct RWLock {
+  int readers;
+  int writer;
+  tc_WaitList waiters; /* readers wait for 1 unit, writers for 0 */
+} RWLock;
+
+static RWLock *checkrwlock (lua_State *L, int idx) {
+  return (RWLock *)luaL_checkudata(L, idx, TC_RWLOCK);
+}
+
+/* hands the lock to the first writer, or to all the readers before the next one */
+static void grant (lua_State *L, RWLock *rw) {
+  while(prune(L, &rw->waiters), rw->waiters.head && !rw->writer) {
+    if(firstn(&rw->waiters)) {
+      rw->readers++;
+    } else if(rw->readers == 0) {
+      rw->writer = 1;
+    } else {
+      break;
+    }
+    taggedcoro_wakeone(L, &rw->waiters);
+  }
+}
+
+static int rw_rlock (lua_State *L) {
+  RWLock *rw = checkrwlock(L, 1);
+  if(!rw->writer && !rw->waiters.head) { /* queued writers go first */
+    rw->readers++;
+    return 0;
+  }
+  return blockon(L, &rw->waiters, 1);
+}
+
+static int rw_tryrlock (lua_State *L) {
+  RWLock *rw = checkrwlock(L, 1);
+  int ok = !rw->writer && !rw->waiters.head;
+  if(ok) rw->readers++;
+  lua_pushboolean(L, ok);
+  return 1;
+}
+
+static int rw_runlock (lua_State *L) {
+  RWLock *rw = checkrwlock(L, 1);
+  if(rw->readers == 0) return luaL_error(L, "runlock of unlocked rwlock");
+  if(--rw->readers == 0) grant(L, rw);
+  return 0;
+}
+
+static int rw_lock (lua_State *L) {
+  RWLock *rw = checkrwlock(L, 1);
+  if(!rw->writer && rw->readers == 0 && !rw->waiters.head) {
+    rw->writer = 1;
+    return 0;
+  }
+  return blockon(L, &rw->waiters, 0);
+}
+
+static int rw_trylock (lua_State *L) {
+  RWLock *rw = checkrwlock(L, 1);
+  int ok = !rw->writer && rw->readers == 0 && !rw->waiters.head;
+  if(ok) rw->writer = 1;
+  lua_pushboolean(L, ok);
+  return 1;
+}
+
+static int rw_unlock (lua_State *L) {
+  RWLock *rw = checkrwlock(L, 1);
+  if(!rw->writer) return luaL_error(L, "unlock of unlocked rwlock");
+  rw->writer = 0;
+  grant(L, rw);
+  return 0;
+}
+
+static int rw_new (lua_State *L) {
+  RWLock *rw = (RWLock *)lua_newuserdata(L, sizeof(RWLock));
+  memset(rw, 0, sizeof(RWLock));
+  luaL_setmetatable(L, TC_RWLOCK);
+  return 1;
+}
+
+static const luaL_Reg rw_methods[] = {
+  {"rlock", rw_rlock},
+  {"tryrlock", rw_tryrlock},
+  {"runlock", rw_runlock},
+  {"lock", rw_lock},
+  {"trylock", rw_trylock},
+  {"unlock", rw_unlock},
+  {NULL, NULL}
+};
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Wait groups
+** =======================================================
+*/
+
+typedef struct WaitGroup {
+  lua_Integer count;
+  tc_WaitList waiters;
+} WaitGroup;
+
+static WaitGroup *checkwg (lua_State *L, int idx) {
+  return (WaitGroup *)luaL_checkudata(L, idx, TC_WAITGROUP);
+}
+
+static int addcount (lua_State *L, WaitGroup *wg, lua_Integer n) {
+  if(wg->count + n < 0) return luaL_error(L, "negative wait group counter");
+  wg->count += n;
+  if(wg->count == 0) taggedcoro_wakeall(L, &wg->waiters);
+  return 0;
+}
+
+static int wg_add (lua_State *L) {
+  return addcount(L, checkwg(L, 1), luaL_optinteger(L, 2, 1));
+}
+
+static int wg_done (lua_State *L) {
+  return addcount(L, checkwg(L, 1), -1);
+}
+
+static int wg_wait (lua_State *L) {
+  WaitGroup *wg = checkwg(L, 1);
+  if(wg->count == 0) return 0;
+  return blockon(L, &wg->waiters, 0);
+}
+
+static int wg_len (lua_State *L) {
+  lua_pushinteger(L, checkwg(L, 1)->count);
+  return 1;
+}
+
+static int wg_new (lua_State *L) {
+  WaitGroup *wg = (WaitGroup *)lua_newuserdata(L, sizeof(WaitGroup));
+  memset(wg, 0, sizeof(WaitGroup));
+  luaL_setmetatable(L, TC_WAITGROUP);
+  return 1;
+}
+
+static const luaL_Reg wg_methods[] = {
+  {"add", wg_add},
+  {"done", wg_done},
+  {"wait", wg_wait},
+  {NULL, NULL}
+};
+
+/* }====================================================== */
+
+static const luaL_Reg funcs[] = {
+  {"mutex", mutex_new},
+  {"semaphore", sem_new},
+  {"rwlock", rw_new},
+  {"waitgroup", wg_new},
+  {NULL, NULL}
+};
+
+/* stack: module, coroset */
+static void newclass (lua_State *L, const char *name, const char *shortname,
+                      const luaL_Reg *methods, lua_CFunction len) {
+  luaL_newmetatable(L, name);
+  lua_newtable(L);
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushstring(L, shortname);
+  lua_pushcclosure(L, sync_tostring, 1);
+  lua_setfield(L, -2, "__tostring");
+  if(len) {
+    lua_pushcfunction(L, len);
+    lua_setfield(L, -2, "__len");
+  }
+  lua_pop(L, 1);
+}
+
+void taggedcoro_opensync (lua_State *L) {
+  /* stack: module, coroset */
+  newclass(L, TC_MUTEX, "mutex", mutex_methods, NULL);
+  newclass(L, TC_SEMAPHORE, "semaphore", sem_methods, sem_len);
+  newclass(L, TC_RWLOCK, "rwlock", rw_methods, NULL);
+  newclass(L, TC_WAITGROUP, "wait group", wg_methods, wg_len);
+  lua_pushvalue(L, -2);
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, funcs, 1);
+  lua_pop(L, 1);
+}
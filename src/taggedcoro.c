@@ -3,14 +3,13 @@
 #include <stdio.h>
 #endif
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
-#include "compat-5.3.h"
-
-#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM == 502
-#define lua_isyieldable taggedcoro_isyieldable
-LUA_API int taggedcoro_isyieldable (lua_State *L);
+#ifdef TC_STATS
+#include <time.h>
 #endif
+#include "taggedcoro.h"
 
 /* exports */
 LUAMOD_API int luaopen_taggedcoro (lua_State *L);
@@ -65,6 +64,151 @@ static int moveyielded (lua_State *L, lua_State *co) {
 }
 
 static int auxcallk(lua_State *L, int status, lua_KContext ctx); /* forward declaration */
+static const char cancelled_key = 'k'; /* error for resuming a closed coroutine */
+static void preempt (lua_State *L, lua_Debug *ar); /* forward declaration */
+
+/* coroutines without a budget of their own run with the budget of their parent */
+static void inheritbudget (lua_State *L, lua_State *co) {
+  /* stack: coroset[co], ... */
+  if(lua_rawgeti(L, 1, 5) == LUA_TNIL) { /* coroset[co].budget */
+    if(lua_gethook(L) == preempt) {
+      lua_sethook(co, preempt, LUA_MASKCOUNT, lua_gethookcount(L));
+    } else if(lua_gethook(co) == preempt) {
+      lua_sethook(co, NULL, 0, 0);
+    }
+  }
+  lua_pop(L, 1);
+}
+
+#ifdef TC_STATS
+
+/*
+** {======================================================
+** Accounting, compiled in with TC_STATS: every resume of a tagged
+** coroutine reads the CPU clock of the thread before and after, and
+** charges the time to the coroutine minus what the coroutines it
+** resumed took, so the figures of nested coroutines do not overlap.
+** Each coroutine keeps its figures in a userdata at meta[12], which
+** also points to the figures of its tag.
+** =======================================================
+*/
+
+typedef struct Stats {
+  double cpu; /* seconds */
+  lua_Integer resumes;
+  lua_Integer yields;
+  struct Stats *tag; /* NULL for the figures of a tag */
+} Stats;
+
+static const char stats_key = 's'; /* figures by tag */
+
+static _Thread_local double childtime; /* of the resumes inside the current one */
+
+static double cputime (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static Stats *newstats (lua_State *L) {
+  Stats *s = (Stats *)lua_newuserdata(L, sizeof(Stats));
+  memset(s, 0, sizeof(Stats));
+  return s;
+}
+
+/* the figures of the coroutine with coroset[co] at index 1 */
+static Stats *getstats (lua_State *L) {
+  Stats *s;
+  if(lua_rawgeti(L, 1, 12) != LUA_TNIL) {
+    s = (Stats *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return s;
+  }
+  lua_pop(L, 1);
+  s = newstats(L);
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &stats_key);
+  lua_rawgeti(L, 1, 1); /* tag */
+  if(lua_rawget(L, -2) == LUA_TNIL) {
+    lua_pop(L, 1);
+    newstats(L);
+    lua_rawgeti(L, 1, 1);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4); /* stats[tag] = figures of the tag */
+  }
+  s->tag = (Stats *)lua_touserdata(L, -1);
+  lua_setuservalue(L, -3); /* keeps them alive */
+  lua_pop(L, 1);
+  lua_rawseti(L, 1, 12); /* meta[12] = figures */
+  return s;
+}
+
+static int statsresume (lua_State *L, lua_State *co, int narg) {
+  Stats *s = getstats(L);
+  double outer = childtime, start = cputime(), elapsed, self;
+  int status;
+  childtime = 0;
+  status = lua_resume(co, L, narg);
+  elapsed = cputime() - start;
+  self = elapsed - childtime;
+  childtime = outer + elapsed;
+  s->cpu += self;
+  s->tag->cpu += self;
+  s->resumes++;
+  s->tag->resumes++;
+  if(status == LUA_YIELD) {
+    s->yields++;
+    s->tag->yields++;
+  }
+  return status;
+}
+
+static void pushstats (lua_State *L, Stats *s) {
+  lua_createtable(L, 0, 3);
+  lua_pushnumber(L, s ? s->cpu : 0);
+  lua_setfield(L, -2, "cpu");
+  lua_pushinteger(L, s ? s->resumes : 0);
+  lua_setfield(L, -2, "resumes");
+  lua_pushinteger(L, s ? s->yields : 0);
+  lua_setfield(L, -2, "yields");
+}
+
+/*
+** stats(co) returns the CPU time, resumes, and yields of a coroutine;
+** stats() returns a table with the figures of each tag
+*/
+static int taggedcoro_stats (lua_State *L) {
+  if(lua_isnone(L, 1)) {
+    lua_newtable(L);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &stats_key);
+    lua_pushnil(L);
+    while(lua_next(L, -2)) {
+      Stats *s = (Stats *)lua_touserdata(L, -1);
+      lua_pop(L, 1);
+      lua_pushvalue(L, -1);
+      pushstats(L, s);
+      lua_rawset(L, -5);
+    }
+    lua_pop(L, 1);
+    return 1;
+  }
+  getco(L);
+  lua_pushvalue(L, 1);
+  if(lua_rawget(L, lua_upvalueindex(1)) == LUA_TNIL) /* coroset[co] */
+    return luaL_error(L, "no figures for untagged coroutine");
+  lua_rawgeti(L, -1, 12);
+  pushstats(L, (Stats *)lua_touserdata(L, -1));
+  return 1;
+}
+
+/* }====================================================== */
+
+#define resume(L, co, narg) statsresume(L, co, narg)
+
+#else
+
+#define resume(L, co, narg) lua_resume(co, L, narg)
+
+#endif
 
 LUA_KFUNCTION(untaggedk) {
   /* stack: coroset[co], co, tag, <args> */
@@ -88,9 +232,17 @@ LUA_KFUNCTION(auxcallk) {
   } else {
     narg = status ? lua_gettop(co) : lua_gettop(co)-1;
   }
+  if(lua_rawgeti(L, 1, 8) != LUA_TNIL) { /* coroset[co].closed */
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &cancelled_key);
+    return lua_error(L);
+  }
+  lua_pop(L, 1);
   lua_pushnil(L);
   lua_rawseti(L, 1, 2); /* coroset[co].stacked = nil */
-  status = lua_resume(co, L, narg);
+  lua_pushnil(L);
+  lua_rawseti(L, 1, 10); /* coroset[co].above = nil */
+  inheritbudget(L, co);
+  status = resume(L, co, narg);
   if (status == LUA_OK) {
     return moveyielded(L, co);
   } else if(status == LUA_YIELD) {
@@ -103,6 +255,8 @@ LUA_KFUNCTION(auxcallk) {
       lua_xmove(co, L, 3); /* move tag, yielder, sentinel */
     }
     /* stack: coroset[co], co, tag, ytag, yielder, sentinel */
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, 1, 10); /* coroset[co].above = yielder, the top of the stack above co */
     if(lua_compare(L, -4, -3, LUA_OPEQ)) { /* yield was for me */
       lua_pop(L, 1); /* pop sentinel */
       lua_State *yco = lua_tothread(L, -1);
@@ -191,7 +345,7 @@ static int auxcall (lua_State *L, lua_State *co, lua_State *yco, int status, int
   return r;
 }
 
-static int taggedcoro_cocall (lua_State *L) {
+int taggedcoro_cocall (lua_State *L) {
   lua_State *co = getco(L);
   if (lua_status(co) == LUA_OK && lua_gettop(co) == 0) {
     return luaL_error(L, "cannot resume dead coroutine");
@@ -207,6 +361,9 @@ static int taggedcoro_cocall (lua_State *L) {
   if(lua_rawgeti(L, -1, 2) != LUA_TNIL) { /* coroset[co].stacked? */
     return luaL_error(L, "cannot resume stacked coroutine");
   } else lua_pop(L, 1);
+  if(lua_rawgeti(L, -1, 8) != LUA_TNIL) { /* coroset[co].closed? */
+    return luaL_error(L, "cannot resume dead coroutine");
+  } else lua_pop(L, 1);
   lua_State *yco = co;
   if(lua_rawgeti(L, -1, 4) != LUA_TNIL) { /* yielder == nil? */
     yco = lua_tothread(L, -1);
@@ -236,6 +393,18 @@ static int taggedcoro_coresume (lua_State *L) {
   return resumek(L, lua_pcallk(L, lua_gettop(L) - 1, LUA_MULTRET, 0, 0, resumek), 0);
 }
 
+/*
+** pushes the metadata table for a new coroutine with the tag at index tag:
+** { <tag>, <stacked>, <parent>, <yielder>, <budget>, <preemptions>,
+**   <priority>, <closed>, <nursery>, <above>, <task>, <stats> }
+*/
+void taggedcoro_newmeta (lua_State *L, int tag) {
+  tag = lua_absindex(L, tag);
+  lua_createtable(L, 12, 0);
+  lua_pushvalue(L, tag); /* copy tag to top */
+  lua_rawseti(L, -2, 1); /* meta[1] = tag */
+}
+
 static int taggedcoro_cocreate (lua_State *L) {
   lua_State *NL;
   if(lua_isnoneornil(L, 1)) {
@@ -243,13 +412,16 @@ static int taggedcoro_cocreate (lua_State *L) {
     lua_replace(L, 1);
   }
   luaL_checktype(L, 2, LUA_TFUNCTION);
+  if(!lua_isnoneornil(L, 3)) luaL_checknumber(L, 3); /* priority */
   NL = lua_newthread(L);
   lua_pushvalue(L, 2);  /* copy function to top */
   lua_xmove(L, NL, 1);  /* move function from L to NL */
   lua_pushvalue(L, -1); /* dup NL */
-  lua_createtable(L, 4, 0); /* meta = { <tag>, <stacked>, <parent>, <yielder> } */
-  lua_pushvalue(L, 1); /* copy tag to top */
-  lua_rawseti(L, -2, 1); /* meta[1] = tag */
+  taggedcoro_newmeta(L, 1);
+  if(!lua_isnoneornil(L, 3)) {
+    lua_pushvalue(L, 3);
+    lua_rawseti(L, -2, 7); /* meta[7] = priority */
+  }
   lua_rawset(L, lua_upvalueindex(1)); /* coroset[co] = meta */
   return 1;
 }
@@ -268,7 +440,7 @@ LUA_KFUNCTION(yieldk) {
   return lua_gettop(L);
 }
 
-static int taggedcoro_yield (lua_State *L) {
+int taggedcoro_yield (lua_State *L) {
   lua_rotate(L, 1, -1); /* move tag to top */
   lua_pushthread(L); /* push yielder */
   lua_pushlightuserdata(L, &getco); /* sentinel */
@@ -316,8 +488,11 @@ static int taggedcoro_costatus (lua_State *L) {
     switch (lua_status(co)) {
       case LUA_YIELD:
         lua_pushvalue(L, 1);
-        if((lua_rawget(L, lua_upvalueindex(1)) == LUA_TNIL) ||
-           (lua_rawgeti(L, -1, 2) == LUA_TNIL)) {
+        if(lua_rawget(L, lua_upvalueindex(1)) == LUA_TNIL) {
+          lua_pushliteral(L, "suspended");
+        } else if(lua_rawgeti(L, -1, 8) != LUA_TNIL) { /* closed */
+          lua_pushliteral(L, "dead");
+        } else if(lua_rawgeti(L, -2, 2) == LUA_TNIL) {
           lua_pushliteral(L, "suspended");
         } else {
           lua_pushliteral(L, "stacked");
@@ -342,36 +517,131 @@ static int taggedcoro_costatus (lua_State *L) {
   return 1;
 }
 
-static int taggedcoro_yieldable (lua_State *L) {
-  if(lua_isnoneornil(L, 1)) {
-    lua_pushliteral(L, "coroutine");
-    lua_replace(L, 1);
+/*
+** Closes the coroutine at index idx together with the coroutines stacked
+** above it, without resuming them: they become dead, and their stacks are
+** released as soon as nothing else references them. Resuming a stack that
+** has a closed coroutine raises the cancelled error where the closed
+** coroutine would be resumed. Returns 0 if the coroutine is running or
+** normal, as those cannot be closed.
+*/
+int taggedcoro_close (lua_State *L, int idx) {
+  lua_State *co = lua_tothread(L, idx);
+  lua_Debug ar;
+  int top = lua_gettop(L);
+  if(co == L || (lua_status(co) == LUA_OK && lua_getstack(co, 0, &ar) > 0)) {
+    return 0;
   }
-  if(!lua_isyieldable(L)) {
-    lua_pushboolean(L, 0);
+  lua_pushvalue(L, idx);
+  if(lua_rawget(L, lua_upvalueindex(1)) == LUA_TNIL) { /* untagged */
+    lua_settop(co, 0);
+    lua_settop(L, top);
+    return 1;
+  }
+  if(lua_rawgeti(L, -1, 8) != LUA_TNIL) { /* already closed */
+    lua_settop(L, top);
     return 1;
   }
+  lua_pop(L, 1);
+  if(lua_status(co) != LUA_YIELD || lua_rawgeti(L, -1, 10) == LUA_TNIL) { /* nothing above */
+    lua_settop(L, top);
+    lua_pushvalue(L, idx);
+  }
+  /* stack: ..., top of the chain; walk down through parents until co */
+  while(1) {
+    lua_State *t = lua_tothread(L, -1);
+    lua_settop(t, 0); /* drop its values */
+    lua_pushvalue(L, -1);
+    if(lua_rawget(L, lua_upvalueindex(1)) == LUA_TNIL) break;
+    lua_pushboolean(L, 1);
+    lua_rawseti(L, -2, 8); /* closed = true */
+    lua_rawgeti(L, -1, 3); /* parent */
+    lua_pushnil(L);
+    lua_rawseti(L, -3, 2);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, 3);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, 4);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, 10);
+    if(t == co || !lua_isthread(L, -1)) break;
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+  }
+  lua_settop(L, top);
+  return 1;
+}
+
+static int taggedcoro_coclose (lua_State *L) {
+  getco(L);
+  if(!taggedcoro_close(L, 1)) {
+    return luaL_error(L, "cannot close a running coroutine");
+  }
+  return 0;
+}
+
+/*
+** pushes the coroutine that a yield with the tag at index tag would reach,
+** or returns 0 without pushing anything if the yield would fail
+*/
+int taggedcoro_pushhandler (lua_State *L, int tag) {
+  int top = lua_gettop(L);
+  tag = lua_absindex(L, tag);
+  if(!lua_isyieldable(L)) {
+    return 0;
+  }
   lua_pushthread(L);
   while(1) { /* loop until parent is untagged or parent = nil or match tag */
+    lua_pushvalue(L, -1);
     if(lua_rawget(L, lua_upvalueindex(1)) == LUA_TNIL) { /* parent is untagged */
-      lua_pushboolean(L, 0);
-      return 1;
+      break;
     }
     lua_rawgeti(L, -1, 1);
-    if(lua_compare(L, 1, -1, LUA_OPEQ)) { /* match tag */
-      lua_pushboolean(L, 1);
+    if(lua_compare(L, tag, -1, LUA_OPEQ)) { /* match tag */
+      lua_pop(L, 2);
+      lua_copy(L, -1, top + 1);
+      lua_settop(L, top + 1);
       return 1;
     }
     lua_pop(L, 1);
     if(lua_rawgeti(L, -1, 3) == LUA_TNIL) { /* parent is nil */
-      lua_pushboolean(L, 0);
-      return 1;
+      break;
     }
     if(!lua_isyieldable(lua_tothread(L, -1))) { /* parent is main tread */
-      lua_pushboolean(L, 0);
-      return 1;
+      break;
     }
   }
+  lua_settop(L, top);
+  return 0;
+}
+
+/* checks if a yield with the tag at index tag would find its coroutine */
+int taggedcoro_canyield (lua_State *L, int tag) {
+  if(taggedcoro_pushhandler(L, tag)) {
+    lua_pop(L, 1);
+    return 1;
+  }
+  return 0;
+}
+
+static int taggedcoro_handler (lua_State *L) {
+  if(lua_isnoneornil(L, 1)) {
+    lua_pushliteral(L, "coroutine");
+    lua_replace(L, 1);
+  }
+  if(!taggedcoro_pushhandler(L, 1)) {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+static int taggedcoro_yieldable (lua_State *L) {
+  if(lua_isnoneornil(L, 1)) {
+    lua_pushliteral(L, "coroutine");
+    lua_replace(L, 1);
+  }
+  lua_pushboolean(L, taggedcoro_canyield(L, 1));
+  return 1;
 }
 
 static int taggedcoro_yieldablec (lua_State *L) {
@@ -417,6 +687,80 @@ static int taggedcoro_cowrapc (lua_State *L) {
   return taggedcoro_cowrap(L);
 }
 
+/*
+** {===============================================================
+** Preemption - a count hook that forces an untagged yield
+** ================================================================
+*/
+
+static const char coroset_key = 'k'; /* coroset in the registry, for the hook */
+
+/* checks if an untagged yield from L would reach an untagged coroutine */
+static int canpreempt (lua_State *L, int coroset) {
+  int top = lua_gettop(L);
+  int found = 0;
+  lua_pushthread(L);
+  while(lua_isyieldable(lua_tothread(L, -1))) {
+    if(lua_rawget(L, coroset) == LUA_TNIL) { /* untagged, the yield stops here */
+      found = 1;
+      break;
+    }
+    if(lua_rawgeti(L, -1, 3) == LUA_TNIL) { /* parent is nil */
+      break;
+    }
+    lua_remove(L, -2);
+  }
+  lua_settop(L, top);
+  return found;
+}
+
+static void preempt (lua_State *L, lua_Debug *ar) {
+  int found;
+  if(ar->event != LUA_HOOKCOUNT || !lua_isyieldable(L)) return;
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &coroset_key);
+  found = canpreempt(L, lua_gettop(L));
+  if(found) {
+    lua_pushthread(L);
+    if(lua_rawget(L, -2) != LUA_TNIL) {
+      lua_rawgeti(L, -1, 6);
+      lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+      lua_rawseti(L, -3, 6); /* coroset[L].preemptions++ */
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  if(found) lua_yield(L, 0);
+}
+
+static int taggedcoro_budget (lua_State *L) {
+  lua_State *co = getco(L);
+  lua_pushvalue(L, 1);
+  if(lua_rawget(L, lua_upvalueindex(1)) == LUA_TNIL) { /* coroset[co] */
+    return luaL_error(L, "cannot budget untagged coroutine");
+  }
+  if(!lua_isnone(L, 2)) {
+    lua_Integer n = lua_toboolean(L, 2) ? luaL_checkinteger(L, 2) : 0;
+    luaL_argcheck(L, n >= 0 && n <= INT_MAX, 2, "budget out of range");
+    if(n > 0) {
+      lua_pushinteger(L, n);
+      lua_sethook(co, preempt, LUA_MASKCOUNT, (int)n);
+    } else {
+      lua_pushnil(L);
+      if(lua_gethook(co) == preempt) lua_sethook(co, NULL, 0, 0);
+    }
+    lua_rawseti(L, -2, 5); /* coroset[co].budget */
+  }
+  lua_rawgeti(L, -1, 5);
+  if(lua_rawgeti(L, -2, 6) == LUA_TNIL) {
+    lua_pop(L, 1);
+    lua_pushinteger(L, 0);
+  }
+  return 2;
+}
+
+/* }====================================================== */
+
 /*
 ** {===============================================================
 ** Traceback - taken with modifications from lauxlib.c and ldblib.c
@@ -664,9 +1008,24 @@ static const luaL_Reg tc_funcs[] = {
   {"tag", taggedcoro_cotag},
   {"install", taggedcoro_install},
   {"traceback", taggedcoro_traceback},
+  {"budget", taggedcoro_budget},
+  {"close", taggedcoro_coclose},
+  {"handler", taggedcoro_handler},
+#ifdef TC_STATS
+  {"stats", taggedcoro_stats},
+#endif
   {NULL, NULL}
 };
 
+static int cancelled_tostring (lua_State *L) {
+  lua_pushliteral(L, "cancelled");
+  return 1;
+}
+
+void taggedcoro_pushcancelled (lua_State *L) {
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &cancelled_key);
+}
+
 LUAMOD_API int luaopen_taggedcoro (lua_State *L) {
   luaL_newlibtable(L, tc_funcs);
   lua_newtable(L); /* extra metadata for each coroutine */
@@ -677,6 +1036,40 @@ LUAMOD_API int luaopen_taggedcoro (lua_State *L) {
   lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
   lua_createtable(L, 4, 0);
   lua_rawset(L, -3);
+  lua_pushvalue(L, -1);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &coroset_key);
+  lua_newtable(L); /* cancelled error */
+  lua_createtable(L, 0, 1);
+  lua_pushcfunction(L, cancelled_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, -1);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &cancelled_key);
+  lua_setfield(L, -3, "cancelled");
+#ifdef TC_STATS
+  lua_newtable(L); /* figures by tag, which go away with their tag */
+  lua_newtable(L);
+  lua_pushliteral(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &stats_key);
+#endif
+  lua_pushvalue(L, -1);
   luaL_setfuncs(L, tc_funcs, 1);
+  taggedcoro_openqueue(L);
+  taggedcoro_openstate(L);
+  taggedcoro_openserialize(L);
+  taggedcoro_openrunq(L);
+  taggedcoro_opennursery(L);
+  taggedcoro_openasync(L);
+  taggedcoro_openchan(L);
+  taggedcoro_opensync(L);
+  taggedcoro_openactor(L);
+  taggedcoro_openmmap(L);
+  taggedcoro_opennlr(L);
+  taggedcoro_openstm(L);
+  taggedcoro_openwal(L);
+  taggedcoro_opensim(L);
+  lua_pop(L, 1); /* coroset */
   return 1;
 }
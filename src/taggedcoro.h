@@ -0,0 +1,170 @@
+#ifndef TAGGEDCORO_H
+#define TAGGEDCORO_H
+
+/*
+** Internal declarations shared by the C files of the taggedcoro module.
+** Every function registered by the module gets the coroutine metadata
+** table (coroset) as its first upvalue, so the helpers below that
+** mention it can be called from any of them.
+*/
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include "compat-5.3.h"
+
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM == 502
+#define lua_isyieldable taggedcoro_isyieldable
+LUA_API int taggedcoro_isyieldable (lua_State *L);
+#endif
+
+/* core (taggedcoro.c) */
+int taggedcoro_yield (lua_State *L);
+int taggedcoro_cocall (lua_State *L);
+int taggedcoro_canyield (lua_State *L, int tag);
+int taggedcoro_pushhandler (lua_State *L, int tag);
+void taggedcoro_newmeta (lua_State *L, int tag);
+int taggedcoro_close (lua_State *L, int idx);
+void taggedcoro_pushcancelled (lua_State *L);
+
+/*
+** Values that can cross from one lua_State to another (value.c)
+*/
+
+#define TC_VNIL     0
+#define TC_VFALSE   1
+#define TC_VTRUE    2
+#define TC_VINT     3
+#define TC_VNUM     4
+#define TC_VSTR     5
+#define TC_VQUEUE   6
+#define TC_VBLOB    7  /* serialized value, decoded when pushed */
+#define TC_VBUFFER  8  /* shared buffer */
+#define TC_VCELL    9  /* shared STM variable */
+
+typedef struct tc_Value {
+  int type;
+  size_t len;
+  union {
+    lua_Integer i;
+    lua_Number n;
+    char *s;
+    void *p;
+  } u;
+} tc_Value;
+
+int taggedcoro_tovalue (lua_State *L, int idx, tc_Value *v);
+void taggedcoro_pushvalue (lua_State *L, tc_Value *v);
+void taggedcoro_freevalue (tc_Value *v);
+
+/* lock-free queues (queue.c) */
+typedef struct tc_Queue tc_Queue;
+
+#define TC_QUEUE "taggedcoro.queue"
+
+void taggedcoro_queueref (tc_Queue *q);
+void taggedcoro_queueunref (tc_Queue *q);
+void taggedcoro_pushqueue (lua_State *L, tc_Queue *q);
+tc_Queue *taggedcoro_toqueue (lua_State *L, int idx);
+
+/* serialization buffers (serialize.c) */
+typedef struct tc_Blob {
+  atomic_int refs;
+  size_t size;
+  size_t cap;
+  char *data;
+  int nobjs;
+  tc_Queue **objs; /* queues referenced by the serialized data */
+  void (*release) (struct tc_Blob *b); /* frees data, if it is not from malloc */
+} tc_Blob;
+
+#define TC_BUFFER "taggedcoro.buffer"
+#define TC_SLICE "taggedcoro.slice"
+
+void taggedcoro_blobref (tc_Blob *b);
+void taggedcoro_blobunref (tc_Blob *b);
+tc_Blob *taggedcoro_encode (lua_State *L, int first, int n);
+int taggedcoro_decode (lua_State *L, int buffer, size_t minslice);
+void taggedcoro_pushbuffer (lua_State *L, tc_Blob *b);
+tc_Blob *taggedcoro_tobuffer (lua_State *L, int idx);
+const char *taggedcoro_toslice (lua_State *L, int idx, size_t *len);
+void taggedcoro_pushslice (lua_State *L, tc_Blob *b, const char *s, size_t len);
+
+/* shared STM variables (stm.c) */
+typedef struct tc_Cell tc_Cell;
+
+void taggedcoro_cellref (tc_Cell *c);
+void taggedcoro_cellunref (tc_Cell *c);
+void taggedcoro_pushcell (lua_State *L, tc_Cell *c);
+tc_Cell *taggedcoro_tocell (lua_State *L, int idx);
+void taggedcoro_wpsignal (void);
+
+/* write-ahead logs (wal.c) */
+typedef struct tc_Wal tc_Wal;
+
+void taggedcoro_walref (tc_Wal *w);
+void taggedcoro_walunref (tc_Wal *w);
+tc_Wal *taggedcoro_towal (lua_State *L, int idx);
+long long taggedcoro_walappend (tc_Wal *w, const char *s, size_t n, long long version);
+int taggedcoro_walsync (lua_State *L, tc_Wal *w, long long ticket, int wait);
+
+/* run queues (runq.c) */
+#define TC_RUNQ "taggedcoro.runq"
+
+void taggedcoro_newrunq (lua_State *L);
+void taggedcoro_runqpush (lua_State *L, int runq, int task, lua_Number key);
+int taggedcoro_runqpop (lua_State *L, int runq);
+int taggedcoro_runqtop (lua_State *L, int runq, lua_Number *key);
+void taggedcoro_pushpriority (lua_State *L, int co);
+
+/*
+** Wait lists (async.c): intrusive doubly linked lists of waiters. A
+** waiter holds a registry reference to the object that owns it while
+** it is in a list; fire is called with that object on top of the
+** stack, and returns non-zero with an error on top if it fails.
+*/
+typedef struct tc_Waiter tc_Waiter;
+
+typedef struct tc_WaitList {
+  tc_Waiter *head;
+  tc_Waiter *tail;
+} tc_WaitList;
+
+struct tc_Waiter {
+  tc_Waiter *next;
+  tc_Waiter *prev;
+  tc_WaitList *list;
+  int (*fire) (lua_State *L, tc_Waiter *w);
+  int ref;
+};
+
+#define TC_ASYNC "async" /* tag of async tasks */
+#define TC_FUTURE "taggedcoro.future"
+
+void taggedcoro_waitadd (lua_State *L, tc_WaitList *l, tc_Waiter *w, int owner);
+void taggedcoro_waitremove (lua_State *L, tc_Waiter *w);
+int taggedcoro_wakeone (lua_State *L, tc_WaitList *l);
+void taggedcoro_wakeall (lua_State *L, tc_WaitList *l);
+tc_Waiter *taggedcoro_block (lua_State *L);
+int taggedcoro_taskclosed (lua_State *L, int task);
+void taggedcoro_newfuture (lua_State *L);
+int taggedcoro_pending (lua_State *L, int future);
+void taggedcoro_complete (lua_State *L, int future, int ok, int n);
+void taggedcoro_spawn (lua_State *L, int runq, int first, int nargs);
+
+/* openers, called with stack: module, coroset */
+void taggedcoro_openqueue (lua_State *L);
+void taggedcoro_openstate (lua_State *L);
+void taggedcoro_openserialize (lua_State *L);
+void taggedcoro_openrunq (lua_State *L);
+void taggedcoro_opennursery (lua_State *L);
+void taggedcoro_openasync (lua_State *L);
+void taggedcoro_openchan (lua_State *L);
+void taggedcoro_opensync (lua_State *L);
+void taggedcoro_openactor (lua_State *L);
+void taggedcoro_openmmap (lua_State *L);
+void taggedcoro_opennlr (lua_State *L);
+void taggedcoro_openstm (lua_State *L);
+void taggedcoro_openwal (lua_State *L);
+void taggedcoro_opensim (lua_State *L);
+
+#endif
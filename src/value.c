@@ -0,0 +1,130 @@
+/*
+** Values that cross lua_State boundaries. A tc_Value owns a private
+** copy of everything it references, so it can be created in one state,
+** handed to another OS thread, and pushed into a different state.
+** Tables and Lua functions travel serialized; queues, buffers and
+** shared STM variables are shared by reference.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "taggedcoro.h"
+
+/*
+** Converts the value at idx into v. Returns 0 if the value has a type
+** that cannot leave its state, leaving v untouched.
+*/
+int taggedcoro_tovalue (lua_State *L, int idx, tc_Value *v) {
+  switch(lua_type(L, idx)) {
+    case LUA_TNONE:
+    case LUA_TNIL:
+      v->type = TC_VNIL;
+      return 1;
+    case LUA_TBOOLEAN:
+      v->type = lua_toboolean(L, idx) ? TC_VTRUE : TC_VFALSE;
+      return 1;
+    case LUA_TNUMBER:
+      if(lua_isinteger(L, idx)) {
+        v->type = TC_VINT;
+        v->u.i = lua_tointeger(L, idx);
+      } else {
+        v->type = TC_VNUM;
+        v->u.n = lua_tonumber(L, idx);
+      }
+      return 1;
+    case LUA_TSTRING: {
+      const char *s = lua_tolstring(L, idx, &v->len);
+      v->u.s = malloc(v->len ? v->len : 1);
+      if(!v->u.s) return luaL_error(L, "not enough memory");
+      memcpy(v->u.s, s, v->len);
+      v->type = TC_VSTR;
+      return 1;
+    }
+    case LUA_TTABLE:
+    case LUA_TFUNCTION: /* serialized, see serialize.c */
+      v->u.p = taggedcoro_encode(L, idx, 1);
+      v->type = TC_VBLOB;
+      return 1;
+    case LUA_TUSERDATA: {
+      tc_Queue *q = taggedcoro_toqueue(L, idx);
+      tc_Cell *c;
+      tc_Blob *b;
+      const char *s;
+      if(q) {
+        taggedcoro_queueref(q);
+        v->type = TC_VQUEUE;
+        v->u.p = q;
+        return 1;
+      }
+      c = taggedcoro_tocell(L, idx);
+      if(c) {
+        taggedcoro_cellref(c);
+        v->type = TC_VCELL;
+        v->u.p = c;
+        return 1;
+      }
+      b = taggedcoro_tobuffer(L, idx);
+      if(b) { /* shared, the receiving state sees the same bytes */
+        taggedcoro_blobref(b);
+        v->type = TC_VBUFFER;
+        v->u.p = b;
+        return 1;
+      }
+      s = taggedcoro_toslice(L, idx, &v->len);
+      if(s) {
+        v->u.s = malloc(v->len ? v->len : 1);
+        if(!v->u.s) return luaL_error(L, "not enough memory");
+        memcpy(v->u.s, s, v->len);
+        v->type = TC_VSTR;
+        return 1;
+      }
+      return 0;
+    }
+    default:
+      return 0;
+  }
+}
+
+/* pushes v and releases what it owns; v becomes nil */
+void taggedcoro_pushvalue (lua_State *L, tc_Value *v) {
+  switch(v->type) {
+    case TC_VNIL: lua_pushnil(L); break;
+    case TC_VFALSE: lua_pushboolean(L, 0); break;
+    case TC_VTRUE: lua_pushboolean(L, 1); break;
+    case TC_VINT: lua_pushinteger(L, v->u.i); break;
+    case TC_VNUM: lua_pushnumber(L, v->u.n); break;
+    case TC_VSTR:
+      lua_pushlstring(L, v->u.s, v->len);
+      free(v->u.s);
+      break;
+    case TC_VQUEUE:
+      taggedcoro_pushqueue(L, v->u.p); /* reference moves to the new userdata */
+      break;
+    case TC_VBUFFER:
+      taggedcoro_pushbuffer(L, v->u.p);
+      break;
+    case TC_VCELL:
+      taggedcoro_pushcell(L, v->u.p);
+      break;
+    case TC_VBLOB: /* the temporary buffer frees the blob even on errors */
+      v->type = TC_VNIL;
+      taggedcoro_pushbuffer(L, v->u.p);
+      taggedcoro_decode(L, -1, (size_t)-1);
+      lua_remove(L, -2);
+      break;
+  }
+  v->type = TC_VNIL;
+}
+
+/* releases a value that will never be pushed */
+void taggedcoro_freevalue (tc_Value *v) {
+  switch(v->type) {
+    case TC_VSTR: free(v->u.s); break;
+    case TC_VQUEUE: taggedcoro_queueunref(v->u.p); break;
+    case TC_VCELL: taggedcoro_cellunref(v->u.p); break;
+    case TC_VBLOB:
+    case TC_VBUFFER: taggedcoro_blobunref(v->u.p); break;
+    default: break;
+  }
+  v->type = TC_VNIL;
+}
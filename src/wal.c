@@ -0,0 +1,400 @@
+/*
+** Write-ahead logs with group commit. A log is a file of records, each
+** with a length, a checksum and a version; appending a record only
+** copies it into the pending batch of the log and returns a ticket, and
+** syncing a ticket makes the first thread that finds no flush running
+** write the whole batch and fdatasync it once for everyone, while the
+** others wait for it. Opening the same path again in any state of the
+** process gives the same log, so commits from several OS threads share
+** batches. Opening a log drops a torn record at its end, left by a
+** crash in the middle of a write, and versions of new records continue
+** from the newest one already in the file.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "taggedcoro.h"
+
+#define TC_WAL "taggedcoro.wal"
+
+#define HEADER 16 /* length (4), checksum (4), version (8) */
+
+typedef long long Ticket;
+
+struct tc_Wal {
+  struct tc_Wal *next; /* in the list of open logs */
+  char *path;
+  int refs; /* guarded by walsmutex */
+  int fd;
+  pthread_mutex_t mutex;
+  pthread_cond_t flushed;
+  char *buf; /* pending batch */
+  size_t len, cap;
+  Ticket appended; /* tickets handed out */
+  Ticket durable; /* tickets on disk */
+  int flushing;
+  int err; /* errno of a failed flush, which fails every later sync */
+  long long base; /* newest version in the file when it was opened */
+};
+
+typedef struct Handle {
+  tc_Wal *w; /* NULL once closed */
+} Handle;
+
+static pthread_mutex_t walsmutex = PTHREAD_MUTEX_INITIALIZER;
+static tc_Wal *wals;
+
+/* FNV-1a, enough to tell a torn record from a complete one */
+static uint32_t checksum (const unsigned char *p, size_t n) {
+  uint32_t h = 2166136261u;
+  while(n--) h = (h ^ *p++) * 16777619u;
+  return h;
+}
+
+static void put32 (unsigned char *p, uint32_t v) {
+  int i;
+  for(i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t get32 (const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put64 (unsigned char *p, uint64_t v) {
+  put32(p, (uint32_t)v);
+  put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t get64 (const unsigned char *p) {
+  return (uint64_t)get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+static int fullread (int fd, void *p, size_t n, off_t off) {
+  while(n > 0) {
+    ssize_t r = pread(fd, p, n, off);
+    if(r < 0 && errno == EINTR) continue;
+    if(r <= 0) return 0;
+    p = (char *)p + r;
+    n -= (size_t)r;
+    off += r;
+  }
+  return 1;
+}
+
+/*
+** reads the record at *off into a malloc'ed buffer, advancing *off;
+** returns NULL at the end of the file or at a torn record
+*/
+static unsigned char *readrecord (int fd, off_t *off, size_t *len, long long *version) {
+  unsigned char h[HEADER], *rec;
+  size_t n;
+  if(!fullread(fd, h, HEADER, *off)) return NULL;
+  n = get32(h);
+  rec = (unsigned char *)malloc(n + 8);
+  if(!rec) return NULL;
+  memcpy(rec, h + 8, 8);
+  if(!fullread(fd, rec + 8, n, *off + HEADER) || checksum(rec, n + 8) != get32(h + 4)) {
+    free(rec);
+    return NULL;
+  }
+  *off += HEADER + (off_t)n;
+  *len = n;
+  *version = (long long)get64(h + 8);
+  return rec;
+}
+
+static int fullwrite (int fd, const char *p, size_t n) {
+  while(n > 0) {
+    ssize_t r = write(fd, p, n);
+    if(r < 0 && errno == EINTR) continue;
+    if(r < 0) return 0;
+    p += r;
+    n -= (size_t)r;
+  }
+  return 1;
+}
+
+static int datasync (int fd) {
+#if defined(__linux__)
+  return fdatasync(fd);
+#else
+  return fsync(fd);
+#endif
+}
+
+/* opens the file, cutting it after the last complete record */
+static tc_Wal *walopen (const char *path) {
+  tc_Wal *w = (tc_Wal *)calloc(1, sizeof(tc_Wal));
+  off_t off = 0;
+  size_t len;
+  long long version;
+  unsigned char *rec;
+  int en;
+  if(!w) return NULL;
+  w->fd = -1;
+  w->path = strdup(path);
+  if(!w->path) goto fail;
+  w->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if(w->fd < 0) goto fail;
+  while((rec = readrecord(w->fd, &off, &len, &version)) != NULL) {
+    if(version > w->base) w->base = version;
+    free(rec);
+  }
+  if(ftruncate(w->fd, off) < 0) goto fail;
+  pthread_mutex_init(&w->mutex, NULL);
+  pthread_cond_init(&w->flushed, NULL);
+  w->refs = 1;
+  return w;
+fail:
+  en = errno;
+  if(w->fd >= 0) close(w->fd);
+  free(w->path);
+  free(w);
+  errno = en;
+  return NULL;
+}
+
+void taggedcoro_walref (tc_Wal *w) {
+  pthread_mutex_lock(&walsmutex);
+  w->refs++;
+  pthread_mutex_unlock(&walsmutex);
+}
+
+/* the last reference flushes the pending batch and closes the file */
+void taggedcoro_walunref (tc_Wal *w) {
+  tc_Wal **p;
+  pthread_mutex_lock(&walsmutex);
+  if(--w->refs > 0) {
+    pthread_mutex_unlock(&walsmutex);
+    return;
+  }
+  for(p = &wals; *p != w; p = &(*p)->next);
+  *p = w->next;
+  pthread_mutex_unlock(&walsmutex);
+  if(w->len > 0 && fullwrite(w->fd, w->buf, w->len)) datasync(w->fd);
+  close(w->fd);
+  pthread_mutex_destroy(&w->mutex);
+  pthread_cond_destroy(&w->flushed);
+  free(w->buf);
+  free(w->path);
+  free(w);
+}
+
+static tc_Wal *checkwal (lua_State *L, int idx) {
+  Handle *h = (Handle *)luaL_checkudata(L, idx, TC_WAL);
+  if(!h->w) luaL_error(L, "attempt to use a closed log");
+  return h->w;
+}
+
+tc_Wal *taggedcoro_towal (lua_State *L, int idx) {
+  return checkwal(L, idx);
+}
+
+/*
+** adds a record with data s to the pending batch of w and returns its
+** ticket, or 0 if there is no memory for it; safe to call without a
+** Lua state, as commits do while they hold their locks
+*/
+Ticket taggedcoro_walappend (tc_Wal *w, const char *s, size_t n, long long version) {
+  size_t need;
+  unsigned char *p;
+  Ticket t;
+  if(n > UINT32_MAX - 8) return 0;
+  pthread_mutex_lock(&w->mutex);
+  need = w->len + HEADER + n;
+  if(need > w->cap) {
+    size_t cap = w->cap ? w->cap : 4096;
+    char *buf;
+    while(cap < need) cap *= 2;
+    if(!(buf = (char *)realloc(w->buf, cap))) {
+      pthread_mutex_unlock(&w->mutex);
+      return 0;
+    }
+    w->buf = buf;
+    w->cap = cap;
+  }
+  p = (unsigned char *)w->buf + w->len;
+  put32(p, (uint32_t)n);
+  put64(p + 8, (uint64_t)(w->base + version));
+  memcpy(p + HEADER, s, n);
+  put32(p + 4, checksum(p + 8, n + 8));
+  w->len = need;
+  t = ++w->appended;
+  pthread_mutex_unlock(&w->mutex);
+  return t;
+}
+
+/*
+** blocks the OS thread until the record with ticket t (every record
+** appended so far, if t is negative) is on disk, and returns 1; if wait
+** is 0 it returns 0 instead of waiting for a flush that another thread
+** leads, and the end of that flush signals the waitpoints of stm.c
+*/
+int taggedcoro_walsync (lua_State *L, tc_Wal *w, Ticket t, int wait) {
+  int err;
+  pthread_mutex_lock(&w->mutex);
+  if(t < 0) t = w->appended;
+  while(w->durable < t && !w->err) {
+    if(w->flushing && !wait) {
+      pthread_mutex_unlock(&w->mutex);
+      return 0;
+    } else if(w->flushing) {
+      pthread_cond_wait(&w->flushed, &w->mutex);
+    } else { /* lead the flush of the whole batch */
+      char *buf = w->buf;
+      size_t len = w->len;
+      Ticket upto = w->appended;
+      int ok;
+      w->buf = NULL;
+      w->len = w->cap = 0;
+      w->flushing = 1;
+      pthread_mutex_unlock(&w->mutex);
+      ok = fullwrite(w->fd, buf, len) && datasync(w->fd) == 0;
+      err = errno;
+      free(buf);
+      pthread_mutex_lock(&w->mutex);
+      w->flushing = 0;
+      if(ok) w->durable = upto;
+      else w->err = err;
+      pthread_cond_broadcast(&w->flushed);
+      taggedcoro_wpsignal();
+    }
+  }
+  err = w->durable < t ? w->err : 0;
+  pthread_mutex_unlock(&w->mutex);
+  if(err) luaL_error(L, "cannot sync %s: %s", w->path, strerror(err));
+  return 1;
+}
+
+/* taggedcoro.wal(path) */
+static int wal_open (lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  Handle *h = (Handle *)lua_newuserdata(L, sizeof(Handle));
+  tc_Wal *w;
+  h->w = NULL;
+  luaL_setmetatable(L, TC_WAL);
+  pthread_mutex_lock(&walsmutex);
+  for(w = wals; w && strcmp(w->path, path) != 0; w = w->next);
+  if(w) {
+    w->refs++;
+  } else if((w = walopen(path)) != NULL) {
+    w->next = wals;
+    wals = w;
+  }
+  pthread_mutex_unlock(&walsmutex);
+  if(!w) return luaL_fileresult(L, 0, path);
+  h->w = w;
+  return 1;
+}
+
+/*
+** wal:append(s[, version]) adds a record to the pending batch and
+** returns its ticket; the version is stored after the newest one the
+** file had when it was opened
+*/
+static int wal_append (lua_State *L) {
+  tc_Wal *w = checkwal(L, 1);
+  size_t n;
+  const char *s = luaL_checklstring(L, 2, &n);
+  lua_Integer version = luaL_optinteger(L, 3, 0);
+  Ticket t;
+  luaL_argcheck(L, n <= UINT32_MAX - 8, 2, "record too large");
+  if(!(t = taggedcoro_walappend(w, s, n, (long long)version)))
+    return luaL_error(L, "not enough memory");
+  lua_pushinteger(L, (lua_Integer)t);
+  return 1;
+}
+
+/*
+** wal:sync([ticket]) blocks the OS thread until the record with the
+** ticket (every record appended so far, by default) is on disk
+*/
+static int wal_sync (lua_State *L) {
+  tc_Wal *w = checkwal(L, 1);
+  taggedcoro_walsync(L, w, (Ticket)luaL_optinteger(L, 2, -1), 1);
+  return 0;
+}
+
+/* wal:durable() returns the newest ticket on disk */
+static int wal_durable (lua_State *L) {
+  tc_Wal *w = checkwal(L, 1);
+  Ticket t;
+  pthread_mutex_lock(&w->mutex);
+  t = w->durable;
+  pthread_mutex_unlock(&w->mutex);
+  lua_pushinteger(L, (lua_Integer)t);
+  return 1;
+}
+
+/* upvalues: log, offset */
+static int records_next (lua_State *L) {
+  tc_Wal *w = checkwal(L, lua_upvalueindex(1));
+  off_t off = (off_t)lua_tointeger(L, lua_upvalueindex(2));
+  size_t len;
+  long long version;
+  unsigned char *rec = readrecord(w->fd, &off, &len, &version);
+  if(!rec) return 0;
+  lua_pushinteger(L, (lua_Integer)off);
+  lua_replace(L, lua_upvalueindex(2));
+  lua_pushlstring(L, (const char *)rec + 8, len);
+  free(rec);
+  lua_pushinteger(L, (lua_Integer)version);
+  return 2;
+}
+
+/* wal:records() iterates over the records on disk and their versions */
+static int wal_records (lua_State *L) {
+  checkwal(L, 1);
+  lua_settop(L, 1);
+  lua_pushinteger(L, 0);
+  lua_pushcclosure(L, records_next, 2);
+  return 1;
+}
+
+/* wal:close() flushes the pending batch when no state has it open */
+static int wal_close (lua_State *L) {
+  Handle *h = (Handle *)luaL_checkudata(L, 1, TC_WAL);
+  if(h->w) {
+    taggedcoro_walunref(h->w);
+    h->w = NULL;
+  }
+  return 0;
+}
+
+static int wal_tostring (lua_State *L) {
+  Handle *h = (Handle *)luaL_checkudata(L, 1, TC_WAL);
+  if(h->w) lua_pushfstring(L, "wal (%s)", h->w->path);
+  else lua_pushliteral(L, "wal (closed)");
+  return 1;
+}
+
+static const luaL_Reg wal_methods[] = {
+  {"append", wal_append},
+  {"sync", wal_sync},
+  {"durable", wal_durable},
+  {"records", wal_records},
+  {"close", wal_close},
+  {NULL, NULL}
+};
+
+void taggedcoro_openwal (lua_State *L) {
+  /* stack: module, coroset */
+  luaL_newmetatable(L, TC_WAL);
+  luaL_newlibtable(L, wal_methods);
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, wal_methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, wal_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushcfunction(L, wal_close);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+  lua_pushcfunction(L, wal_open);
+  lua_setfield(L, -3, "wal");
+}
@@ -0,0 +1,53 @@
+local tc = require "taggedcoro"
+
+do -- selective receive takes the oldest message with the tag
+  local q = tc.runq()
+  local log = {}
+  local a, done = q:actor(function (self, prefix)
+    log[#log + 1] = prefix .. self:receive("b")
+    log[#log + 1] = prefix .. self:receive("a")
+    log[#log + 1] = table.concat({ self:receive() }, ",")
+    local x, y, z = self:receive("c")
+    assert(x == 1 and y == nil and z == 3)
+    return #self
+  end, ">")
+  a:send("a", 1)
+  a:send("a", 2)
+  a:send("b", 3)
+  assert(#a == 3 and a:count("a") == 2 and a:count("c") == 0)
+  q:run()
+  assert(table.concat(log, " ") == ">3 >1 a,2")
+  assert(#a == 0 and done:state() == "pending")
+  a:send("d")
+  q:run()
+  assert(done:state() == "pending") -- still waiting for "c"
+  a:send("c", 1, nil, 3)
+  q:run()
+  assert(done:await() == 1)
+  assert(not pcall(a.receive, a))
+  assert(not pcall(a.send, a))
+end
+
+do -- actors talking to each other, with a large backlog
+  local q = tc.runq()
+  local pong = q:actor(function (self)
+    while true do
+      local from, n = self:receive("ping")
+      if n == 0 then return end
+      from:send("pong", n)
+    end
+  end)
+  local _, res = q:actor(function (self)
+    for i = 1, 1000 do self:send("noise", i) end
+    local sum = 0
+    for i = 1, 100 do
+      pong:send("ping", self, i)
+      sum = sum + self:receive("pong")
+    end
+    pong:send("ping", self, 0)
+    return sum, #self
+  end)
+  q:run()
+  local sum, left = res:await()
+  assert(sum == 5050 and left == 1000)
+end
@@ -0,0 +1,76 @@
+local tc = require "taggedcoro"
+
+do
+  local q = tc.runq()
+  local f = tc.future()
+  assert(f:state() == "pending")
+  local t1 = q:spawn(function () return f:await() + 1 end)
+  local t2 = q:spawn(function (x) return f:await() * x end, 2)
+  q:spawn(function ()
+    tc.yield("async") -- let the others block first
+    f:resolve(10)
+  end)
+  q:run()
+  assert(f:state() == "resolved" and f:await() == 10)
+  assert(t1:state() == "resolved" and t1:await() == 11)
+  assert(t2:await() == 20)
+  assert(not pcall(f.resolve, f, 1))
+end
+
+do
+  local q = tc.runq()
+  local f = tc.future()
+  local t = q:spawn(function () return f:await() end)
+  local bad = q:spawn(function () error("boom") end)
+  q:run()
+  assert(t:state() == "pending" and #q == 0)
+  f:reject("failed")
+  assert(#q == 1)
+  q:run()
+  assert(t:state() == "rejected")
+  local ok, err = pcall(t.await, t)
+  assert(not ok and err == "failed")
+  ok, err = pcall(bad.await, bad)
+  assert(not ok and err:match("boom"))
+  assert(not pcall(tc.future().await, tc.future()))
+end
+
+do
+  local a, b, c = tc.future(), tc.future(), tc.future()
+  local all, any = tc.all(a, b), tc.any(b, c)
+  local log = {}
+  all:callback(function (ok, x, y) log[#log + 1] = tostring(ok) .. x .. y end)
+  b:resolve("B")
+  assert(any:state() == "resolved" and any:await() == "B")
+  assert(all:state() == "pending")
+  a:resolve("A", "ignored")
+  local x, y = all:await()
+  assert(x == "A" and y == "B")
+  assert(log[1] == "trueAB")
+  assert(select("#", tc.all():await()) == 0)
+  local d = tc.future()
+  local alld = tc.all(d, tc.future())
+  d:reject("no")
+  assert(alld:state() == "rejected")
+  local e1, e2 = tc.future(), tc.future()
+  local anye = tc.any(e1, e2)
+  e1:reject("x")
+  assert(anye:state() == "pending")
+  e2:reject("y")
+  assert(anye:state() == "rejected" and not pcall(anye.await, anye))
+  local called
+  a:callback(function (ok, v) called = v end)
+  assert(called == "A")
+end
+
+do -- one resolve wakes every waiter in one batch
+  local q = tc.runq()
+  local f = tc.future()
+  local sum = 0
+  for i = 1, 100 do q:spawn(function () sum = sum + f:await() end) end
+  q:run()
+  f:resolve(1)
+  assert(#q == 100)
+  q:run()
+  assert(sum == 100)
+end
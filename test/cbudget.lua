@@ -0,0 +1,48 @@
+local tc = require "taggedcoro"
+
+local function spin(n)
+  local x = 0
+  for i = 1, n do x = x + i end
+  return x
+end
+
+do -- preempted by the untagged scheduler below
+  local co = tc.create("task", function () return "done", spin(100000) end)
+  assert(tc.budget(co, 1000) == 1000)
+  local sched = coroutine.wrap(function () return tc.resume(co) end)
+  local slices = 0
+  local ok, done, x = sched()
+  while ok == nil do
+    slices = slices + 1
+    assert(tc.status(co) == "stacked" or tc.status(co) == "suspended")
+    ok, done, x = sched()
+  end
+  assert(ok and done == "done" and x == spin(100000))
+  local budget, preemptions = tc.budget(co)
+  assert(budget == 1000 and preemptions == slices and slices > 0)
+end
+
+do -- no untagged coroutine to take the yield, so it runs to completion
+  local co = tc.create("task", function () return spin(100000) end)
+  tc.budget(co, 1000)
+  assert(tc.call(co) == spin(100000))
+  assert(select(2, tc.budget(co)) == 0)
+end
+
+do -- stacked coroutines run with their parent's budget
+  local inner = tc.create("inner", function () return spin(100000) end)
+  local outer = tc.create("outer", function () return tc.call(inner) end)
+  tc.budget(outer, 1000)
+  local sched = coroutine.wrap(function () return tc.call(outer) end)
+  local x = sched()
+  while x == nil do
+    assert(tc.status(outer) == "stacked" and tc.status(inner) == "stacked")
+    x = sched()
+  end
+  assert(x == spin(100000))
+  assert(select(2, tc.budget(inner)) > 0)
+  assert(select(2, tc.budget(outer)) == 0)
+  tc.budget(outer, false)
+  assert(tc.budget(outer) == nil)
+  assert(not pcall(tc.budget, coroutine.create(print), 10))
+end
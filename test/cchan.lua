@@ -0,0 +1,100 @@
+local tc = require "taggedcoro"
+
+do -- a buffered producer only blocks when the buffer is full
+  local q = tc.runq()
+  local ch = tc.chan(4)
+  local sent, got = 0, {}
+  q:spawn(function ()
+    for i = 1, 10 do ch:send(i); sent = i end
+    ch:close()
+  end)
+  q:spawn(function ()
+    assert(sent == 4 and #ch == 4)
+    while true do
+      local v, ok = ch:recv()
+      if not ok then break end
+      got[#got + 1] = v
+    end
+  end)
+  q:run()
+  assert(#got == 10)
+  for i = 1, 10 do assert(got[i] == i) end
+  assert(ch:closed() and select("#", ch:recv()) == 2)
+  assert(not pcall(ch.send, ch, 1))
+  assert(not pcall(ch.close, ch))
+end
+
+do -- unbuffered channels hand values over directly
+  local q = tc.runq()
+  local ch = tc.chan()
+  local log = {}
+  q:spawn(function ()
+    for i = 1, 3 do ch:send(i); log[#log + 1] = "s" .. i end
+  end)
+  q:spawn(function ()
+    for i = 1, 3 do log[#log + 1] = "r" .. ch:recv() end
+  end)
+  q:run()
+  assert(#log == 6 and #ch == 0)
+  assert(not pcall(ch.send, ch, 1)) -- would block outside a task
+  assert(not pcall(ch.recv, ch))
+end
+
+do -- select waits on all its cases and commits to one
+  local q = tc.runq()
+  local a, b, out = tc.chan(), tc.chan(), tc.chan(1)
+  local res = {}
+  q:spawn(function ()
+    for n = 1, 3 do
+      local i, v, ok = tc.select(n == 1 and { a, b, { out, "x" } } or { a, b })
+      res[#res + 1] = i .. ":" .. tostring(v) .. ":" .. tostring(ok)
+    end
+  end)
+  q:spawn(function ()
+    assert(out:recv() == "x")
+    b:send("B")
+    a:close()
+  end)
+  q:run()
+  assert(res[1] == "3:nil:nil")
+  assert(res[2] == "2:B:true")
+  assert(res[3] == "1:nil:false")
+  assert(#a == 0 and #b == 0)
+  assert(tc.select({ b }, true) == nil)
+  assert(tc.select({ a }, true) == 1)
+  assert(not pcall(tc.select, {}))
+  assert(not pcall(tc.select, { {} }))
+end
+
+do -- fan-in from many producers
+  local q = tc.runq()
+  local ch = tc.chan(2)
+  local sum = 0
+  for p = 1, 10 do
+    q:spawn(function ()
+      for i = 1, 10 do ch:send(p * i) end
+    end)
+  end
+  q:spawn(function ()
+    for _ = 1, 100 do sum = sum + ch:recv() end
+  end)
+  q:run()
+  assert(sum == 55 * 55)
+end
+
+do -- a receiver whose task was closed does not take the value
+  local q = tc.runq()
+  local ch = tc.chan()
+  local closed, got
+  q:spawn(function ()
+    closed = tc.running()
+    ch:recv()
+    got = "closed"
+  end)
+  q:run()
+  tc.close(closed)
+  q:spawn(function () got = ch:recv() end)
+  q:spawn(function () ch:send("v") end)
+  q:run()
+  assert(got == "v" and #ch == 0)
+end
@@ -0,0 +1,83 @@
+local tc = require "taggedcoro"
+local ex = require "taggedcoro.exception"
+
+local A = ex.class("A")
+local B = ex.class("B")
+local SubA = ex.class("SubA", A)
+
+do -- a throw goes past a trycatch without a handler for its class
+  local log = {}
+  local r = ex.trycatch(function ()
+    return ex.trycatch(function ()
+      ex.throw(setmetatable({ msg = "a" }, A))
+      return "not reached"
+    end, { [B] = function () log[#log + 1] = "B" end })
+  end, { [A] = function (resume, traceback, e) return "A " .. e.msg end })
+  assert(r == "A a" and #log == 0)
+  r = ex.trycatch(function ()
+    return ex.trycatch(function () ex.throw(A) end,
+                       function () log[#log + 1] = "untyped" end)
+  end, { [A] = function (resume, traceback, e) return e end })
+  assert(r == A and #log == 0)
+  r = ex.trycatch(function ()
+    return ex.trycatch(function () ex.throw("plain") end,
+                       { [A] = function () log[#log + 1] = "A" end })
+  end, function (resume, traceback, e) return e end)
+  assert(r == "plain" and #log == 0)
+end
+
+do -- a subclass goes to the handler of its nearest class
+  local r = ex.trycatch(function () ex.throw(SubA, 1) end,
+                        { [A] = function (resume, traceback, e, n) return e, n end })
+  assert(r == SubA)
+  local e = setmetatable({}, SubA)
+  local a, b = ex.trycatch(function () ex.throw(e) end, {
+    [A] = function () return "A" end,
+    [SubA] = function (resume, traceback, x) return "SubA", x end,
+  })
+  assert(a == "SubA" and b == e)
+  a = ex.trycatch(function () ex.throw(e) end, {
+    [B] = function () error("wrong handler") end,
+    [A] = function () return "A" end,
+  })
+  assert(a == "A")
+end
+
+do -- throws nobody handles and errors go through as errors
+  local ok = pcall(ex.trycatch, function () ex.throw(B) end,
+                   { [A] = function () return "A" end })
+  assert(not ok)
+  local err
+  ok, err = pcall(ex.trycatch, function () error("boom", 0) end,
+                  { [A] = function () return "A" end })
+  assert(not ok and err == "boom")
+  ok, err = pcall(ex.trycatch, function ()
+    return ex.trycatch(function () error("inner", 0) end,
+                       { [B] = function () return "B" end })
+  end, { [A] = function () return "A" end })
+  assert(not ok and err == "inner")
+end
+
+do -- typed handlers can resume the throw, as untyped ones can
+  local tries = 0
+  local r = ex.trycatch(function ()
+    local v = ex.throw(A, 1)
+    while v < 3 do
+      v = ex.throw(SubA, v)
+    end
+    return "done " .. v
+  end, { [A] = function (resume, traceback, e, n)
+    tries = tries + 1
+    assert(type(traceback("at")) == "string")
+    return resume(n + 1)
+  end })
+  assert(r == "done 3" and tries == 2)
+  r = ex.trycatch(function ()
+    return ex.trycatch(function () return "got " .. ex.throw(B) end,
+                       function () return "untyped" end)
+  end, { [B] = function (resume) return resume("B") end })
+  assert(r == "got B")
+  r = ex.trycatch(function () return ex.throw("again") .. "!" end,
+                  function (resume, traceback, e) return resume(e) end)
+  assert(r == "again!")
+end
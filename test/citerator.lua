@@ -0,0 +1,57 @@
+local iterator = require "taggedcoro.iterator"
+
+local produce = iterator.produce
+
+local function pack(...)
+  return { n = select("#", ...), ... }
+end
+
+-- what successive calls of the iterator return, up to its first error
+local function trace(it, arg)
+  local log = {}
+  for i = 1, 20 do
+    local r = pack(pcall(it, i == 1 and arg or nil))
+    local t = {}
+    for k = 1, r.n do t[k] = tostring(r[k]) end
+    log[#log + 1] = r.n .. ":" .. table.concat(t, ",")
+    if not r[1] then break end
+  end
+  return table.concat(log, "|")
+end
+
+local function values(a)
+  for i = 1, 5 do produce(i, i * a) end
+  produce()
+  produce(nil, "x")
+  return "done", a
+end
+
+local function failing()
+  for i = 1, 4 do produce(i) end
+  error("boom", 0)
+end
+
+do -- batches give the same items, results and errors as single items
+  for _, f in ipairs({ values, failing }) do
+    local expected = trace(iterator.make(f), 2)
+    for _, n in ipairs({ 2, 3, 7, 8, 100 }) do
+      assert(trace(iterator.make(f, n), 2) == expected)
+    end
+  end
+end
+
+do -- the producer runs ahead to fill a batch, and produce returns nothing
+  local produced, results = 0, {}
+  local it = iterator.make(function ()
+    for i = 1, 10 do
+      results[i] = select("#", produce(i))
+      produced = produced + 1
+    end
+  end, 3)
+  assert(it() == 1 and produced == 3)
+  assert(it() == 2 and it() == 3 and produced == 3)
+  assert(it() == 4 and produced == 6)
+  while it() do end
+  assert(produced == 10)
+  for i = 1, 10 do assert(results[i] == 0) end
+end
@@ -0,0 +1,44 @@
+local tc = require "taggedcoro"
+
+local name = os.tmpname()
+local f = assert(io.open(name, "wb"))
+f:write("alpha\nbeta\n\ngamma")
+f:close()
+
+do
+  local m = assert(tc.mmap(name))
+  assert(#m == 17)
+  local t = {}
+  for r in m:records() do t[#t + 1] = tostring(r) end
+  assert(table.concat(t, "|") == "alpha|beta||gamma")
+  local it = m:records("\n", true)
+  assert(it() == "alpha" and type(it()) == "string")
+  t = {}
+  for r in m:records("ta") do t[#t + 1] = tostring(r) end
+  assert(#t == 2 and t[1] == "alpha\nbe" and t[2] == "\n\ngamma")
+  local first = m:records()()
+  assert(#first == 5 and first:sub(2, 3) == "lp" and first == m:sub(1, 5))
+  assert(tostring(m:sub(-5)) == "gamma")
+  m:close()
+  assert(tostring(first) == "alpha") -- slices keep the mapping alive
+  assert(not pcall(m.records, m))
+end
+
+f = assert(io.open(name, "wb"))
+f:write("one\n")
+f:close()
+do
+  local n = 0
+  for r in tc.mmap(name):records() do n = n + 1; assert(r == "one" or tostring(r) == "one") end
+  assert(n == 1)
+end
+
+f = assert(io.open(name, "wb"))
+f:close()
+do
+  local m = tc.mmap(name)
+  assert(#m == 0 and m:records()() == nil)
+end
+
+os.remove(name)
+assert(tc.mmap(name) == nil)
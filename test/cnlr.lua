@@ -0,0 +1,93 @@
+local tc = require "taggedcoro"
+
+do -- early and normal returns, with any number of values
+  assert(tc.nlrrun(function () tc.nlrret(1, nil, 3); error("unreachable") end) == 1)
+  assert(select("#", tc.nlrrun(function () tc.nlrret(1, nil, 3) end)) == 3)
+  assert(select("#", tc.nlrrun(function () tc.nlrret() end)) == 0)
+  local a, b = tc.nlrrun(function (x, y) return y, x end, "x", "y")
+  assert(a == "y" and b == "x")
+end
+
+do -- the innermost run catches the return
+  local r = tc.nlrrun(function ()
+    local inner = tc.nlrrun(function () tc.nlrret("inner") end)
+    assert(inner == "inner")
+    tc.nlrret("outer")
+  end)
+  assert(r == "outer")
+end
+
+do -- other errors go through unchanged
+  local e = {}
+  local ok, err = pcall(tc.nlrrun, function () error(e) end)
+  assert(not ok and err == e)
+  ok, err = pcall(tc.nlrret, 1)
+  assert(not ok and tostring(err) == "non-local return outside of nlr.run")
+end
+
+do -- other tags yield through the run, which needs no coroutine of its own
+  local co = tc.wrap("gen", function ()
+    return tc.nlrrun(function ()
+      for i = 1, 3 do
+        if tc.yield("gen", i) == "stop" then tc.nlrret("stopped", i) end
+      end
+      return "done"
+    end)
+  end)
+  assert(co() == 1 and co() == 2)
+  local r, i = co("stop")
+  assert(r == "stopped" and i == 2)
+end
+
+do -- returns go through trycatch, which still catches throws in a run
+  local ex = require "taggedcoro.exception"
+  local nlr = require "taggedcoro.nlr"
+  local ok, e = pcall(tc.nlrret, 1)
+  assert(not ok and tc.isnlr(e) and not tc.isnlr({}) and not tc.isnlr())
+  local r = nlr.run(function ()
+    ex.trycatch(function () nlr.ret("early", 2) end,
+                function () error("handler called") end)
+    return "late"
+  end)
+  assert(r == "early")
+  local C = ex.class("C")
+  local a, b = nlr.run(function ()
+    ex.trycatch(function () nlr.ret("typed", 2) end,
+                { [C] = function () error("handler called") end })
+  end)
+  assert(a == "typed" and b == 2)
+  r = nlr.run(function ()
+    return ex.trycatch(function () ex.throw("thrown") end,
+                       function (resume, traceback, e) return e end)
+  end)
+  assert(r == "thrown")
+  local gen = tc.wrap("gen", function ()
+    nlr.run(function () tc.yield("gen", 1); nlr.ret() end)
+    return "after"
+  end)
+  assert(gen() == 1 and gen() == "after")
+end
+
+do -- nlr.run returns through pcalls and coroutines as a yield, as before
+  local nlr = require "taggedcoro.nlr"
+  assert(nlr.run(function () pcall(nlr.ret, 1); return 2 end) == 1)
+  assert(nlr.run(function ()
+    pcall(function () nlr.ret("through") end)
+    return "caught"
+  end) == "through")
+  local inner
+  local r = nlr.run(function ()
+    inner = tc.create("other", function () nlr.ret("out"); return "resumed" end)
+    tc.resume(inner)
+    return "late"
+  end)
+  assert(r == "out" and tc.status(inner) ~= "dead")
+  local ok, e = pcall(nlr.run, function () error("boom", 0) end)
+  assert(not ok and e == "boom")
+  local a, b = nlr.run(function (x, y) nlr.ret(y, x) end, 1, 2)
+  assert(a == 2 and b == 1)
+  assert(select("#", nlr.run(function () nlr.ret(nil, nil) end)) == 2)
+  assert(nlr.run(function ()
+    return nlr.run(function () nlr.ret("inner") end) .. "+outer"
+  end) == "inner+outer")
+end
@@ -0,0 +1,75 @@
+local tc = require "taggedcoro"
+
+do -- children run round-robin, and the nursery returns the results of the body
+  local log = {}
+  local function worker(name, n)
+    for i = 1, n do
+      log[#log + 1] = name .. i
+      tc.yield("nursery")
+    end
+  end
+  local a, b = tc.nursery(function (n)
+    n:spawn(worker, "a", 2)
+    n:spawn(worker, "b", 3)
+    return "body", #n
+  end)
+  assert(a == "body" and b == 3)
+  assert(table.concat(log, " ") == "a1 b1 a2 b2 b3")
+end
+
+do -- an error in a child cancels the others and propagates
+  local other
+  local ok, err = pcall(tc.nursery, function (n)
+    other = n:spawn(function () while true do tc.yield("nursery") end end)
+    n:spawn(function () tc.yield("nursery"); error("boom") end)
+  end)
+  assert(not ok and err:match("boom"))
+  assert(tc.status(other) == "dead")
+end
+
+do -- cancel from inside
+  local children = {}
+  local r, err = tc.nursery(function (n)
+    for i = 1, 3 do
+      children[i] = n:spawn(function () while true do tc.yield("nursery") end end)
+    end
+    n:spawn(function () tc.yield("nursery"); n:cancel(); error("unreachable") end)
+  end)
+  assert(r == nil and err == tc.cancelled and tostring(err) == "cancelled")
+  for i = 1, 3 do assert(tc.status(children[i]) == "dead") end
+  assert(not pcall(tc.resume, children[1]))
+end
+
+do -- cancel from outside, with the subtree stacked under another tag
+  local n, child, inner
+  local outer = tc.create("outer", function ()
+    return tc.nursery(function (nn)
+      n = nn
+      child = n:spawn(function ()
+        tc.nursery(function (m)
+          inner = m:spawn(function () while true do tc.yield("nursery") end end)
+          tc.yield("outer", "waiting")
+        end)
+      end)
+    end)
+  end)
+  local ok, v = tc.resume(outer)
+  assert(ok and v == "waiting")
+  assert(tc.status(child) == "stacked")
+  n:cancel()
+  assert(n:cancelled())
+  assert(tc.status(child) == "dead" and tc.status(inner) == "dead")
+  local ok, r, err = tc.resume(outer)
+  assert(ok and r == nil and err == tc.cancelled)
+  assert(tc.status(outer) == "dead")
+  assert(not pcall(n.spawn, n, print))
+end
+
+do -- close
+  local co = tc.create("t", function () tc.yield("t", 1); return 2 end)
+  assert(select(2, tc.resume(co)) == 1)
+  tc.close(co)
+  assert(tc.status(co) == "dead")
+  assert(not pcall(tc.call, co))
+  assert(not pcall(tc.close, tc.running()))
+end
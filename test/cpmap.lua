@@ -0,0 +1,44 @@
+local stream = require "taggedcoro.stream"
+
+local function same(t, ...)
+  local n = select("#", ...)
+  assert(#t == n, "expected " .. n .. " items, got " .. #t)
+  for i = 1, n do
+    assert(t[i] == select(i, ...), "mismatch at item " .. i)
+  end
+end
+
+do -- pmap keeps the order of its input
+  local s = stream.range(1, 50):pmap(function (x) return x * x end,
+                                     { workers = 3, window = 5 })
+  local t = s:collect()
+  assert(#t == 50)
+  for i = 1, 50 do assert(t[i] == i * i) end
+  same(stream.pmap(stream.values({}), function (x) return x end):collect())
+end
+
+do -- an error in pmap comes out after the items before it
+  local s = stream.range(1, 20):pmap(function (x)
+    if x == 7 then error("bad item", 0) end
+    return x
+  end, { workers = 4 })
+  local got = {}
+  local ok, err = pcall(s.each, s, function (v) got[#got + 1] = v end)
+  assert(not ok and err == "bad item")
+  same(got, 1, 2, 3, 4, 5, 6)
+end
+
+do -- dropping a pmap stream midway stops pulling and shuts the workers down
+  local pulled = 0
+  local it = stream.range(1, 1e9):map(function (x) pulled = pulled + 1; return x end)
+                                 :pmap(function (x) return x end, { workers = 2, window = 4 })
+                                 :iter()
+  assert(it() == 1 and it() == 2)
+  it = nil
+  collectgarbage()
+  collectgarbage()
+  local before = pulled
+  assert(before < stream.batch + 8)
+  same(stream.range(1, 3):pmap(function (x) return -x end, { workers = 2 }):collect(), -1, -2, -3)
+  assert(pulled == before)
+end
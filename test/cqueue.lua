@@ -0,0 +1,117 @@
+local tc = require "taggedcoro"
+
+do
+  local q = tc.queue(3, "spsc")
+  local cap, kind = q:capacity()
+  assert(cap == 4 and kind == "spsc")
+  assert(#q == 0)
+  assert(q:trypop() == false)
+  for i = 1, 4 do assert(q:trypush(i)) end
+  assert(q:trypush(5) == false)
+  assert(#q == 4)
+  for i = 1, 4 do
+    local ok, v = q:trypop()
+    assert(ok and v == i)
+  end
+  assert(q:trypop() == false)
+end
+
+do
+  local q = tc.queue()
+  local cap, kind = q:capacity()
+  assert(cap == 1024 and kind == "mpmc")
+  q:push(nil)
+  q:push(false)
+  q:push(true)
+  q:push(1.5)
+  q:push(123456789)
+  q:push("hello\0world")
+  q:push(q)
+  assert(select(2, q:trypop()) == nil)
+  assert(q:pop() == false)
+  assert(q:pop() == true)
+  assert(q:pop() == 1.5)
+  assert(q:pop() == 123456789)
+  assert(q:pop() == "hello\0world")
+  local q2 = q:pop()
+  assert(tostring(q2) == tostring(q))
+  assert(q2:trypush("shared"))
+  assert(q:pop() == "shared")
+  assert(not pcall(q.push, q, coroutine.create(print)))
+  assert(not pcall(q.trypush, q, print))
+  assert(#q == 0)
+end
+
+do
+  local q = tc.queue(2)
+  local rfd = q:fd()
+  local co = tc.create("queue", function ()
+    return "done", q:pop()
+  end)
+  local ok, yq, fd = tc.resume(co)
+  assert(ok and yq == q and fd == rfd)
+  assert(tc.status(co) == "suspended")
+  q:push("hello")
+  local ok, done, v = tc.resume(co)
+  assert(ok and done == "done" and v == "hello")
+  assert(tc.status(co) == "dead")
+end
+
+do
+  local q = tc.queue(1)
+  q:push(1)
+  local co = tc.wrap("other", function ()
+    q:push(2, "other")
+    return "pushed"
+  end)
+  local yq = co()
+  assert(yq == q)
+  assert(q:pop() == 1)
+  assert(co() == "pushed")
+  assert(q:pop() == 2)
+end
+
+do
+  local st = tc.newstate("return 1 + ..., 'two', true", 41)
+  local a, b, c = st:join()
+  assert(a == 42 and b == "two" and c == true)
+  assert(not pcall(st.join, st))
+  local st = tc.newstate("error('boom')")
+  local ok, err = pcall(st.join, st)
+  assert(not ok and err:match("boom"))
+  local st = tc.newstate("return coroutine.running()")
+  local ok, err = pcall(st.join, st)
+  assert(not ok and err:match("cannot move result"))
+  assert(not pcall(tc.newstate, "return", coroutine.create(print)))
+end
+
+do -- collecting a state that is still running does not wait for it
+  local q = tc.queue(1)
+  local st = tc.newstate("local q = ... q:pop()", q)
+  st = nil
+  collectgarbage()
+  collectgarbage()
+  q:push(true)
+end
+
+do
+  assert(not pcall(tc.queue, 0))
+  assert(not pcall(tc.queue, 2^60))
+end
+
+do
+  local q = tc.queue(16)
+  local st = tc.newstate(function (q, n)
+    for i = 1, n do q:push(i) end
+    q:push(false)
+    return "sent"
+  end, q, 1000)
+  local sum = 0
+  while true do
+    local v = q:pop()
+    if not v then break end
+    sum = sum + v
+  end
+  assert(st:join() == "sent")
+  assert(sum == 500500)
+end
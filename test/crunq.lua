@@ -0,0 +1,50 @@
+local tc = require "taggedcoro"
+
+do
+  local q = tc.runq()
+  assert(#q == 0 and q:pop() == nil and q:peek() == nil)
+  for i, k in ipairs{ 5, 1, 4, 1, 3, 9, 2, 6 } do
+    q:push("t" .. i, k)
+  end
+  assert(#q == 8)
+  local t, k = q:peek()
+  assert(t == "t2" and k == 1)
+  local order = {}
+  while #q > 0 do
+    local t, k = q:pop()
+    order[#order + 1] = string.format("%s:%d", t, k)
+  end
+  assert(table.concat(order, " ") == "t2:1 t4:1 t7:2 t5:3 t3:4 t1:5 t8:6 t6:9")
+end
+
+do
+  local q = tc.runq()
+  for i = 1, 1000 do q:push(i, (i * 7919) % 101) end
+  local last, lastseq = -1, 0
+  for _ = 1, 1000 do
+    local i, k = q:pop()
+    assert(k > last or (k == last and i > lastseq))
+    last, lastseq = k, i
+  end
+  assert(#q == 0)
+end
+
+do
+  local hi = tc.create("task", function () return "hi" end, -10)
+  local lo = tc.create("task", function () return "lo" end)
+  assert(tc.priority(hi) == -10 and tc.priority(lo) == 0)
+  local child
+  local parent = tc.create("task", function ()
+    child = tc.create("task", function () return tc.priority(child) end)
+    return tc.call(child)
+  end, 3)
+  assert(tc.call(parent) == 3) -- inherited through parent
+  tc.priority(child, 7)
+  assert(tc.priority(child) == 7)
+  local q = tc.runq()
+  q:push(lo)
+  q:push(hi)
+  assert(tc.call(q:pop()) == "hi")
+  assert(tc.call(q:pop()) == "lo")
+  assert(not pcall(tc.priority, coroutine.create(print), 1))
+end
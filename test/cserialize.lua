@@ -0,0 +1,74 @@
+local tc = require "taggedcoro"
+
+do
+  local s = tc.encode(nil, false, true, 0, -1, 123456789, -123456789, 1.5, "hello\0world")
+  assert(type(s) == "string")
+  local a, b, c, d, e, f, g, h, i = tc.decode(s)
+  assert(a == nil and b == false and c == true)
+  assert(d == 0 and e == -1 and f == 123456789 and g == -123456789)
+  assert(h == 1.5 and i == "hello\0world")
+  assert(select("#", tc.decode(tc.encode())) == 0)
+  assert(select("#", tc.decode(tc.encode(nil, nil))) == 2)
+end
+
+do
+  local shared = { x = 1 }
+  local t = { 10, 20, 30, a = shared, b = shared, [true] = "yes" }
+  t.self = t
+  local u = tc.decode(tc.encode(t))
+  assert(u[1] == 10 and u[2] == 20 and u[3] == 30 and #u == 3)
+  assert(u.a.x == 1 and u.a == u.b and u.self == u and u[true] == "yes")
+end
+
+do
+  local n = 2
+  local function add(x) return x + n end
+  local f = tc.decode(tc.encode(add))
+  assert(f(40) == 42)
+  local g = tc.decode(tc.encode(function (x) return tostring(x) end))
+  assert(g(1) == "1")
+  assert(not pcall(tc.encode, print))
+  assert(not pcall(tc.encode, coroutine.create(print)))
+  assert(not pcall(tc.encode, tc.queue()))
+  assert(not pcall(tc.decode, "\1\6\1"))
+  assert(not pcall(tc.decode, "\1\8\200"))
+end
+
+do
+  local buf = tc.buffer()
+  assert(buf:encode(1, "two", { 3 }) == buf)
+  local a, b, c = buf:decode()
+  assert(a == 1 and b == "two" and c[1] == 3)
+  assert(#buf == #buf:bytes())
+  assert(buf:bytes() == tc.encode(1, "two", { 3 }))
+  buf:encode(string.rep("x", 100), "short")
+  local s, short = buf:decode(50)
+  assert(type(s) == "userdata" and type(short) == "string")
+  assert(#s == 100 and tostring(s) == string.rep("x", 100))
+  assert(tostring(s) == tc.decode(tc.encode(s)))
+  assert(s:sub(1, 3) == "xxx" and s:byte(-1) == 120)
+  assert(s .. "!" == string.rep("x", 100) .. "!")
+  buf:encode("other") -- s keeps the old memory
+  assert(tostring(s) == string.rep("x", 100))
+  assert(type(buf:decode(true)) == "userdata")
+end
+
+do
+  local q = tc.queue()
+  local buf = tc.buffer()
+  buf:encode({ q = q, n = 42 })
+  local t = buf:decode()
+  assert(tostring(t.q) == tostring(q) and t.n == 42)
+  q:push({ 1, { 2 } })
+  local v = q:pop()
+  assert(v[1] == 1 and v[2][1] == 2)
+  q:push(buf)
+  local b2 = q:pop()
+  assert(b2:bytes() == buf:bytes())
+  local st = tc.newstate(function (q, t)
+    q:push(t.n + 1)
+    return t.f(t.n)
+  end, q, { n = 1, f = function (x) return x * 10 end })
+  assert(st:join() == 10)
+  assert(q:pop() == 2)
+end
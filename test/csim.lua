@@ -0,0 +1,42 @@
+local tc = require "taggedcoro"
+
+do -- the clock jumps to the next timer once every task is blocked
+  local sim, log = tc.simulation(), {}
+  local function note(name) log[#log + 1] = name .. string.format("%g", sim:now()) end
+  sim:spawn(function () sim:sleep(10); note("a") end)
+  sim:spawn(function ()
+    sim:sleep(5); note("b")
+    sim:sleep(10); note("b")
+  end)
+  sim:run()
+  assert(table.concat(log, " ") == "b5 a10 b15" and sim:now() == 15)
+end
+
+do -- futures for timers, and timeouts
+  local sim, res = tc.simulation(), {}
+  local slow = sim:after(100)
+  sim:spawn(function ()
+    local ok, err = pcall(function () return sim:timeout(slow, 10):await() end)
+    res[1] = ok == false and err == "timeout" and sim:now() == 10
+    res[2] = sim:timeout(sim:after(1), 10):await() == 11
+  end)
+  local f = sim:spawn(function () return slow:await() end)
+  sim:run()
+  assert(res[1] and res[2] and f:await() == 100 and sim:now() == 100)
+  assert(not pcall(sim.sleep, sim, 1)) -- outside of a task
+end
+
+do -- timers due together fire in the order they were set, or from the seed
+  local function order(seed)
+    local sim, log = tc.simulation(seed), {}
+    for i = 1, 20 do
+      sim:spawn(function () sim:sleep(1); log[#log + 1] = i end)
+    end
+    sim:run()
+    return table.concat(log, ",")
+  end
+  local fifo = {}
+  for i = 1, 20 do fifo[i] = i end
+  assert(order() == table.concat(fifo, ","))
+  assert(order(7) == order(7) and order(7) ~= order() and order(7) ~= order(8))
+end
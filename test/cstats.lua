@@ -0,0 +1,47 @@
+local tc = require "taggedcoro"
+
+if not tc.stats then return end -- built without TC_STATS
+
+local function spin(n)
+  local x = 0
+  for i = 1, n do x = x + i end
+  return x
+end
+
+do -- resumes and yields per coroutine and per tag, CPU time without nested ones
+  local before = tc.stats()["statsouter"]
+  assert(before == nil)
+  local inner = tc.create("statsinner", function ()
+    for _ = 1, 3 do
+      spin(1e6)
+      tc.yield("statsinner")
+    end
+  end)
+  local outer = tc.create("statsouter", function ()
+    while tc.status(inner) ~= "dead" do
+      tc.resume(inner)
+    end
+    tc.yield("statsouter")
+  end)
+  assert(tc.stats(outer).resumes == 0)
+  tc.resume(outer)
+  tc.resume(outer)
+  local so, si = tc.stats(outer), tc.stats(inner)
+  assert(so.resumes == 2 and so.yields == 1)
+  assert(si.resumes == 4 and si.yields == 3)
+  assert(si.cpu > 0 and so.cpu >= 0 and so.cpu < si.cpu)
+  local tags = tc.stats()
+  assert(tags.statsinner.resumes == 4 and tags.statsouter.yields == 1)
+  assert(not pcall(tc.stats, coroutine.create(print)))
+end
+
+do -- the figures of a tag do not keep it alive
+  local tag = {}
+  tc.wrap(tag, function () tc.yield(tag) end)()
+  assert(tc.stats()[tag].resumes == 1)
+  local weak = setmetatable({ tag }, { __mode = "v" })
+  tag = nil
+  collectgarbage()
+  collectgarbage()
+  assert(weak[1] == nil)
+end
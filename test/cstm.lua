@@ -0,0 +1,388 @@
+local tc = require "taggedcoro"
+
+do -- reads see the writes of the same log, commits install them
+  local a, b = tc.tvar(1), tc.tvar("b")
+  local tx = tc.stmtx()
+  local ok, v = tx:read(a)
+  assert(ok and v == 1)
+  tx:write(a, 2)
+  tx:write(b, nil)
+  ok, v = tx:read(a)
+  assert(ok and v == 2)
+  assert(a:get() == 1)
+  assert(tx:commit() == true)
+  assert(a:get() == 2 and b:get() == nil and a:version() == b:version())
+  assert(not pcall(tx.read, tx, a))
+end
+
+do -- a read of a variable newer than the log fails
+  local a = tc.tvar(0)
+  local t1, t2 = tc.stmtx(), tc.stmtx()
+  t2:write(a, 1)
+  assert(t2:commit())
+  local ok = t1:read(a)
+  assert(ok == false and t1:conflict() == a)
+end
+
+do -- commit validates the reads, and read-only logs commit anyway
+  local a, b = tc.tvar(0), tc.tvar(0)
+  local t1, t2, t3 = tc.stmtx(), tc.stmtx(), tc.stmtx()
+  assert(t1:read(a) and t3:read(a))
+  t1:write(b, 1)
+  t2:write(a, 1)
+  assert(t2:commit())
+  assert(not t3:validate() and t3:commit())
+  assert(t1:commit() == false and t1:conflict() == a and b:get() == 0)
+end
+
+do -- commits return the variables that logs watch
+  local a, b = tc.tvar(0), tc.tvar(0)
+  local waiter = tc.stmtx()
+  assert(waiter:read(a))
+  local vars = waiter:watch()
+  assert(#vars == 1 and vars[1] == a)
+  local tx = tc.stmtx()
+  tx:write(a, 1)
+  tx:write(b, 1)
+  local ok, woken, more = tx:commit()
+  assert(ok and woken == a and more == nil)
+  waiter:unwatch()
+  tx = tc.stmtx()
+  tx:write(a, 2)
+  assert(select("#", tx:commit()) == 1)
+end
+
+do -- many writes go through the index
+  local vars, tx = {}, tc.stmtx()
+  for i = 1, 100 do vars[i] = tc.tvar(i) end
+  for i = 1, 100 do tx:write(vars[i], -i) end
+  for i = 1, 100 do local _, v = tx:read(vars[i]); assert(v == -i) end
+  assert(tx:commit() and vars[50]:get() == -50)
+end
+
+do -- shared variables hold copies, and cross states by reference
+  local t = { 1, 2 }
+  local a = tc.tvar(t, "shared")
+  assert(a:get() ~= t and a:get()[2] == 2)
+  local tx = tc.stmtx()
+  local ok, v = tx:read(a)
+  assert(ok and v[1] == 1 and tx:shared() == 1)
+  tx:write(a, { 3 })
+  assert(select(2, tx:read(a))[1] == 3)
+  assert(tx:commit() and a:get()[1] == 3)
+  assert(not pcall(tc.stmtx().write, tc.stmtx(), a, coroutine.create(print)))
+  local st = tc.newstate([[
+    local tc = require "taggedcoro"
+    local a = ...
+    for _ = 1, 1000 do
+      local tx
+      repeat
+        tx = tc.stmtx()
+        local ok, v = tx:read(a)
+        if ok then tx:write(a, { v[1] + 1 }) end
+      until ok and tx:commit()
+    end
+  ]], a)
+  for _ = 1, 1000 do
+    local tx
+    repeat
+      tx = tc.stmtx()
+      local ok, v = tx:read(a)
+      if ok then tx:write(a, { v[1] + 1 }) end
+    until ok and tx:commit()
+  end
+  st:join()
+  assert(a:get()[1] == 2003)
+end
+
+do -- a log waits until another thread writes what it read
+  local a = tc.tvar(0, "shared")
+  local tx = tc.stmtx()
+  assert(tx:read(a))
+  local st = tc.newstate([[
+    local tc = require "taggedcoro"
+    local tx = tc.stmtx()
+    tx:write(..., 1)
+    assert(tx:commit())
+  ]], a)
+  tx:wait()
+  st:join()
+  assert(a:get() == 1 and not tx:validate())
+end
+
+do -- a log with a coroutine for the tag yields a descriptor instead of sleeping
+  local a = tc.tvar(0, "shared")
+  local tx = tc.stmtx()
+  assert(tx:read(a))
+  local co = tc.wrap("waiter", function ()
+    tx:wait("waiter")
+    return "changed"
+  end)
+  local ytx, fd = co()
+  assert(ytx == tx and type(fd) == "number")
+  assert(co() == tx) -- nothing changed yet
+  local other = tc.stmtx()
+  other:write(a, 1)
+  assert(other:commit())
+  assert(co() == "changed")
+end
+
+do -- a retry in an async task lets the other tasks of its run queue commit
+  local stm = require "taggedcoro.stm"
+  local a = stm.var("retried", 0, "shared")
+  local q = tc.runq()
+  local log = {}
+  q:spawn(function ()
+    stm.transaction(function ()
+      if stm.get(a) == 0 then stm.retry() end
+      log[#log + 1] = "read " .. stm.get(a)
+    end)
+  end)
+  q:spawn(function ()
+    stm.transaction(function () stm.set(a, 1) end)
+    log[#log + 1] = "set"
+  end)
+  q:run()
+  assert(table.concat(log, " ") == "set read 1")
+end
+
+do -- nested logs see their ancestors' writes and merge into the parent
+  local a, b = tc.tvar(1), tc.tvar(2)
+  local top = tc.stmtx()
+  top:write(a, 10)
+  local child = top:nest()
+  local ok, v = child:read(a)
+  assert(ok and v == 10)
+  assert(child:read(b))
+  child:write(b, 20)
+  assert(select(2, top:read(b)) == 2) -- not merged yet
+  child:merge()
+  assert(not pcall(child.read, child, a))
+  assert(not pcall(top.merge, top))
+  assert(top:commit() and a:get() == 10 and b:get() == 20)
+end
+
+do -- a failed nested log runs again after extending its ancestors
+  local a, b = tc.tvar(0), tc.tvar(0)
+  local top = tc.stmtx()
+  assert(top:read(a))
+  local child = top:nest()
+  local other = tc.stmtx()
+  other:write(b, 1)
+  assert(other:commit())
+  assert(child:read(b) == false and child:conflict() == b)
+  assert(top:extend())
+  child = top:nest()
+  local ok, v = child:read(b)
+  assert(ok and v == 1)
+  child:merge()
+  other = tc.stmtx()
+  other:write(a, 1)
+  assert(other:commit())
+  assert(not top:extend() and #top:watch() == 2)
+  top:unwatch()
+end
+
+do -- snapshots read old values, which commits drop once no snapshot needs them
+  local a, b = tc.tvar(1, "local", 2), tc.tvar("x")
+  local snap = tc.stmtx("snapshot")
+  for i = 2, 4 do
+    local tx = tc.stmtx()
+    tx:write(a, i)
+    tx:write(b, "y")
+    assert(tx:commit())
+  end
+  local ok, v = snap:read(a)
+  assert(not ok and snap:conflict() == a) -- only two old values kept
+  snap = tc.stmtx("snapshot")
+  local tx = tc.stmtx()
+  tx:write(a, 5)
+  assert(tx:commit())
+  ok, v = snap:read(a)
+  assert(ok and v == 4 and a:get() == 5)
+  assert(select(2, snap:read(b)) == "y")
+  assert(not pcall(snap.write, snap, a, 0))
+  assert(snap:commit())
+  tx = tc.stmtx()
+  tx:write(a, 6)
+  assert(tx:commit())
+  snap = tc.stmtx("snapshot")
+  assert(select(2, snap:read(a)) == 6)
+  snap:commit()
+end
+
+do -- snapshots of shared variables while another state writes them
+  local a = tc.tvar(0, "shared", 4)
+  local snap = tc.stmtx("snapshot")
+  local st = tc.newstate([[
+    local tc = require "taggedcoro"
+    local a = ...
+    for i = 1, 4 do
+      local tx = tc.stmtx()
+      tx:write(a, i)
+      assert(tx:commit())
+    end
+  ]], a)
+  st:join()
+  local ok, v = snap:read(a)
+  assert(ok and v == 0) -- the snapshot held back its value
+  assert(snap:commit())
+  snap = tc.stmtx("snapshot")
+  assert(select(2, snap:read(a)) == 4)
+end
+
+do -- gets of cached values do not go back to the log
+  local stm = require "taggedcoro.stm"
+  local a = stm.var("cached", 0)
+  local function poke(var, val)
+    local tx = tc.stmtx()
+    tx:write(var, val)
+    assert(tx:commit())
+  end
+  local runs, first, again = 0
+  stm.transaction(function ()
+    runs = runs + 1
+    first = stm.get(a)
+    if runs == 1 then poke(a, 1) end
+    again = stm.get("cached") -- a read of the log would fail
+  end)
+  assert(runs == 1 and first == 0 and again == 0)
+  local other = stm.var("other", 0)
+  stm.transaction(function ()
+    stm.setmany{ cached = 2, [other] = false }
+    assert(stm.get(a) == 2 and stm.get("other") == false)
+  end)
+  assert(a:get() == 2)
+end
+
+do -- getmany mixes cached and uncached variables in order
+  local stm = require "taggedcoro.stm"
+  local a, b, c = stm.var("ma", 1), stm.var("mb", nil), stm.var("mc", 3)
+  stm.transaction(function ()
+    assert(stm.get(c) == 3)
+    stm.set(b, 2)
+    local n = select("#", stm.getmany{ a, "mb", c, "ma" })
+    local x, y, z, w = stm.getmany{ a, "mb", c, "ma" }
+    assert(n == 4 and x == 1 and y == 2 and z == 3 and w == 1)
+    stm.set(b, nil)
+    x, y, z = stm.getmany{ c, b, a }
+    assert(x == 3 and y == nil and z == 1)
+  end)
+end
+
+do -- nested transactions inherit the cache and merge theirs into the parent
+  local stm = require "taggedcoro.stm"
+  local a, b = stm.var("na", 0), stm.var("nb", 0)
+  local runs, inner, merged = 0
+  stm.transaction(function ()
+    runs = runs + 1
+    local x = stm.get(a)
+    if runs == 1 then
+      local tx = tc.stmtx()
+      tx:write(a, 1)
+      assert(tx:commit())
+    end
+    stm.transaction(function ()
+      local y = stm.get(a) -- from the cache of the parent
+      if runs == 1 then inner = y end
+      stm.set(b, y + 10)
+    end)
+    if runs == 1 then merged = stm.get(b) end
+  end)
+  -- the first run saw the old value throughout, then failed to commit
+  assert(inner == 0 and merged == 10)
+  assert(runs == 2 and b:get() == 11)
+end
+
+do -- a conflict in a nested transaction runs only the nested one again
+  local stm = require "taggedcoro.stm"
+  local a, b = stm.var("pa", 0), stm.var("pb", 0)
+  local outer, inner = 0, 0
+  stm.transaction(function ()
+    outer = outer + 1
+    stm.get(a)
+    if outer == 1 then
+      local tx = tc.stmtx()
+      tx:write(b, 1)
+      assert(tx:commit())
+    end
+    stm.transaction(function ()
+      inner = inner + 1
+      stm.set(a, stm.get(b) + 1)
+    end)
+  end)
+  assert(outer == 1 and inner == 2 and a:get() == 2)
+end
+
+do -- the contention manager sees each abort, and the stats count them
+  local stm = require "taggedcoro.stm"
+  local a, b = stm.var("hot", 0), stm.var("cold", 0)
+  local manager, calls = stm.manager, {}
+  stm.manager = function (aborts, karma)
+    calls[#calls + 1] = { aborts, karma }
+  end
+  stm.resetstats()
+  local runs = 0
+  stm.transaction(function ()
+    runs = runs + 1
+    stm.set(b, stm.get(a) + 1)
+    if runs < 3 then
+      local tx = tc.stmtx()
+      tx:write(a, runs)
+      assert(tx:commit())
+    end
+  end)
+  stm.manager = manager
+  assert(runs == 3 and b:get() == 3)
+  assert(#calls == 2 and calls[1][1] == 1 and calls[2][1] == 2)
+  assert(calls[1][2] == 2 and calls[2][2] == 4) -- a read and a write a run
+  local s = stm.stats()
+  assert(s.commits == 1 and s.aborts == 2 and s.retries == 0)
+  assert(s.conflicts.hot == 2 and s.conflicts.cold == nil)
+  stm.resetstats()
+  s = stm.stats()
+  assert(s.commits == 0 and s.aborts == 0 and next(s.conflicts) == nil)
+  local backoff = stm.backoff(1, 4)
+  for aborts = 1, 5 do
+    local secs = backoff(aborts)
+    assert(secs >= 0 and secs <= math.min(4, 2 ^ (aborts - 1)))
+  end
+end
+
+do -- snapshots that fail end their logs, and too many at once is an error
+  local stm = require "taggedcoro.stm"
+  local a = stm.var("snapped", 0, "local", 1)
+  collectgarbage("stop") -- only ending the logs frees their slots
+  for _ = 1, 300 do
+    assert(not pcall(stm.snapshot, function () stm.get(a); error("x") end))
+  end
+  local open, ok, tx = {}
+  for i = 1, 300 do
+    ok, tx = pcall(tc.stmtx, "snapshot")
+    if not ok then break end
+    open[i] = tx
+  end
+  collectgarbage("restart")
+  assert(not ok and tx:match("too many snapshot") and #open <= 256)
+  for i = 1, #open do open[i]:abort() end
+  assert(tc.stmtx("snapshot"):commit())
+end
+
+do -- nested transactions raise and yield through the block around them
+  local stm = require "taggedcoro.stm"
+  local ex = require "taggedcoro.exception"
+  local a = stm.var("nestederror", 0)
+  local ok, err, caught
+  stm.transaction(function ()
+    stm.set(a, 1)
+    ok, err = pcall(stm.transaction, function ()
+      stm.set(a, 2)
+      error("x", 0)
+    end)
+    caught = ex.trycatch(function ()
+      stm.transaction(function () ex.throw("thrown") end)
+    end, function (resume, traceback, e) return e end)
+  end)
+  assert(not ok and err == "x" and caught == "thrown")
+  assert(a:get() == 1) -- nothing of the failed nested transactions
+end
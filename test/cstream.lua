@@ -0,0 +1,66 @@
+local stream = require "taggedcoro.stream"
+
+local produce = stream.produce
+
+local function same(t, ...)
+  local n = select("#", ...)
+  assert(#t == n, "expected " .. n .. " items, got " .. #t)
+  for i = 1, n do
+    assert(t[i] == select(i, ...), "mismatch at item " .. i)
+  end
+end
+
+do -- maps in a row fuse into one stage, and nil ends the stream
+  local s = stream.range(1, 10):map(function (x) return x + 1 end)
+                               :map(function (x) return x * 2 end)
+                               :map(function (x) if x < 16 then return x end end)
+  assert(#s.stages == 1)
+  same(s:collect(), 4, 6, 8, 10, 12, 14)
+  local f = s:filter(function (x) return x > 4 end):map(tostring)
+  assert(#f.stages == 3 and #s.stages == 1)
+  same(f:collect(), "6", "8", "10", "12", "14")
+end
+
+do -- filter, skip, take and the sinks
+  local s = stream.range(1, 20):filter(function (x) return x % 2 == 0 end)
+                               :skip(2):take(3)
+  same(s:collect(), 6, 8, 10)
+  same(s:collect(), 6, 8, 10) -- each run starts over
+  assert(s:count() == 3)
+  assert(s:fold(function (a, x) return a + x end, 0) == 24)
+  same(stream.values({ 1, 2, 3 }):skip(5):collect())
+  same(stream.range(10, 1, -3):collect(), 10, 7, 4, 1)
+  local t = {}
+  stream.from(ipairs({ "a", "b" })):each(function (k) t[#t + 1] = k end)
+  same(t, 1, 2)
+end
+
+do -- pipes and generators produce in a coroutine of their own
+  local twice = stream.range(1, 100):pipe(function (up)
+    for v in up do
+      produce(v)
+      produce(v)
+    end
+  end)
+  local t = twice:take(5):collect()
+  same(t, 1, 1, 2, 2, 3)
+  assert(twice:count() == 200)
+  local g = stream.generate(function (a, b)
+    for i = a, b do produce(i) end
+  end, 3, 5)
+  same(g:map(function (x) return -x end):collect(), -3, -4, -5)
+end
+
+do -- lines are strings unless asked for slices
+  local name = os.tmpname()
+  local f = assert(io.open(name, "wb"))
+  f:write("abc\nbcd\ncde\n")
+  f:close()
+  local t = stream.lines(name):filter(function (l) return l:match("b") end):collect()
+  same(t, "abc", "bcd")
+  local n = stream.lines(name, "\n", true):map(function (s) return #s end)
+                                         :fold(function (a, x) return a + x end, 0)
+  assert(n == 9)
+  collectgarbage()
+  os.remove(name)
+end
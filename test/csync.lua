@@ -0,0 +1,119 @@
+local tc = require "taggedcoro"
+
+do -- the mutex passes to waiters in order, and free locks never yield
+  local q = tc.runq()
+  local m = tc.mutex()
+  local log = {}
+  for i = 1, 3 do
+    q:spawn(function ()
+      m:lock()
+      log[#log + 1] = "in" .. i
+      tc.yield("async")
+      log[#log + 1] = "out" .. i
+      m:unlock()
+    end)
+  end
+  q:run()
+  assert(table.concat(log, " ") == "in1 out1 in2 out2 in3 out3")
+  assert(not m:locked())
+  m:lock() -- no task needed when it is free
+  assert(m:locked() and not m:trylock())
+  assert(not pcall(m.lock, m))
+  m:unlock()
+  assert(not pcall(m.unlock, m))
+end
+
+do
+  local q = tc.runq()
+  local s = tc.semaphore(2)
+  local active, most = 0, 0
+  for _ = 1, 5 do
+    q:spawn(function ()
+      s:acquire()
+      active = active + 1
+      most = math.max(most, active)
+      tc.yield("async")
+      active = active - 1
+      s:release()
+    end)
+  end
+  q:run()
+  assert(most == 2 and #s == 2)
+  assert(s:tryacquire(2) and not s:tryacquire())
+  s:release(2)
+  assert(not pcall(s.acquire, s, 0))
+end
+
+do -- a queued writer keeps later readers out
+  local q = tc.runq()
+  local rw = tc.rwlock()
+  local log = {}
+  local function reader(i)
+    return function ()
+      rw:rlock()
+      log[#log + 1] = "r" .. i
+      tc.yield("async")
+      rw:runlock()
+    end
+  end
+  q:spawn(reader(1))
+  q:spawn(reader(2))
+  q:spawn(function ()
+    rw:lock()
+    log[#log + 1] = "w"
+    tc.yield("async")
+    rw:unlock()
+  end)
+  q:spawn(reader(3))
+  q:run()
+  assert(table.concat(log, " ") == "r1 r2 w r3")
+  assert(rw:trylock() and not rw:tryrlock())
+  rw:unlock()
+  assert(not pcall(rw.runlock, rw))
+end
+
+do
+  local q = tc.runq()
+  local wg = tc.waitgroup()
+  local done, waited = 0, 0
+  wg:add(3)
+  for _ = 1, 3 do
+    q:spawn(function ()
+      tc.yield("async")
+      done = done + 1
+      wg:done()
+    end)
+  end
+  for _ = 1, 2 do
+    q:spawn(function () wg:wait(); waited = waited + done end)
+  end
+  q:run()
+  assert(waited == 6 and #wg == 0)
+  assert(not pcall(wg.done, wg))
+end
+
+do -- an unlock skips waiters whose task was closed
+  local q = tc.runq()
+  local m = tc.mutex()
+  local closed
+  m:lock()
+  q:spawn(function ()
+    closed = tc.running()
+    m:lock()
+    m:unlock()
+  end)
+  q:run()
+  tc.close(closed)
+  collectgarbage()
+  m:unlock()
+  assert(not m:locked())
+  local s = tc.semaphore(0)
+  q:spawn(function ()
+    closed = tc.running()
+    s:acquire()
+  end)
+  q:run()
+  tc.close(closed)
+  s:release()
+  assert(#s == 1)
+end
@@ -0,0 +1,37 @@
+local stream = require "taggedcoro.stream"
+
+local function same(t, ...)
+  local n = select("#", ...)
+  assert(#t == n, "expected " .. n .. " items, got " .. #t)
+  for i = 1, n do
+    assert(t[i] == select(i, ...), "mismatch at item " .. i)
+  end
+end
+
+local unpack = table.unpack or unpack
+
+local function range(n)
+  local t = {}
+  for i = 1, n do t[i] = i end
+  return unpack(t)
+end
+
+do -- a tee outside a coroutine grows its buffer to keep every item
+  local a, b = stream.tee(stream.range(1, 100), 2, 4)
+  same(a:collect(), range(100))
+  same(b:collect(), range(100))
+  assert(not pcall(a.collect, a))
+end
+
+do -- stream.run lets the consumers of a tee take turns
+  local pulled = 0
+  local src = stream.range(1, 100):map(function (x) pulled = pulled + 1; return x end)
+  local a, b, c = stream.tee(src, 3, 4)
+  local all, sum, first
+  stream.run(function () all = a:collect() end,
+             function () sum = b:fold(function (acc, x) return acc + x end, 0) end,
+             function () first = c:take(10):collect() end)
+  same(all, range(100))
+  same(first, range(10))
+  assert(sum == 5050 and pulled == 100)
+end
@@ -0,0 +1,130 @@
+local tc = require "taggedcoro"
+
+local name = os.tmpname()
+os.remove(name)
+
+do -- appends wait in the batch until a sync writes them
+  local w = assert(tc.wal(name))
+  local t1 = w:append("one", 1)
+  local t2 = w:append("two", 2)
+  assert(t2 == t1 + 1 and w:durable() == 0)
+  w:sync(t1)
+  assert(w:durable() == t2) -- the sync took the whole batch
+  local t = {}
+  for data, version in w:records() do t[#t + 1] = data .. version end
+  assert(table.concat(t, "|") == "one1|two2")
+  w:sync()
+  w:close()
+  assert(not pcall(w.append, w, "three"))
+end
+
+do -- syncs from several OS threads share the log and its batches
+  local w = assert(tc.wal(name))
+  local states = {}
+  for i = 1, 4 do
+    states[i] = tc.newstate([[
+      local tc = require "taggedcoro"
+      local w = assert(tc.wal(...))
+      for i = 1, 50 do w:sync(w:append("x", 0)) end
+      w:close()
+    ]], name)
+  end
+  for i = 1, 4 do states[i]:join() end
+  local n = 0
+  for data in w:records() do n = n + 1 end
+  assert(n == 202)
+  w:close()
+end
+
+do -- a torn record at the end is dropped, and versions go on from the file
+  local f = assert(io.open(name, "ab"))
+  f:write("\100\0\0\0garbage")
+  f:close()
+  local w = assert(tc.wal(name))
+  w:sync(w:append("four", 1))
+  local last, n
+  for data, version in w:records() do last, n = data, version end
+  assert(last == "four" and n == 3)
+  w:close()
+end
+
+do -- durable stm variables come back from the log
+  local stm = require "taggedcoro.stm"
+  os.remove(name)
+  stm.open(name)
+  local a = stm.durable("a", 1)
+  stm.transaction(function () stm.set(a, { n = 2 }) end)
+  stm.transaction(function () stm.set(a, { n = 3 }) end)
+  stm.open(name)
+  local b = stm.durable("a", 1)
+  assert(b:get().n == 3)
+  local c = stm.durable("c", "default")
+  assert(c:get() == "default")
+end
+
+do -- commits in other states log shared durable variables in version order
+  local stm = require "taggedcoro.stm"
+  local path = os.tmpname()
+  stm.open(path)
+  local a = stm.durable("counter", 0, "shared")
+  local states = {}
+  for i = 1, 4 do
+    states[i] = tc.newstate([[
+      local stm = require "taggedcoro.stm"
+      local a = ...
+      for i = 1, 25 do
+        stm.transaction(function () stm.set(a, stm.get(a) + 1) end)
+      end
+    ]], a)
+  end
+  for i = 1, 4 do states[i]:join() end
+  local w, last, n = assert(tc.wal(path)), -1, 0
+  for data, version in w:records() do
+    local names, vals = tc.decode(data)
+    n = n + 1
+    assert(names[1] == "counter" and vals[1] == n and version > last)
+    last = version
+  end
+  w:close()
+  assert(n == 100)
+  stm.open(path)
+  assert(stm.durable("counter", 0, "shared"):get() == 100)
+  os.remove(path)
+end
+
+do -- tasks sync durable commits while another state flushes the same log
+  local stm = require "taggedcoro.stm"
+  local path = os.tmpname()
+  stm.open(path)
+  local vars = {}
+  for i = 1, 4 do vars[i] = stm.durable("task" .. i, 0, "shared") end
+  local st = tc.newstate([[
+    local stm = require "taggedcoro.stm"
+    local a = ...
+    for i = 1, 50 do
+      stm.transaction(function () stm.set(a, stm.get(a) + 1) end)
+    end
+  ]], vars[1])
+  local q = tc.runq()
+  for i = 1, 4 do
+    q:spawn(function ()
+      for _ = 1, 25 do
+        stm.transaction(function () stm.set(vars[i], stm.get(vars[i]) + 1) end)
+      end
+    end)
+  end
+  q:run()
+  st:join()
+  assert(vars[1]:get() == 75 and vars[4]:get() == 25)
+  local tx = tc.stmtx()
+  tx:write(vars[2], "done")
+  assert(tx:commit() and tx:logged() == 1)
+  local co = tc.wrap("flush", function () tx:sync("flush"); return "synced" end)
+  local r = co()
+  while r ~= "synced" do r = co() end -- yields the log while others flush
+  stm.open(path)
+  assert(stm.durable("task2", 0, "shared"):get() == "done")
+  os.remove(path)
+end
+
+os.remove(name)